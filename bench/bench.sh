@@ -0,0 +1,143 @@
+#!/bin/sh
+# Times myshell builtins (each case one -c command line) against the
+# coreutils doing the same job, on trees generated under $BENCH_DIR:
+#
+#   files/   $BENCH_FILES empty files in one directory
+#   deep/    a chain of $BENCH_DEPTH nested directories
+#   big      a file of $BENCH_BIG_MB MiB
+#
+# Each case runs $BENCH_RUNS times and the best run is reported, as ops/s
+# (files or lines handled) or MB/s. A run that fails or writes to stderr
+# stops the bench (a fast failure is not a speedup), and both sides have
+# to agree on a count or checksum of what they did. The trees are kept
+# between runs; rm cases rebuild what they delete. BENCH_ONLY=cat,ls
+# limits the cases.
+#
+# usage: bench/bench.sh [path/to/myshell]
+
+set -eu
+
+MYSHELL=$(cd "$(dirname "${1:-./myshell}")" && pwd)/$(basename "${1:-./myshell}")
+BENCH_DIR=${BENCH_DIR:-/tmp/myshell-bench}
+BENCH_FILES=${BENCH_FILES:-1000000}
+BENCH_DEPTH=${BENCH_DEPTH:-1000}
+BENCH_BIG_MB=${BENCH_BIG_MB:-2048}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_ONLY=${BENCH_ONLY:-}
+
+[ -x "$MYSHELL" ] || { echo "bench: no myshell at $MYSHELL, run make first" >&2; exit 1; }
+mkdir -p "$BENCH_DIR"
+cd "$BENCH_DIR"
+ERRORS=$BENCH_DIR/.errors
+
+now() { date +%s%N; }
+
+make_files() {
+  [ -f files/.count ] && [ "$(cat files/.count)" = "$BENCH_FILES" ] && return
+  rm -rf files
+  mkdir files
+  (cd files && seq -f "f%.0f" 1 "$BENCH_FILES" | xargs touch)
+  echo "$BENCH_FILES" > files/.count
+}
+
+make_deep() {
+  [ -f deep.count ] && [ "$(cat deep.count)" = "$BENCH_DEPTH" ] && return
+  rm -rf deep
+  # one mkdir -p per 100 levels keeps the path under PATH_MAX
+  i=0 dir=$BENCH_DIR/deep
+  mkdir deep
+  while [ "$i" -lt "$BENCH_DEPTH" ]; do
+    sub=$(printf 'd/%.0s' $(seq 1 $((BENCH_DEPTH - i < 100 ? BENCH_DEPTH - i : 100))))
+    (cd "$dir" && mkdir -p "$sub")
+    dir=$dir/$sub
+    i=$((i + 100))
+  done
+  echo "$BENCH_DEPTH" > deep.count
+}
+
+make_big() {
+  [ -f big ] && [ "$(($(stat -c %s big) / 1048576))" = "$BENCH_BIG_MB" ] && return
+  # real data rather than a hole, so cat has pages to read
+  head -c $((BENCH_BIG_MB * 1048576)) /dev/zero | tr '\0' 'x' > big
+}
+
+# best wall time in ns over BENCH_RUNS runs of "$@", with an optional
+# setup command (BENCH_SETUP) run untimed before each one. Exits if a run
+# fails or complains
+best() {
+  best_ns=
+  run=0
+  while [ "$run" -lt "$BENCH_RUNS" ]; do
+    [ -n "${BENCH_SETUP:-}" ] && eval "$BENCH_SETUP"
+    start=$(now)
+    status=0
+    "$@" > /dev/null 2> "$ERRORS" || status=$?
+    ns=$(($(now) - start))
+    if [ "$status" -ne 0 ] || [ -s "$ERRORS" ]; then
+      echo "bench: $name: '$2' failed (exit $status):" >&2
+      head -n 5 "$ERRORS" >&2
+      exit 1
+    fi
+    [ -z "$best_ns" ] || [ "$ns" -lt "$best_ns" ] && best_ns=$ns
+    run=$((run + 1))
+  done
+  echo "$best_ns"
+}
+
+myshell_run() { "$MYSHELL" -c "$1"; }
+
+sh_run() { sh -c "$1"; }
+
+# what one more (untimed) run of "$@" comes to: its output through the
+# case's check, a filter that counts or checksums it (and may look at the tree)
+result() {
+  [ -n "${BENCH_SETUP:-}" ] && eval "$BENCH_SETUP"
+  "$@" 2> /dev/null | sh -c "$check"
+}
+
+# case NAME UNIT AMOUNT "myshell line" "coreutils line" "check"
+# UNIT is ops or MB; AMOUNT is how many of them one run handles
+bench_case() {
+  name=$1 unit=$2 amount=$3 check=$6
+  if [ -n "$BENCH_ONLY" ]; then
+    case ",$BENCH_ONLY," in *",${name%% *},"*) ;; *) return ;; esac
+  fi
+  ours=$(best myshell_run "$4")
+  theirs=$(best sh_run "$5")
+  ours_result=$(result myshell_run "$4")
+  theirs_result=$(result sh_run "$5")
+  if [ "$ours_result" != "$theirs_result" ]; then
+    echo "bench: $name: results differ: myshell '$ours_result', coreutils '$theirs_result'" >&2
+    exit 1
+  fi
+  awk -v name="$name" -v unit="$unit" -v n="$amount" -v a="$ours" -v b="$theirs" 'BEGIN {
+    ra = n / (a / 1e9); rb = n / (b / 1e9)
+    printf "%-22s %12.0f %-5s %12.0f %-5s %6.2fx\n", name, ra, unit "/s", rb, unit "/s", ra / rb
+  }'
+}
+
+echo "bench: generating trees in $BENCH_DIR" >&2
+make_files
+make_deep
+make_big
+
+printf '%-22s %18s %18s %7s\n' case myshell coreutils speedup
+bench_case "cat big" MB "$BENCH_BIG_MB" "cat big" "cat big" cksum
+bench_case "cat big | pipe" MB "$BENCH_BIG_MB" "cat big | cat" "cat big | cat" cksum
+bench_case "ls files" ops "$BENCH_FILES" "ls files" "ls -lUA files" \
+  "grep -c -e '^-' -e '\[FILE\]'"
+bench_case "stat files/*" ops "$BENCH_FILES" "stat files/*" \
+  "find files -mindepth 1 ! -name '.*' -print0 | xargs -0 stat" "grep -c 'File:'"
+bench_case "du files" ops "$BENCH_FILES" "du -s files" "du -s files" cat
+bench_case "find deep" ops "$BENCH_DEPTH" "find deep" "find deep" "wc -l"
+bench_case "du deep" ops "$BENCH_DEPTH" "du -s deep" "du -s deep" cat
+
+# rm deletes its input, so each run gets a fresh copy
+BENCH_SETUP='rm -rf victim && cp -al files victim'
+bench_case "rm -r files" ops "$BENCH_FILES" "rm -r victim" "rm -r victim" \
+  "cat; [ -e victim ] && echo left || echo gone"
+BENCH_SETUP='rm -rf victim && cp -a deep victim'
+bench_case "rm -r deep" ops "$BENCH_DEPTH" "rm -r victim" "rm -r victim" \
+  "cat; [ -e victim ] && echo left || echo gone"
+BENCH_SETUP=
+rm -rf victim "$ERRORS"
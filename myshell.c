@@ -5,12 +5,16 @@
  * @brief Acts as a simple command line interpreter.  It reads commands from
  *        standard input entered from the terminal and executes them. The
  *        shell does not include any provisions for control structures,
- *        redirection, background processes, environmental variables, pipes,
- *        or other advanced properties of a modern shell. All commands are
- *        implemented internally and do not rely on external system programs.
+ *        job control, environmental variables, or other advanced
+ *        properties of a modern shell beyond simple pipelines, background
+ *        jobs and < > >> 2> 2>> redirection. The common file commands are implemented internally;
+ *        anything else is run as an external program found on PATH.
+ *        With --serve it runs the commands of clients on a unix socket.
  *
  */
 
+#define _GNU_SOURCE
+
 #include <pwd.h>
 #include <time.h>
 #include <ctype.h>
@@ -24,394 +28,11640 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <stdatomic.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <termios.h>
+#include <poll.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//intrinsics for the SSE2/AVX2 (or NEON) byte scanners of grep, wc, head and tail
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
 
-#define BUFFER_SIZE          256
-#define MAX_PATH_LENGTH      256
-#define MAX_FILENAME_LENGTH  256
+//io_uring is used for batched stats when the headers have it. Build with
+//-DMYSHELL_NO_IO_URING to leave it out and only use the synchronous path
+#if !defined(MYSHELL_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
 
-static char buffer[BUFFER_SIZE] = {0};
-static char filename[MAX_FILENAME_LENGTH] = {0};
+//reflinks, from linux/fs.h, which older or trimmed headers don't have
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define CAT_BUFFER_SIZE      (128 * 1024)
+#define CAT_CHUNK_SIZE       (1 << 30)
+#define CAT_MMAP_WINDOW      ((size_t)256 << 20)
+#define DIRENT_BUFFER_SIZE   (256 * 1024)
+#define URING_ENTRIES        256
+#define OUT_BUFFER_SIZE      (64 * 1024)
+#define DIRECT_ALIGN         4096
+#define WALK_CHUNK_SIZE      (1024 * 1024)
+#define WALK_MAX_THREADS     256
+#define WALK_FD_STRIDE       8
+#define COMMAND_HASH_SIZE    256
+#define ARENA_BLOCK_SIZE     (64 * 1024)
+#define READER_BLOCK_SIZE    (1024 * 1024)
+#define PATH_HASH_SIZE       64
+#define BATCH_SLICE_MIN      512
+#define BATCH_RUN_MAX        256
+#define GLOB_CACHE_SIZE      64
+#define GLOB_RACY_NS         100000000LL
+#define STATS_BUCKETS        252
+#define META_DIR_HASH        256
+#define CP_CHUNK_MIN         ((off_t)16 << 20)
+#define PROMPT_HASH_SIZE     64
+#define PROMPT_CACHE_MAX     512
+#define TRI_BITS             20
+#define COMPLETE_ASK         100
+#define TRI_BUCKETS          ((size_t)1 << TRI_BITS)
+#define SERVE_BACKLOG        128
+#define SERVE_READ_SIZE      (64 * 1024)
+#define SERVE_REQUEST_MAX    (1024 * 1024)
+#define SERVE_QUEUE_MAX      (1024 * 1024)
+#define DU_INDEX_MAGIC       "myshdu1\n"
 
 // Implements various UNIX commands using POSIX system calls
-// Each must return an integer value indicating success or failure
-int do_cat(const char* filename);
-int do_cd(char* dirname);
-int do_ls(const char* dirname);
-int do_mkdir(const char* dirname);
-int do_pwd(void);
-int do_rm(const char* filename);
-int do_rmdir(const char* dirname);
-int do_stat(char* filename);
-int execute_command(char* buffer);
-DIR* d;
-  
+// Each must return an integer value indicating success or failure, and
+// takes the words after the command name (checked against the command table)
+int do_cat(int argc, char** argv);
+int do_cd(int argc, char** argv);
+int do_ls(int argc, char** argv);
+int do_mkdir(int argc, char** argv);
+int do_pwd(int argc, char** argv);
+int do_rm(int argc, char** argv);
+int do_cp(int argc, char** argv);
+int do_rmdir(int argc, char** argv);
+int do_stat(int argc, char** argv);
+int do_set(int argc, char** argv);
+int do_du(int argc, char** argv);
+int do_find(int argc, char** argv);
+int do_exit(int argc, char** argv);
+int do_rehash(int argc, char** argv);
+int do_export(int argc, char** argv);
+int do_jobs(int argc, char** argv);
+int do_wait(int argc, char** argv);
+int do_fg(int argc, char** argv);
+int do_parallel(int argc, char** argv);
+int do_stats(int argc, char** argv);
+int do_grep(int argc, char** argv);
+int do_head(int argc, char** argv);
+int do_tail(int argc, char** argv);
+int do_wc(int argc, char** argv);
+int do_hash(int argc, char** argv);
+int do_cache(int argc, char** argv);
+int do_history(int argc, char** argv);
+int execute_command(const char* line, size_t len);
+void jobs_notify(void);
+void stats_enable_json(const char* path);
+
 /*
-* @brief  used in the ls function for identifying if an entry is a 
-*         file or directory
-*@return "DIR" if a directory and "FILE" otherwise
+* @brief  runtime knobs changed with the set builtin. Sizes are byte counts,
+*         modes are an index into the tunable's list of choices
 */
-static const char* file_or_dir(mode_t mode)
-{
-  return S_ISDIR(mode) ? "DIR" : "FILE";
-}
+enum cat_mode { CAT_MODE_AUTO, CAT_MODE_MMAP, CAT_MODE_ZEROCOPY, CAT_MODE_BUFFERED };
+static const char* const cat_mode_names[] = { "auto", "mmap", "zerocopy", "buffered", NULL };
+
+static long long cat_mode = CAT_MODE_AUTO;
+static long long cat_zerocopy_min = 64 << 10;
+static long long cat_mmap_min = 8 << 20;
+static long long cat_buffer_size = CAT_BUFFER_SIZE;
+
+enum stat_backend { STAT_BACKEND_SYNC, STAT_BACKEND_IO_URING };
+static const char* const stat_backend_names[] = { "sync", "io_uring", NULL };
+#ifdef HAVE_IO_URING
+static long long stat_backend = STAT_BACKEND_IO_URING;
+#else
+static long long stat_backend = STAT_BACKEND_SYNC;
+#endif
+
+enum walk_order { WALK_ORDER_COMPLETION, WALK_ORDER_SORTED };
+static const char* const walk_order_names[] = { "completion", "sorted", NULL };
+static long long walk_threads = 0;
+static long long walk_order = WALK_ORDER_COMPLETION;
+
+static long long pipe_size = 0;
+
+static long long cp_split_min = 64 << 20;
+
+static long long direct_output = 0;
+static long long meta_cache = 0;
+static long long meta_cache_max = 1000000;
+
+enum simd_level { SIMD_AUTO, SIMD_BASELINE, SIMD_OFF };
+static const char* const simd_names[] = { "auto", "baseline", "off", NULL };
+static long long simd_level = SIMD_AUTO;
+
+static const char* const off_on_names[] = { "off", "on", NULL };
+static long long stats_io = 0;
+
+static long long prompt_show_git = 1;
+static long long prompt_show_status = 1;
+static long long prompt_duration = 1000;
+static long long prompt_wait = 0;
+
+struct tunable {
+  const char* name;
+  long long* value;
+  const char* const* choices; //NULL for plain numbers
+  long long min, max;         //allowed range for plain numbers
+  const char* help;
+};
+
+static const struct tunable tunables[] = {
+  { "cat_mode", &cat_mode, cat_mode_names, 0, 0,
+    "how cat moves data: auto picks by size, or force one method" },
+  { "cat_zerocopy_min", &cat_zerocopy_min, NULL, 0, LLONG_MAX,
+    "files at least this big use copy_file_range/splice/sendfile" },
+  { "cat_mmap_min", &cat_mmap_min, NULL, 0, LLONG_MAX,
+    "files at least this big are mmapped when zero-copy is not possible" },
+  { "cat_buffer_size", &cat_buffer_size, NULL, 1, CAT_BUFFER_SIZE,
+    "read/write chunk of the buffered loop" },
+  { "stat_backend", &stat_backend, stat_backend_names, 0, 0,
+    "how ls and stat look up batches of entries (io_uring falls back to sync)" },
+  { "walk_threads", &walk_threads, NULL, 0, WALK_MAX_THREADS,
+    "threads for recursive builtins (ls -R, du, find), 0 for one per CPU" },
+  { "walk_order", &walk_order, walk_order_names, 0, 0,
+    "recursive output in completion order (fastest) or sorted by path" },
+  { "pipe_size", &pipe_size, NULL, 0, INT_MAX,
+    "capacity of the pipes between pipeline stages (F_SETPIPE_SZ), 0 for the default" },
+  { "cp_split_min", &cp_split_min, NULL, 0, LLONG_MAX,
+    "files at least this big are copied by several threads at once, 0 never" },
+  { "direct_output", &direct_output, off_on_names, 0, 0,
+    "open files for > with O_DIRECT, written in whole aligned blocks" },
+  { "meta_cache", &meta_cache, off_on_names, 0, 0,
+    "answer repeated stat and ls from memory, kept up to date with inotify" },
+  { "meta_cache_max", &meta_cache_max, NULL, 1, INT_MAX,
+    "entries the metadata cache holds before it starts over" },
+  { "simd", &simd_level, simd_names, 0, 0,
+    "byte scanners for grep/wc/head/tail: auto, baseline (SSE2 or NEON) or off" },
+  { "prompt_git", &prompt_show_git, off_on_names, 0, 0,
+    "show the git branch in the prompt, found by a worker thread and cached per directory" },
+  { "prompt_status", &prompt_show_status, off_on_names, 0, 0,
+    "show the exit status of the last command in the prompt when it failed" },
+  { "prompt_duration", &prompt_duration, NULL, 0, INT_MAX,
+    "show how long the last command took when it was at least this many ms, 0 never" },
+  { "prompt_wait", &prompt_wait, NULL, 0, 1000,
+    "ms the prompt waits for a segment it has no answer for yet, 0 never" },
+  { "stats_io", &stats_io, off_on_names, 0, 0,
+    "count read/write syscalls and bytes per command for stats (costs 2 reads of /proc each)" },
+};
 
 /*
-*@brief file type helper for the ls function
-*@return a string noting the file type
-*
+* @brief  buffered output used by every builtin instead of stdio. Text is
+*         collected in one big buffer and handed to the kernel when it fills
+*         up, or at the end of each line when the output is a terminal so
+*         interactive output still shows up right away
 */
-static const char* ftype_string(mode_t mode) 
-{
-  switch (mode & S_IFMT)
-  {
-    case S_IFREG: return "regular";
-    case S_IFDIR: return "directory";
-    case S_IFLNK: return "symlink";
-    case S_IFCHR: return "char-device";
-    case S_IFBLK: return "block-device";
-    case S_IFIFO: return "fifo";
-    case S_IFSOCK: return "socket";
-    default:      return "unknown";
-  }
-}
+struct outbuf {
+  int fd;
+  bool tty;
+  bool direct;           //fd is O_DIRECT, so only whole aligned blocks are written
+  pthread_mutex_t* lock; //taken around writes when threads share the fd
+  size_t len;
+  char data[OUT_BUFFER_SIZE] __attribute__((aligned(DIRECT_ALIGN)));
+};
 
+static struct outbuf out_stdout = { STDOUT_FILENO, false, false, NULL, 0, {0} };
 
+/*
+* @brief  bump allocator for everything that only lives as long as one
+*         command (the words of the command line, mostly). Blocks are kept
+*         when the arena is reset, so once it has grown to fit the biggest
+*         command the main loop doesn't malloc or free at all
+*/
+struct arena_block {
+  struct arena_block* next;
+  size_t used, cap;
+  char data[];
+};
 
-/**
- * @brief  Removes extraneous whitespace at the end of a command to avoid
- *         parsing problems
- * @param  Char array representing the command entered
- * @return None
- */
-void strip_trailing_whitespace(char* string) {
-  int i = strnlen(string, BUFFER_SIZE) - 1;
-  
-  while(isspace(string[i]))
-    string[i--] = 0;
-}
-
-/**
- * @brief Displays a command prompt including the current working directory
- */
-void display_prompt(void) {
-  char current_dir[MAX_PATH_LENGTH];
-  
-  if (getcwd(current_dir, sizeof(current_dir)) != NULL)
-    // Outputs the current working directory in bold green text (\033[32;1m)
-    // \033 is the escape sequence for changing text, 32 is green, 1 is bold
-    fprintf(stdout, "myshell:\033[32;1m%s\033[0m> ", current_dir);
-}
+struct arena {
+  struct arena_block* first;
+  struct arena_block* current;
+};
 
-/**
- * @brief  Main program function
- * @param  Not used
- * @return EXIT_SUCCESS is always returned
- */
-int main(int argc, char** argv) {
-  while (true) {
-    display_prompt();
-    
-    // Read a line representing a command to execute from stdin into 
-    // a character array
-    if (fgets(buffer, BUFFER_SIZE, stdin) != 0) {
-      
-      // Clean up sloppy user input
-      strip_trailing_whitespace(buffer);
-      
-      //Reset filename buffer after each command execution
-      bzero(filename, MAX_FILENAME_LENGTH);     
-      
-      // As in most shells, "cd" and "exit" are special cases that need
-      // to be handled separately
-      if ((sscanf(buffer, "cd %s", filename) == 1) ||
-	  (!strncmp(buffer, "cd", BUFFER_SIZE))) 
-	do_cd(filename);
-      else if (!strncmp(buffer, "exit", BUFFER_SIZE)) 
-	exit(EXIT_SUCCESS);
-      else 
-	execute_command(buffer);
-    }
-  }
-  
-  return EXIT_SUCCESS;
-}
+/*
+* @brief  what a running command works with, instead of globals: the
+*         buffer its output goes through, its input, where its error
+*         messages go (its 2> file, or NULL for the shell's own stderr) and
+*         the fd under that for the programs it starts, and the arena its
+*         words live in. A pipeline stage, a redirected builtin and a
+*         --serve request each run in one of their own, and the threads a
+*         command starts share its context for their error messages
+*/
+struct exec_ctx {
+  struct outbuf* out;
+  int in_fd;
+  FILE* err_stream;
+  int err_fd;
+  struct arena* arena;
+};
 
-/**
- * @brief  Changes the current working directory
- * @param  Char array representing the directory to change to, or if empty
- *         use the user's home directory
- * @return -1 on error, 0 on success
- */
-int do_cd(char* dirname) {
-  struct passwd *p = getpwuid(getuid());
+static struct arena shell_arena = { NULL, NULL };
+static struct exec_ctx shell_ctx = { &out_stdout, STDIN_FILENO, NULL, STDERR_FILENO,
+                                     &shell_arena };
 
-  // If no argument, change to current user's home directory
-  if (strnlen(dirname, MAX_PATH_LENGTH) == 0)
-      strncpy(dirname, p->pw_dir, MAX_PATH_LENGTH);
+//the context of the command running on this thread
+static __thread struct exec_ctx* ctx = &shell_ctx;
 
-  // Otherwise, change to directory specified and check for error
-  if (chdir(dirname) < 0) {
-    fprintf(stderr, "cd: %s\n", strerror(errno));
-    return -1;
-  }
-  
-  return 0;
+/*
+*@brief  where errors are reported: the running command's error stream, or
+*        stderr when it has none
+*/
+static FILE* err_out(void)
+{
+  return ctx->err_stream ? ctx->err_stream : stderr;
 }
 
-/**
- * @brief  Lists the contents of a directory
- * @param  Name of directory to list, or if empty, use current working directory
- * @return -1 on error, 0 on success
- * Notes: lstat > stat because it's apparently better for identifying file types, aka lsat is more portable and reliable
- * I added functionality to list whether each entry is a file or a directory, as well as what type of file it would be if not a directory 
- * (note ftype_string) above, and then list the num of bytes each entry takes up
- */ 
-int do_ls(const char* dirname) {
-  //normalize input
-  //if dirname is null or empty string, use ">""
-  const char* dir = (dirname && dirname[0]) ? dirname : ".";
-
-  DIR* d = opendir(dir);
-  if (!d)
+/*
+*@brief  writes all len bytes of data, retrying short writes and EINTR
+*@return 0 on success, -1 on error
+*/
+static int write_all(int fd, const char* data, size_t len)
+{
+  while (len > 0)
   {
-    fprintf(stderr, "Could not open directory %s %s\n", dirname, strerror(errno));
-    return -1;
+    ssize_t n = write(fd, data, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
   }
+  return 0;
+}
 
-  struct dirent* entry;
-  errno = 0; //do this for error handling later to distinguish end of stream from error
+/*
+*@brief  writes two pieces of data with as few writev calls as possible,
+*        retrying short writes and EINTR
+*@return 0 on success, -1 on error
+*/
+static int writev_all(int fd, const char* first, size_t first_len,
+                      const char* second, size_t second_len)
+{
+  struct iovec iov[2] = {
+    { (void*)first, first_len },
+    { (void*)second, second_len },
+  };
+  struct iovec* cur = iov;
+  int count = 2;
 
-  while ((entry = readdir(d)) != NULL)
+  while (count > 0)
   {
-    //build a full path to the entry for lstat call
-    //snprintf into a fixed buffer, then check for truncation with n>= buffer or any format errors
-    char path[PATH_MAX];
-    int n = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
-    if (n < 0 || (size_t)n >= sizeof(path)) 
+    ssize_t n = writev(fd, cur, count);
+    if (n < 0)
     {
-      fprintf(stderr, "path too long: %s/%s\n", dir, entry->d_name); //if it doesn't fit, note it but move on
-      continue;
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
-
-    struct stat st;
-    if (lstat(path, &st) != 0) //get the data if symlink
+    while (count > 0 && (size_t)n >= cur->iov_len)
     {
-      fprintf(stderr, "lstat failed for '%s': %s\n", path, strerror(errno));
-      continue;
+      n -= cur->iov_len;
+      cur++;
+      count--;
+    }
+    if (count > 0)
+    {
+      cur->iov_base = (char*)cur->iov_base + n;
+      cur->iov_len -= (size_t)n;
     }
-
-    //get dir/file label and file type
-    const char* fod = file_or_dir(st.st_mode);
-    const char* ftype = ftype_string(st.st_mode);
-    off_t size = st.st_size; //bytes of the file
-
-    //omg this one line took eighteen years
-    printf("%s\t[%s]\t(type=%s)\tsize=%jd bytes \n", entry->d_name, fod, ftype, (intmax_t)size);
   }
+  return 0;
+}
 
-  //post loop error check
-  if (errno != 0) //error not just end of stream here!
-  {
-    fprintf(stderr, "Error reading directory %s :  %s\n", dir, strerror(errno));
-    closedir(d);
-    return -1;
-  }
+/*
+*@brief  points an output buffer at a file descriptor
+*/
+static void out_init(struct outbuf* o, int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  o->fd = fd;
+  o->tty = isatty(fd);
+  o->direct = flags >= 0 && (flags & O_DIRECT);
+  o->lock = NULL;
+  o->len = 0;
+}
 
-  if (closedir(d) != 0)
-  {
-    fprintf(stderr, "error closing directory %s :  %s\n", dir, strerror(errno));
-    return -1;
-  }
-  return 0;
+/*
+*@brief  allocates an output buffer, aligned for O_DIRECT
+*@return the buffer, or NULL if out of memory
+*/
+static struct outbuf* out_alloc(void)
+{
+  return aligned_alloc(__alignof__(struct outbuf), sizeof(struct outbuf));
 }
 
-/**
- * @brief  Outputs the contents of a single ordinary file
- * @param  Name of file whose contents should be output
- * @return -1 on error, 0 on success
- */
-int do_cat(const char* filename) {
-  //take names of files as input and print entire contents of each, in sequential order
-  int sourcefd = open(filename, O_RDONLY, 0);
-  if (sourcefd < 0) //source file not opened, failure
+/*
+*@brief  hands everything buffered so far to the kernel
+*@return 0 on success, -1 on error
+*/
+static int out_flush(struct outbuf* o)
+{
+  size_t len = o->len;
+  int status = 0;
+
+  //whoever flushes may write to the fd next, or end the output here, and
+  //neither can keep to O_DIRECT's alignment: the whole blocks go out as
+  //they are, and the rest without O_DIRECT
+  if (o->direct)
   {
-    fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
-    close(sourcefd);
-    return -1;
+    size_t whole = len / DIRECT_ALIGN * DIRECT_ALIGN;
+    int flags = fcntl(o->fd, F_GETFL);
+    o->direct = false;
+    o->len = 0;
+    if (write_all(o->fd, o->data, whole) < 0 ||
+        (flags >= 0 && fcntl(o->fd, F_SETFL, flags & ~O_DIRECT) < 0))
+      return -1;
+    return write_all(o->fd, o->data + whole, len - whole);
   }
 
-  int countr = 1;
-  int exitLoop = 1;
-  while (exitLoop == 1)
+  o->len = 0;
+  if (len == 0)
+    return 0;
+  if (o->lock)
+    pthread_mutex_lock(o->lock);
+  status = write_all(o->fd, o->data, len);
+  if (o->lock)
+    pthread_mutex_unlock(o->lock);
+  return status;
+}
+
+/*
+*@brief  appends len bytes. Anything too big to be worth copying goes out in
+*        the same writev as the buffered text in front of it
+*@return 0 on success, -1 on error
+*/
+static int out_write(struct outbuf* o, const char* data, size_t len)
+{
+  //with O_DIRECT the buffer is only ever written out full, so every write
+  //is whole aligned blocks (nothing else shares a direct fd)
+  while (o->direct && len > 0)
   {
-    countr = read(sourcefd, buffer, BUFFER_SIZE);
-    if (countr < 0) //error reading data
+    size_t n = sizeof(o->data) - o->len < len ? sizeof(o->data) - o->len : len;
+    memcpy(o->data + o->len, data, n);
+    o->len += n;
+    data += n;
+    len -= n;
+    if (o->len == sizeof(o->data))
     {
-        fprintf(stderr, "Error reading data from %s: %s\n", filename, strerror(errno));
+      o->len = 0;
+      if (write_all(o->fd, o->data, sizeof(o->data)) < 0)
         return -1;
     }
-    else if (countr == 0) //file empty now
-    {
-      fprintf(stdout, "\n");
-      exitLoop = 0;
-    }
-    else
-    {
-      fwrite(buffer, BUFFER_SIZE, BUFFER_SIZE -1, stdout);
-      fflush(stdout);
-      //printf("%s\n", buffer);
-    }
   }
+  if (len == 0)
+    return 0;
 
-  //close the file
-  int sourceCloseSucc = close(sourcefd);
-  if (sourceCloseSucc < 0) 
+  if (len > sizeof(o->data) - o->len)
   {
-      fprintf(stderr, "Error closing source file %s: %s\n", filename, strerror(errno));
-      exit-1;
+    if (len >= sizeof(o->data) / 2)
+    {
+      size_t buffered = o->len;
+      o->len = 0;
+      if (o->lock)
+        pthread_mutex_lock(o->lock);
+      int status = writev_all(o->fd, o->data, buffered, data, len);
+      if (o->lock)
+        pthread_mutex_unlock(o->lock);
+      return status;
+    }
+    if (out_flush(o) < 0)
+      return -1;
   }
 
-  close(sourcefd);
+  memcpy(o->data + o->len, data, len);
+  o->len += len;
+  if (o->tty && memchr(data, '\n', len))
+    return out_flush(o);
+  return 0;
 }
 
-/**
- * @brief  Creates a new directory
- * @param  Name of directory to create
- * @return -1 on error, 0 on success
- */
-int do_mkdir(const char* dirname) {
+/*
+*@brief  appends a NUL terminated string
+*/
+static int out_str(struct outbuf* o, const char* s)
+{
+  return out_write(o, s, strlen(s));
+}
 
-  //creates a new directory named dirname with read, write, and search permissions for owner and group
-  int status = mkdir(dirname, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  if (status == -1)
+/*
+*@brief  formats value in decimal into the bytes just before end
+*@return pointer to the first digit
+*/
+static char* format_uint(char* end, uintmax_t value)
+{
+  do
   {
-    fprintf(stderr, "Error creating directory %s %s\n", dirname, strerror(errno));
+    *--end = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  return end;
+}
+
+/*
+*@brief  appends an unsigned number in decimal, formatted by hand
+*/
+static int out_uint(struct outbuf* o, uintmax_t value)
+{
+  char digits[24];
+  char* p = format_uint(digits + sizeof(digits), value);
+  return out_write(o, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/*
+*@brief  appends a signed number in decimal, formatted by hand
+*/
+static int out_int(struct outbuf* o, intmax_t value)
+{
+  if (value >= 0)
+    return out_uint(o, (uintmax_t)value);
+  if (out_write(o, "-", 1) < 0)
     return -1;
-  }
-  return 0;
+  return out_uint(o, -(uintmax_t)value);
 }
 
-/**
- * @brief  Removes an existing directory
- * @param  Name of directory to remove
- * @return -1 on error, 0 on success
- */
-int do_rmdir(const char* dirname) {
-  int status = rmdir(dirname);
-  if (status == -1)
+/*
+* @brief  a growable string, used to put a line together before it is
+*         handed over in one piece (so lines from different threads never
+*         interleave). Allocation failures are sticky: the string stops
+*         growing and failed is set
+*/
+struct strbuf {
+  char* data;
+  size_t len, cap;
+  bool failed;
+};
+
+/*
+*@brief  makes room for extra more bytes plus a terminating NUL
+*@return 0 on success, -1 if out of memory
+*/
+static int sb_reserve(struct strbuf* sb, size_t extra)
+{
+  if (sb->failed)
+    return -1;
+  if (sb->len + extra + 1 <= sb->cap)
+    return 0;
+
+  size_t cap = sb->cap ? sb->cap : 256;
+  while (cap < sb->len + extra + 1)
+    cap *= 2;
+  char* grown = realloc(sb->data, cap);
+  if (!grown)
   {
-    fprintf(stderr, "Error removing directory %s %s\n", dirname, strerror(errno));
+    sb->failed = true;
     return -1;
   }
+  sb->data = grown;
+  sb->cap = cap;
   return 0;
 }
 
-/**
- * @brief  Outputs the name of the current working directory
- * @return Cannot fail. Always returns 1.
- */
-int do_pwd(void) {
-char current_dir[MAX_PATH_LENGTH];
-if (getcwd(current_dir, sizeof(current_dir)) != NULL)
+/*
+*@brief  appends len bytes and keeps the string NUL terminated
+*/
+static void sb_write(struct strbuf* sb, const char* data, size_t len)
 {
-  fprintf(stdout, "myshell:\033[32;1m%s\033[0m> ", current_dir);
+  if (sb_reserve(sb, len) < 0)
+    return;
+  memcpy(sb->data + sb->len, data, len);
+  sb->len += len;
+  sb->data[sb->len] = '\0';
 }
-else
+
+/*
+*@brief  appends a NUL terminated string
+*/
+static void sb_str(struct strbuf* sb, const char* s)
 {
-  fprintf(stderr, "Error outputting current directory: %s\n", strerror(errno));
-  return -1;
+  sb_write(sb, s, strlen(s));
 }
-fprintf(stdout, "\n");
-return 0;
+
+/*
+*@brief  appends an unsigned number in decimal
+*/
+static void sb_uint(struct strbuf* sb, uintmax_t value)
+{
+  char digits[24];
+  char* p = format_uint(digits + sizeof(digits), value);
+  sb_write(sb, p, (size_t)(digits + sizeof(digits) - p));
 }
 
+/*
+*@brief  hands out size bytes, aligned for any type, valid until the next
+*        arena_reset
+*@return the memory, or NULL if out of memory
+*/
+static void* arena_alloc(struct arena* a, size_t size)
+{
+  const size_t align = _Alignof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
 
-/**
- * @brief  Removes (unlinks) a file
- * @param  Name of file to delete
- * @return -1 on error, 0 on success
- */
-int do_rm(const char* filename) {
-  int status = unlink(filename);
-  if (status == -1)
+  //look for room in the current block and the (already reset) ones after it
+  for (struct arena_block* b = a->current; b; b = b->next)
   {
-    fprintf(stderr, "Error removing file %s %s\n", filename, strerror(errno));
-    return -1;
+    if (b->cap - b->used >= size)
+    {
+      void* p = b->data + b->used;
+      b->used += size;
+      a->current = b;
+      return p;
+    }
   }
-  return 0;
-}
 
-/**
- * @brief  Outputs information about a file
- * @param  Name of file to stat
- * @return -1 on error, 0 on success
- */
-int do_stat(char* filename) {
-  struct stat sb;
-  stat(filename, &sb);
+  size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+  struct arena_block* b = malloc(sizeof(*b) + cap);
+  if (!b)
+    return NULL;
+  b->used = size;
+  b->cap = cap;
 
-  if (stat(filename, &sb) == -1)
+  //new blocks go right after the current one so the reset ones behind it
+  //are still found next time
+  if (a->current)
   {
-    fprintf(stdout, "Error outputting stat: %s, %s\n", filename, strerror(errno));
-    return -1;
+    b->next = a->current->next;
+    a->current->next = b;
   }
   else
   {
-    fprintf(stdout, "File: %s\n", filename);
-    fprintf(stdout, "Size: %ld bytes\t", (long) sb.st_blksize);
-    fprintf(stdout, "Blocks: %ld\t", (long) sb.st_blocks);
-    fprintf(stdout, "Links: %ld\n", (long) sb.st_nlink);
-
-    fprintf(stdout, "Inode: %ld\n", (long) sb.st_ino);
-    fprintf(stdout, "Time Modified: %s\n", ctime(&sb.st_mtime));
+    b->next = NULL;
+    a->first = b;
   }
-
+  a->current = b;
+  return b->data;
 }
 
-/**
- * @brief  Executes a shell command. Checks for invalid commands.
- * @param  Char array representing the command to execute
- * @return Return value of command being executed, or -1 for invalid command
- */
-int execute_command(char* buffer)  {
-  if (sscanf(buffer, "cat %s", filename) == 1) {
-    return do_cat(filename);
-  }
-  
-  if (sscanf(buffer, "stat %s", filename) == 1) {
-    return do_stat(filename);
-  }
-  
-  if (sscanf(buffer, "mkdir %s", filename) == 1) {
-    return do_mkdir(filename);
-  }
-  
-  if (sscanf(buffer, "rmdir %s", filename) == 1) {
-    return do_rmdir(filename);
-  }
+/*
+*@brief  frees everything handed out since the last reset, keeping the blocks
+*/
+static void arena_reset(struct arena* a)
+{
+  for (struct arena_block* b = a->first; b; b = b->next)
+    b->used = 0;
+  a->current = a->first;
+}
   
-  if (sscanf(buffer, "rm %s", filename) == 1) {
-    return do_rm(filename);
-  }
- 
-  if ((sscanf(buffer, "ls %s", filename) == 1) ||
-      (!strncmp(buffer, "ls", BUFFER_SIZE))) {
-    if (strnlen(filename, BUFFER_SIZE) == 0)
-      sprintf(filename, ".");
+/*
+* @brief  used in the ls function for identifying if an entry is a 
+*         file or directory
+*@return "DIR" if a directory and "FILE" otherwise
+*/
+static const char* file_or_dir(mode_t mode)
+{
+  return S_ISDIR(mode) ? "DIR" : "FILE";
+}
 
-    return do_ls(filename);
+/*
+*@brief file type helper for the ls function
+*@return a string noting the file type
+*
+*/
+static const char* ftype_string(mode_t mode) 
+{
+  switch (mode & S_IFMT)
+  {
+    case S_IFREG: return "regular";
+    case S_IFDIR: return "directory";
+    case S_IFLNK: return "symlink";
+    case S_IFCHR: return "char-device";
+    case S_IFBLK: return "block-device";
+    case S_IFIFO: return "fifo";
+    case S_IFSOCK: return "socket";
+    default:      return "unknown";
   }
+}
 
-  if (!strncmp(buffer, "pwd", BUFFER_SIZE)) {
-    return do_pwd();
-  }
 
-  // Invalid command
-  if (strnlen(buffer, BUFFER_SIZE) != 0)
-    fprintf(stderr, "myshell: %s: No such file or directory\n", buffer);
 
-  return -1;
+/*
+* @brief  operators come back from tokenize as pointers into this table, so
+*         a quoted "|" (which is copied into the word text) is never taken
+*         for one
+*/
+enum shell_op { OP_PIPE, OP_BACKGROUND, OP_IN, OP_OUT, OP_APPEND, OP_ERR, OP_ERR_APPEND,
+                NUM_OPS };
+static char shell_ops[NUM_OPS][4] = { "|", "&", "<", ">", ">>", "2>", "2>>" };
+
+/*
+*@brief  tells whether a word from tokenize is the given operator
+*/
+static bool is_op(const char* word, enum shell_op op)
+{
+  return word == shell_ops[op];
+}
+
+/*
+*@brief  tells whether a word from tokenize is any operator at all
+*/
+static bool is_any_op(const char* word)
+{
+  for (int op = 0; op < NUM_OPS; op++)
+    if (word == shell_ops[op])
+      return true;
+  return false;
+}
+
+/*
+*@brief  recognizes an operator at line[i]
+*@return the operator, or NUM_OPS if there is none; *oplen is its length
+*/
+static enum shell_op op_at(const char* line, size_t len, size_t i, size_t* oplen)
+{
+  enum shell_op op = NUM_OPS;
+  size_t n = 1;
+
+  if (line[i] == '|')
+    op = OP_PIPE;
+  else if (line[i] == '&')
+    op = OP_BACKGROUND;
+  else if (line[i] == '<')
+    op = OP_IN;
+  else if (line[i] == '>')
+    op = i + 1 < len && line[i + 1] == '>' ? OP_APPEND : OP_OUT;
+  else if (line[i] == '2' && i + 1 < len && line[i + 1] == '>')
+    op = i + 2 < len && line[i + 2] == '>' ? OP_ERR_APPEND : OP_ERR;
+  if (op != NUM_OPS)
+    n = strlen(shell_ops[op]);
+  *oplen = n;
+  return op;
+}
+
+/*
+*@brief  takes the \ escapes out of a word in pattern form, in place
+*@return the new length
+*/
+static size_t glob_unescape(char* word)
+{
+  char* to = word;
+  for (const char* from = word; *from; from++)
+  {
+    if (*from == '\\' && from[1])
+      from++;
+    *to++ = *from;
+  }
+  *to = '\0';
+  return (size_t)(to - word);
+}
+
+/**
+ * @brief  Splits a command line into words, the way a POSIX shell would for
+ *         simple commands: words are separated by unquoted blanks, a
+ *         backslash takes the next character literally, '...' keeps
+ *         everything as is, and "..." only lets \ escape " \ $ ` and a
+ *         newline. An unquoted # at the start of a word starts a comment.
+ *         An unquoted | & < > >> (and 2> 2>> at the start of a word) is
+ *         a word of its own, from shell_ops.
+ *         With globbed_out, words with an unquoted * ? or [ are flagged
+ *         for glob_expand and kept in pattern form: quoted * ? [ and \
+ *         have a \ in front, so they only ever match themselves
+ * @param  Arena to allocate from, the line and its length, where to store
+ *         the NUL terminated argv array, and where to store the pattern
+ *         flags (one per word), or NULL to take every word literally
+ * @return Number of words, or -1 on a syntax error or when out of memory
+ */
+int tokenize(struct arena* a, const char* line, size_t len, char*** argv_out,
+             bool** globbed_out) {
+  //a line of len bytes can't have more than len words (operators need no
+  //blanks around them), or need more than twice len bytes of text (every
+  //quoted character escaped) plus a NUL for each word
+  char** argv = arena_alloc(a, (len + 2) * sizeof(char*));
+  char* text = arena_alloc(a, 2 * len + len / 2 + 2);
+  bool* globbed = globbed_out ? arena_alloc(a, len + 2) : NULL;
+  int argc = 0;
+  size_t i = 0;
+
+  if (!argv || !text || (globbed_out && !globbed))
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(ENOMEM));
+    return -1;
+  }
+
+  while (true)
+  {
+    while (i < len && isblank((unsigned char)line[i]))
+      i++;
+    if (i == len || line[i] == '\n' || line[i] == '#')
+      break;
+    size_t oplen;
+    enum shell_op op = op_at(line, len, i, &oplen);
+    if (op != NUM_OPS)
+    {
+      if (globbed)
+        globbed[argc] = false;
+      argv[argc++] = shell_ops[op];
+      i += oplen;
+      continue;
+    }
+
+    char* word = text;
+    bool pattern = false;
+    argv[argc++] = text;
+    while (i < len && !isblank((unsigned char)line[i]) && line[i] != '\n' &&
+           !memchr("|&<>", line[i], 4))
+    {
+      char c = line[i++];
+      if (c == '\\')
+      {
+        if (i < len)
+        {
+          if (globbed && strchr("*?[\\", line[i]))
+            *text++ = '\\';
+          *text++ = line[i++];
+        }
+      }
+      else if (c == '\'')
+      {
+        while (i < len && line[i] != '\'')
+        {
+          if (globbed && strchr("*?[\\", line[i]))
+            *text++ = '\\';
+          *text++ = line[i++];
+        }
+        if (i++ == len)
+        {
+          fprintf(err_out(), "myshell: unterminated quote\n");
+          return -1;
+        }
+      }
+      else if (c == '"')
+      {
+        while (i < len && line[i] != '"')
+        {
+          if (line[i] == '\\' && i + 1 < len && strchr("\"\\$`\n", line[i + 1]))
+            i++;
+          if (globbed && strchr("*?[\\", line[i]))
+            *text++ = '\\';
+          *text++ = line[i++];
+        }
+        if (i++ == len)
+        {
+          fprintf(err_out(), "myshell: unterminated quote\n");
+          return -1;
+        }
+      }
+      else
+      {
+        pattern |= c == '*' || c == '?' || c == '[';
+        *text++ = c;
+      }
+    }
+    *text++ = '\0';
+
+    //only patterns keep the escapes
+    if (globbed)
+    {
+      globbed[argc - 1] = pattern;
+      if (!pattern)
+        text = word + glob_unescape(word) + 1;
+    }
+  }
+
+  argv[argc] = NULL;
+  *argv_out = argv;
+  if (globbed_out)
+    *globbed_out = globbed;
+  return argc;
+}
+
+/*
+* @brief  the shell's current directory as a logical path (symlinks kept as
+*         they were typed, like $PWD), so the prompt never has to ask the
+*         kernel. dev/ino say which directory the path named when it was
+*         last checked; that is compared again only when the path matters
+*/
+static __thread struct {
+  struct strbuf path;
+  dev_t dev;
+  ino_t ino;
+  bool valid;
+} cwd_cache;
+
+/*
+*@brief  remembers which directory we are in now, under the given path
+*/
+static void cwd_set(const char* path, size_t len)
+{
+  struct stat st;
+
+  cwd_cache.path.len = 0;
+  sb_write(&cwd_cache.path, path, len);
+  cwd_cache.valid = !cwd_cache.path.failed && stat(".", &st) == 0;
+  if (cwd_cache.valid)
+  {
+    cwd_cache.dev = st.st_dev;
+    cwd_cache.ino = st.st_ino;
+  }
+}
+
+/*
+*@brief  asks the kernel where we are, with a buffer as big as it takes
+*@return 0 on success, -1 on error
+*/
+static int cwd_reload(void)
+{
+  char* path = getcwd(NULL, 0);
+  if (!path)
+    return -1;
+  cwd_set(path, strlen(path));
+  free(path);
+  return cwd_cache.valid ? 0 : -1;
+}
+
+/*
+*@brief  the cached current directory, loaded the first time. With verify,
+*        the cached path is checked against "." first (the directory may
+*        have been renamed or replaced) and reloaded if they differ
+*@return the path, or NULL if it can't be determined
+*/
+static const char* cwd_get(bool verify)
+{
+  if (!cwd_cache.valid)
+    return cwd_reload() == 0 ? cwd_cache.path.data : NULL;
+  if (!verify)
+    return cwd_cache.path.data;
+
+  struct stat here, there;
+  if (stat(".", &here) != 0)
+    return NULL;
+  if (here.st_dev == cwd_cache.dev && here.st_ino == cwd_cache.ino)
+  {
+    //still the same directory, but is the path still its name?
+    if (stat(cwd_cache.path.data, &there) == 0 &&
+        there.st_dev == here.st_dev && there.st_ino == here.st_ino)
+      return cwd_cache.path.data;
+    //too long for the kernel to resolve; we kept it up to date ourselves
+    if (errno == ENAMETOOLONG)
+      return cwd_cache.path.data;
+  }
+  return cwd_reload() == 0 ? cwd_cache.path.data : NULL;
+}
+
+/*
+*@brief  works out the logical path cd should go to: dir taken relative to
+*        base unless it is absolute, with "." and ".." resolved by name
+*/
+static void cwd_resolve(struct strbuf* sb, const char* base, const char* dir)
+{
+  sb->len = 0;
+  if (dir[0] != '/')
+    sb_str(sb, base);
+
+  const char* p = dir;
+  while (*p)
+  {
+    const char* end = strchrnul(p, '/');
+    size_t n = (size_t)(end - p);
+
+    if (n == 2 && p[0] == '.' && p[1] == '.')
+    {
+      while (sb->len > 0 && sb->data[sb->len - 1] != '/')
+        sb->len--;
+      if (sb->len > 0)
+        sb->len--;
+    }
+    else if (n > 0 && !(n == 1 && p[0] == '.'))
+    {
+      sb_write(sb, "/", 1);
+      sb_write(sb, p, n);
+    }
+    p = *end ? end + 1 : end;
+  }
+  if (sb->len == 0)
+    sb_write(sb, "/", 1);
+  if (!sb->failed)
+    sb->data[sb->len] = '\0';
+}
+
+/*
+* @brief  the git segment of one directory as last worked out: which
+*         branch the repository it is in has checked out, if any
+*/
+struct prompt_dir {
+  struct prompt_dir* next;
+  char* branch;   //NULL outside a repository
+  char path[];
+};
+
+/*
+* @brief  the prompt's git worker. Looking for .git up the tree is a few
+*         stats per level, and on a network or cold filesystem far too slow
+*         to do before every prompt, so a thread does it while the prompt
+*         is shown with whatever the cache already has. Results are kept
+*         per directory; the worker only ever has one directory to do, the
+*         latest, and asking again replaces it
+*/
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  bool started;
+  char* request;                 //directory to look at next, owned
+  unsigned long asked, answered; //request numbers, to wait for one
+  struct prompt_dir* table[PROMPT_HASH_SIZE];
+  size_t count;
+} prompt_git = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                 false, NULL, 0, 0, { NULL }, 0 };
+
+//what the prompt says about the last command, filled in by main
+static int prompt_last_status = 0;
+static uint64_t prompt_last_ns = 0;
+
+/*
+*@brief  reads a small file into buf as a string, dropping the newline
+*@return its length, or -1 if it can't be read
+*/
+static ssize_t read_small(int dirfd, const char* name, char* buf, size_t size)
+{
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n < 0)
+    return -1;
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+    n--;
+  buf[n] = '\0';
+  return n;
+}
+
+/*
+*@brief  finds the repository dir is in, looking for .git in it and every
+*        directory above, and reads its HEAD: "ref: refs/heads/x" is on
+*        branch x, a bare hash is a detached HEAD, shown abbreviated.
+*        .git can also be a file pointing somewhere else (worktrees,
+*        submodules)
+*@return the branch, to free, or NULL outside a repository
+*/
+static char* git_branch(const char* dir)
+{
+  struct strbuf path = { NULL, 0, 0, false };
+  char head[512];
+  char* branch = NULL;
+  size_t len = strlen(dir);
+
+  while (!branch)
+  {
+    path.len = 0;
+    sb_write(&path, dir, len);
+    sb_str(&path, len > 1 ? "/.git" : ".git");
+    sb_write(&path, "", 1);
+    if (path.failed)
+      break;
+
+    struct stat st;
+    ssize_t n = -1;
+    bool found = stat(path.data, &st) == 0;
+    if (found && S_ISDIR(st.st_mode))
+    {
+      int fd = open(path.data, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      n = fd >= 0 ? read_small(fd, "HEAD", head, sizeof(head)) : -1;
+      if (fd >= 0)
+        close(fd);
+    }
+    else if (found && S_ISREG(st.st_mode) && read_small(AT_FDCWD, path.data, head, sizeof(head)) > 8 &&
+             strncmp(head, "gitdir: ", 8) == 0)
+    {
+      //relative gitdirs are relative to the directory holding .git
+      int base = open(len > 0 ? (path.data[len] = '\0', path.data) : "/",
+                      O_PATH | O_DIRECTORY | O_CLOEXEC);
+      int fd = base >= 0 ? openat(base, head + 8, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+      n = fd >= 0 ? read_small(fd, "HEAD", head, sizeof(head)) : -1;
+      if (fd >= 0)
+        close(fd);
+      if (base >= 0)
+        close(base);
+    }
+
+    if (n > 0)
+    {
+      const char* name = head;
+      if (strncmp(head, "ref: ", 5) == 0)
+      {
+        name = head + 5;
+        if (strncmp(name, "refs/heads/", 11) == 0)
+          name += 11;
+      }
+      else if (n > 7)
+        head[7] = '\0';
+      branch = strdup(name);
+      if (!branch)
+        break;
+    }
+    if (n >= 0 || len <= 1)
+      break;
+
+    //on to the parent
+    while (len > 1 && dir[len - 1] != '/')
+      len--;
+    if (len > 1)
+      len--;
+  }
+  free(path.data);
+  return branch;
+}
+
+/*
+*@brief  the cache entry of a directory, prompt_git.lock held
+*/
+static struct prompt_dir** prompt_slot(const char* dir)
+{
+  uint32_t hash = 2166136261u; //FNV-1a
+  for (const char* c = dir; *c; c++)
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+  struct prompt_dir** slot = &prompt_git.table[hash % PROMPT_HASH_SIZE];
+  while (*slot && strcmp((*slot)->path, dir) != 0)
+    slot = &(*slot)->next;
+  return slot;
+}
+
+/*
+*@brief  the worker: takes the latest directory, looks it up, keeps the
+*        answer and wakes a prompt that might be waiting for it
+*/
+static void* prompt_worker(void* arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&prompt_git.lock);
+  while (true)
+  {
+    while (!prompt_git.request)
+      pthread_cond_wait(&prompt_git.work, &prompt_git.lock);
+    char* dir = prompt_git.request;
+    unsigned long asked = prompt_git.asked;
+    prompt_git.request = NULL;
+    pthread_mutex_unlock(&prompt_git.lock);
+
+    char* branch = git_branch(dir);
+
+    pthread_mutex_lock(&prompt_git.lock);
+    struct prompt_dir** slot = prompt_slot(dir);
+    if (!*slot)
+    {
+      //plenty for anyone's working set; past that start over
+      if (prompt_git.count >= PROMPT_CACHE_MAX)
+      {
+        for (size_t i = 0; i < PROMPT_HASH_SIZE; i++)
+        {
+          while (prompt_git.table[i])
+          {
+            struct prompt_dir* next = prompt_git.table[i]->next;
+            free(prompt_git.table[i]->branch);
+            free(prompt_git.table[i]);
+            prompt_git.table[i] = next;
+          }
+        }
+        prompt_git.count = 0;
+        slot = prompt_slot(dir);
+      }
+      size_t len = strlen(dir);
+      *slot = malloc(sizeof(**slot) + len + 1);
+      if (*slot)
+      {
+        (*slot)->next = NULL;
+        (*slot)->branch = NULL;
+        memcpy((*slot)->path, dir, len + 1);
+        prompt_git.count++;
+      }
+    }
+    if (*slot)
+    {
+      free((*slot)->branch);
+      (*slot)->branch = branch;
+    }
+    else
+      free(branch);
+    free(dir);
+    prompt_git.answered = asked;
+    pthread_cond_broadcast(&prompt_git.done);
+  }
+  return NULL;
+}
+
+/*
+*@brief  the git segment for dir: the cached answer, while the worker checks
+*        it again in the background for the next prompt. Only a directory
+*        with no answer yet waits, at most prompt_wait ms (by default not
+*        at all), so the prompt always appears straight away
+*@return the branch, to free, or NULL
+*/
+static char* prompt_branch(const char* dir)
+{
+  char* branch = NULL;
+  char* request = strdup(dir);
+  if (!request)
+    return NULL;
+
+  pthread_mutex_lock(&prompt_git.lock);
+  if (!prompt_git.started)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prompt_worker, NULL) == 0)
+    {
+      pthread_detach(thread);
+      prompt_git.started = true;
+    }
+  }
+  if (prompt_git.started)
+  {
+    free(prompt_git.request);
+    prompt_git.request = request;
+    unsigned long want = ++prompt_git.asked;
+    pthread_cond_signal(&prompt_git.work);
+
+    //a cached answer is shown as it is, the worker's goes to the next prompt
+    if (prompt_wait > 0 && !*prompt_slot(dir))
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long)(prompt_wait % 1000) * 1000000;
+      deadline.tv_sec += (time_t)(prompt_wait / 1000) + deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (prompt_git.answered < want &&
+             pthread_cond_timedwait(&prompt_git.done, &prompt_git.lock, &deadline) == 0)
+        ;
+    }
+  }
+  else
+    free(request);
+
+  struct prompt_dir* entry = *prompt_slot(dir);
+  if (entry && entry->branch)
+    branch = strdup(entry->branch);
+  pthread_mutex_unlock(&prompt_git.lock);
+  return branch;
+}
+
+//the last prompt shown, for the line editor to draw again
+static struct strbuf prompt_text;
+
+/**
+ * @brief Displays a command prompt including the current working directory
+ *        and, when set up with set, the git branch, the status of the
+ *        last command if it failed and how long it took if that was long
+ */
+void display_prompt(void) {
+  const char* current_dir = cwd_get(false);
+
+  prompt_text.len = 0;
+  if (current_dir != NULL) {
+    // Outputs the current working directory in bold green text (\033[32;1m)
+    // \033 is the escape sequence for changing text, 32 is green, 1 is bold
+    sb_str(&prompt_text, "myshell:\033[32;1m");
+    sb_str(&prompt_text, current_dir);
+    sb_str(&prompt_text, "\033[0m");
+
+    char* branch = prompt_show_git ? prompt_branch(current_dir) : NULL;
+    if (branch) {
+      sb_str(&prompt_text, " (\033[36m");
+      sb_str(&prompt_text, branch);
+      sb_str(&prompt_text, "\033[0m)");
+      free(branch);
+    }
+  }
+
+  char segment[64];
+  if (prompt_show_status && prompt_last_status != 0) {
+    // builtins fail with -1, which is exit status 1 to everyone else
+    snprintf(segment, sizeof(segment), " \033[31m[%d]\033[0m",
+             prompt_last_status < 0 ? 1 : prompt_last_status);
+    sb_str(&prompt_text, segment);
+  }
+  if (prompt_duration > 0 && prompt_last_ns >= (uint64_t)prompt_duration * 1000000) {
+    snprintf(segment, sizeof(segment), " \033[33m%.2fs\033[0m", (double)prompt_last_ns / 1e9);
+    sb_str(&prompt_text, segment);
+  }
+  sb_str(&prompt_text, "> ");
+  out_write(ctx->out, prompt_text.data, prompt_text.len);
+  out_flush(ctx->out);
+}
+
+/*
+* @brief  reads commands in big blocks and hands them out a line at a time,
+*         instead of a read (or a trip through stdio) for every line. A line
+*         that doesn't fit grows the buffer
+*/
+struct line_reader {
+  int fd;
+  char* buf;
+  size_t cap, start, end; //unread data is buf[start, end)
+  bool eof;
+};
+
+/*
+*@brief  returns the next line, including its newline if it has one
+*@return length of the line, 0 at end of input, -1 on error
+*/
+static ssize_t reader_next(struct line_reader* r, const char** line)
+{
+  while (true)
+  {
+    //an empty buffer may not even be allocated yet
+    char* nl = r->start < r->end ? memchr(r->buf + r->start, '\n', r->end - r->start) : NULL;
+    if (nl || (r->eof && r->start < r->end))
+    {
+      size_t len = nl ? (size_t)(nl + 1 - (r->buf + r->start)) : r->end - r->start;
+      *line = r->buf + r->start;
+      r->start += len;
+      return (ssize_t)len;
+    }
+    if (r->eof)
+      return 0;
+
+    //keep the partial line, move it to the front and make room behind it
+    if (r->start < r->end)
+      memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+    if (r->end == r->cap)
+    {
+      size_t cap = r->cap ? r->cap * 2 : READER_BLOCK_SIZE;
+      char* grown = realloc(r->buf, cap);
+      if (!grown)
+        return -1;
+      r->buf = grown;
+      r->cap = cap;
+    }
+
+    ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      r->eof = true;
+    r->end += (size_t)n;
+  }
+}
+
+/*
+* @brief  the history, kept across sessions: the commands, one per line, in
+*         an append-only file ($MYSHELL_HISTORY, or ~/.myshell_history), and
+*         next to it (".idx") the offset every line starts at as a uint64_t.
+*         Both are mapped, so starting up costs the same with ten lines or
+*         ten million, and entry i is there without reading anything. Every
+*         session appends under flock, and sees what the others added. A
+*         session that died between the two appends leaves lines without
+*         offsets, which are indexed again by the next one
+*/
+static struct {
+  bool opened;
+  int fd, idx_fd;        //-1 if there is no history file
+  const char* text;      //mapping of the history file
+  size_t text_len;
+  const uint64_t* at;    //mapping of the index: entry i starts at at[i]
+  size_t at_len, count;
+} hist = { false, -1, -1, NULL, 0, NULL, 0, 0 };
+
+/*
+* @brief  the trigram index of reverse search, built on a thread from its
+*         own mapping of the history. For each trigram (hashed into
+*         TRI_BUCKETS) it lists the entries that have it, oldest first, so
+*         a search only looks at the entries in the shortest list of its
+*         pattern's trigrams. Entries added after it was built are few, and
+*         just looked at one by one
+*/
+static struct {
+  atomic_bool ready;
+  bool started;
+  size_t n;              //entries covered
+  uint32_t* start;       //TRI_BUCKETS + 1 offsets into post
+  uint32_t* post;
+} tri;
+
+/*
+*@brief  maps (or maps again, bigger) the whole of a file that only grows
+*@return 0 on success, -1 on error
+*/
+static int hist_map(int fd, const void** map, size_t* len)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+  size_t size = (size_t)st.st_size;
+  if (size == *len)
+    return 0;
+
+  void* p = size == 0 ? NULL :
+            *map ? mremap((void*)*map, *len, size, MREMAP_MAYMOVE)
+                 : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  if (size == 0 && *map)
+    munmap((void*)*map, *len);
+  *map = p;
+  *len = size;
+  return 0;
+}
+
+/*
+*@brief  maps both files again after they grew. The index goes first: a
+*        line is always written before its offset, so every offset then
+*        has its line in the text mapped after it
+*@return 0 on success, -1 on error
+*/
+static int hist_remap(void)
+{
+  if (hist_map(hist.idx_fd, (const void**)&hist.at, &hist.at_len) < 0 ||
+      hist_map(hist.fd, (const void**)&hist.text, &hist.text_len) < 0)
+    return -1;
+  hist.count = hist.at_len / sizeof(uint64_t);
+  return 0;
+}
+
+/*
+*@brief  gives the lines at the end of the history file that have no
+*        offset yet their offsets, after a crash (or a history file that
+*        was written some other way). The file must be locked
+*@return 0 on success, -1 on error
+*/
+static int hist_repair(void)
+{
+  if (hist_remap() < 0)
+    return -1;
+  //a torn offset, or offsets past the end of the text: index it all again
+  if (hist.at_len % sizeof(uint64_t) != 0 ||
+      (hist.count > 0 && hist.at[hist.count - 1] >= hist.text_len))
+  {
+    if (ftruncate(hist.idx_fd, 0) < 0)
+      return -1;
+    munmap((void*)hist.at, hist.at_len);
+    hist.at = NULL;
+    hist.at_len = hist.count = 0;
+  }
+
+  //the last line the index knows ends where the unindexed ones start
+  size_t from = 0;
+  if (hist.count > 0)
+  {
+    const char* last = hist.text + hist.at[hist.count - 1];
+    const char* nl = memchr(last, '\n', hist.text_len - hist.at[hist.count - 1]);
+    from = nl ? (size_t)(nl + 1 - hist.text) : hist.text_len;
+  }
+  if (from == hist.text_len)
+    return 0;
+
+  struct strbuf offsets = { NULL, 0, 0, false };
+  for (size_t at = from; at < hist.text_len; )
+  {
+    uint64_t off = at;
+    sb_write(&offsets, (const char*)&off, sizeof(off));
+    const char* nl = memchr(hist.text + at, '\n', hist.text_len - at);
+    at = nl ? (size_t)(nl + 1 - hist.text) : hist.text_len;
+  }
+  //a last line cut short gets its newline, so the next one starts afresh
+  int status = offsets.failed ||
+               (hist.text[hist.text_len - 1] != '\n' && write_all(hist.fd, "\n", 1) < 0) ||
+               write_all(hist.idx_fd, offsets.data, offsets.len) < 0 ? -1 : 0;
+  free(offsets.data);
+  return status < 0 ? -1 : hist_remap();
+}
+
+/*
+*@brief  opens and maps the history files, the first time history is used
+*@return 0 if there is a history, -1 if not
+*/
+static int hist_open(void)
+{
+  if (hist.opened)
+    return hist.fd >= 0 ? 0 : -1;
+  hist.opened = true;
+
+  //an empty MYSHELL_HISTORY keeps no history at all
+  const char* path = getenv("MYSHELL_HISTORY");
+  struct strbuf name = { NULL, 0, 0, false };
+  if (!path)
+  {
+    const char* home = getenv("HOME");
+    struct passwd* pw = home ? NULL : getpwuid(getuid());
+    if (!home && !pw)
+      return -1;
+    sb_str(&name, home ? home : pw->pw_dir);
+    sb_str(&name, "/.myshell_history");
+  }
+  else if (*path)
+    sb_str(&name, path);
+  if (name.len == 0 || name.failed)
+  {
+    free(name.data);
+    return -1;
+  }
+
+  hist.fd = open(name.data, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  sb_str(&name, ".idx");
+  hist.idx_fd = name.failed ? -1 : open(name.data, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  int status = hist.fd >= 0 && hist.idx_fd >= 0 ? 0 : -1;
+  if (status == 0)
+  {
+    flock(hist.fd, LOCK_EX);
+    status = hist_repair();
+    flock(hist.fd, LOCK_UN);
+  }
+  if (status < 0)
+  {
+    fprintf(err_out(), "myshell: history %s: %s\n", name.data, strerror(errno));
+    if (hist.fd >= 0)
+      close(hist.fd);
+    if (hist.idx_fd >= 0)
+      close(hist.idx_fd);
+    hist.fd = hist.idx_fd = -1;
+  }
+  free(name.data);
+  return status;
+}
+
+/*
+*@brief  entry i of the history, without its newline
+*/
+static const char* hist_entry(size_t i, size_t* len)
+{
+  const char* start = hist.text + hist.at[i];
+  const char* end = i + 1 < hist.count ? hist.text + hist.at[i + 1] : NULL;
+  //the last one ends at its newline, as another session may be adding more
+  if (!end && !(end = memchr(start, '\n', hist.text_len - hist.at[i])))
+    end = hist.text + hist.text_len;
+  if (end > start && end[-1] == '\n')
+    end--;
+  *len = (size_t)(end - start);
+  return start;
+}
+
+/*
+*@brief  adds a command to the history, unless it is blank or the same as
+*        the last one
+*/
+static void hist_add(const char* line, size_t len)
+{
+  while (len > 0 && (line[len - 1] == '\n' || isblank((unsigned char)line[len - 1])))
+    len--;
+  if (len == 0 || memchr(line, '\n', len) || hist_open() < 0)
+    return;
+
+  flock(hist.fd, LOCK_EX);
+  size_t last_len;
+  const char* last;
+  if (hist_repair() == 0 &&
+      (hist.count == 0 || (last = hist_entry(hist.count - 1, &last_len), last_len != len) ||
+       memcmp(last, line, len) != 0))
+  {
+    uint64_t off = hist.text_len;
+    if (writev_all(hist.fd, line, len, "\n", 1) < 0 ||
+        write_all(hist.idx_fd, (const char*)&off, sizeof(off)) < 0)
+      fprintf(err_out(), "myshell: history: %s\n", strerror(errno));
+  }
+  flock(hist.fd, LOCK_UN);
+  hist_remap();
+}
+
+static uint32_t tri_bucket(const unsigned char* p)
+{
+  uint32_t code = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+  return (code * 2654435761u) >> (32 - TRI_BITS);
+}
+
+/*
+*@brief  thread body that builds the trigram index: a count of the
+*        entries in every bucket, then the lists in one array. last[b]
+*        makes an entry count once per bucket
+*/
+static void* tri_main(void* arg)
+{
+  (void)arg;
+  const void* text = NULL;
+  const void* idx = NULL;
+  size_t text_len = 0, idx_len = 0;
+  uint32_t* start = calloc(TRI_BUCKETS + 1, sizeof(*start));
+  uint32_t* last = calloc(TRI_BUCKETS, sizeof(*last));
+  uint32_t* post = NULL;
+
+  //the index goes first, as in hist_remap, so its offsets have their text
+  if (!start || !last || hist_map(hist.idx_fd, &idx, &idx_len) < 0 ||
+      hist_map(hist.fd, &text, &text_len) < 0)
+    goto out;
+  const uint64_t* at = idx;
+  size_t n = idx_len / sizeof(uint64_t);
+  if (n > UINT32_MAX - 1)
+    n = UINT32_MAX - 1;
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      size_t end = i + 1 < n && at[i + 1] < text_len ? at[i + 1] : text_len;
+      const unsigned char* p = (const unsigned char*)text + (at[i] < end ? at[i] : end);
+      const unsigned char* stop = (const unsigned char*)text + end;
+      for (; p + 3 <= stop; p++)
+      {
+        uint32_t b = tri_bucket(p);
+        if (last[b] == i + 1)
+          continue;
+        last[b] = (uint32_t)i + 1;
+        if (pass == 0)
+          start[b + 1]++;
+        else
+          post[start[b]++] = (uint32_t)i;
+      }
+    }
+    if (pass == 0)
+    {
+      for (size_t b = 0; b < TRI_BUCKETS; b++)
+        start[b + 1] += start[b];
+      memset(last, 0, TRI_BUCKETS * sizeof(*last));
+      if (!(post = malloc((start[TRI_BUCKETS] ? start[TRI_BUCKETS] : 1) * sizeof(*post))))
+        goto out;
+    }
+  }
+  //filling moved every start to where the next bucket starts
+  memmove(start + 1, start, TRI_BUCKETS * sizeof(*start));
+  start[0] = 0;
+
+  tri.n = n;
+  tri.start = start;
+  tri.post = post;
+  start = NULL;
+  post = NULL;
+  atomic_store(&tri.ready, true);
+out:
+  free(start);
+  free(last);
+  free(post);
+  if (text)
+    munmap((void*)text, text_len);
+  if (idx)
+    munmap((void*)idx, idx_len);
+  return NULL;
+}
+
+/*
+*@brief  does entry i have the pattern in it
+*@return where in the entry, or -1
+*/
+static ssize_t hist_match(size_t i, const char* pat, size_t plen)
+{
+  size_t len;
+  const char* e = hist_entry(i, &len);
+  const char* hit = memmem(e, len, pat, plen);
+  return hit ? hit - e : -1;
+}
+
+/*
+*@brief  finds the newest entry older than entry from with the pattern in
+*        it, through the trigram index where it can
+*@return the entry, or -1 if there is none; *at is where the pattern is
+*/
+static long hist_search(const char* pat, size_t plen, size_t from, size_t* at)
+{
+  bool indexed = plen >= 3 && atomic_load(&tri.ready);
+  size_t i = from;
+  ssize_t hit;
+
+  for (; i > (indexed ? tri.n : 0); i--)
+  {
+    if ((hit = hist_match(i - 1, pat, plen)) >= 0)
+    {
+      *at = (size_t)hit;
+      return (long)i - 1;
+    }
+  }
+  if (!indexed)
+    return -1;
+
+  //every entry with the pattern is in every one of its trigram's lists,
+  //so the shortest will do
+  uint32_t lo = 0, hi = 0;
+  for (size_t k = 0; k + 3 <= plen; k++)
+  {
+    uint32_t b = tri_bucket((const unsigned char*)pat + k);
+    if (k == 0 || tri.start[b + 1] - tri.start[b] < hi - lo)
+    {
+      lo = tri.start[b];
+      hi = tri.start[b + 1];
+    }
+  }
+  //the entries before i, newest first
+  uint32_t* end = tri.post + hi;
+  uint32_t* first = tri.post + lo;
+  while (first < end)
+  {
+    uint32_t* mid = first + (end - first) / 2;
+    if (*mid < i)
+      first = mid + 1;
+    else
+      end = mid;
+  }
+  for (uint32_t* p = end; p > tri.post + lo; p--)
+  {
+    if ((hit = hist_match(p[-1], pat, plen)) >= 0)
+    {
+      *at = (size_t)hit;
+      return (long)p[-1];
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief  Lists the history, numbered from 1 like other shells
+ * @param  How many of the newest entries to show (all without one)
+ * @return 0 on success, -1 if there is no history or the count is wrong
+ */
+int do_history(int argc, char** argv) {
+  char* end;
+  unsigned long long want = ULLONG_MAX;
+
+  if (argc > 0 && ((want = strtoull(argv[0], &end, 10)), *end || !*argv[0]))
+  {
+    fprintf(err_out(), "history: %s: numeric argument required\n", argv[0]);
+    return -1;
+  }
+  if (hist_open() < 0)
+    return -1;
+  hist_remap();
+
+  size_t first = want < hist.count ? hist.count - (size_t)want : 0;
+  for (size_t i = first; i < hist.count; i++)
+  {
+    char number[32];
+    size_t len;
+    const char* e = hist_entry(i, &len);
+    snprintf(number, sizeof(number), "%5zu  ", i + 1);
+    out_str(ctx->out, number);
+    out_write(ctx->out, e, len);
+    out_write(ctx->out, "\n", 1);
+  }
+  return 0;
+}
+
+enum editor_key { KEY_UP = 256, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE,
+                  KEY_ESCAPE };
+
+/*
+* @brief  the line editor of interactive sessions: the terminal in raw mode,
+*         the line as it is being edited, history browsing, and reverse
+*         search (Ctrl-R). The prompt is display_prompt's, drawn again with
+*         the line whenever it changes; a line too wide for the terminal
+*         scrolls sideways to keep the cursor in view
+*/
+static struct {
+  struct termios cooked;
+  struct strbuf line;
+  size_t pos;              //cursor, as a byte offset
+  size_t browse;           //history entry shown, hist.count for the new line
+  struct strbuf saved;     //the new line while browsing history
+  struct strbuf search;    //the reverse search pattern
+  bool searching, failing;
+  long found;              //entry the search is at, -1 for none yet
+  unsigned char keys[256]; //read ahead from the terminal
+  size_t key_at, key_len;
+} ed;
+
+/*
+*@brief  columns taken by len bytes of UTF-8 text, leaving out terminal
+*        escape sequences (the colors of the prompt)
+*/
+static size_t text_cols(const char* s, size_t len)
+{
+  size_t cols = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (s[i] == '\033')
+    {
+      while (i + 1 < len && !isalpha((unsigned char)s[++i]))
+        ;
+      continue;
+    }
+    cols += ((unsigned char)s[i] & 0xc0) != 0x80;
+  }
+  return cols;
+}
+
+/*
+*@brief  the next key, with the escape sequences of arrows and the like
+*        turned into editor_keys
+*@return the key, or -1 at end of input or on error
+*/
+static int editor_key(void)
+{
+  if (ed.key_at == ed.key_len)
+  {
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, ed.keys, sizeof(ed.keys))) < 0 && errno == EINTR)
+      ;
+    if (n <= 0)
+      return -1;
+    ed.key_at = 0;
+    ed.key_len = (size_t)n;
+  }
+  int c = ed.keys[ed.key_at++];
+  if (c != '\033')
+    return c;
+
+  //the rest of a sequence comes right behind it; an Escape on its own
+  //doesn't, and waiting 50 ms tells them apart
+  unsigned char seq[3];
+  size_t n = 0;
+  while (n < sizeof(seq))
+  {
+    if (ed.key_at == ed.key_len)
+    {
+      struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+      ssize_t got;
+      if (poll(&pfd, 1, 50) <= 0 ||
+          (got = read(STDIN_FILENO, ed.keys, sizeof(ed.keys))) <= 0)
+        break;
+      ed.key_at = 0;
+      ed.key_len = (size_t)got;
+    }
+    seq[n++] = ed.keys[ed.key_at++];
+    if (n == 1 && seq[0] != '[' && seq[0] != 'O')
+      break;
+    if (n >= 2 && (isalpha(seq[n - 1]) || seq[n - 1] == '~'))
+      break;
+  }
+  if (n >= 2 && (seq[0] == '[' || seq[0] == 'O'))
+  {
+    switch (seq[n - 1])
+    {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return KEY_RIGHT;
+      case 'D': return KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+      case '~':
+        return seq[1] == '3' ? KEY_DELETE : seq[1] == '1' || seq[1] == '7' ? KEY_HOME
+               : seq[1] == '4' || seq[1] == '8' ? KEY_END : KEY_ESCAPE;
+    }
+  }
+  return KEY_ESCAPE;
+}
+
+/*
+*@brief  draws the prompt and the line again, with the cursor where it is
+*/
+static void editor_refresh(void)
+{
+  struct winsize ws;
+  size_t width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  struct strbuf sb = { NULL, 0, 0, false };
+
+  sb_write(&sb, "\r", 1);
+  if (ed.searching)
+  {
+    sb_str(&sb, ed.failing ? "(failed reverse-i-search)`" : "(reverse-i-search)`");
+    sb_write(&sb, ed.search.data, ed.search.len);
+    sb_str(&sb, "': ");
+  }
+  else
+    sb_write(&sb, prompt_text.data, prompt_text.len);
+  size_t prompt_cols = text_cols(sb.data + 1, sb.len - 1);
+
+  //start far enough in for the cursor to fit, on a character boundary
+  size_t room = width > prompt_cols + 1 ? width - prompt_cols - 1 : 1;
+  size_t first = 0;
+  while (text_cols(ed.line.data + first, ed.pos - first) > room)
+    while (((unsigned char)ed.line.data[++first] & 0xc0) == 0x80)
+      ;
+  size_t last = first;
+  while (last < ed.line.len && text_cols(ed.line.data + first, last - first) < room)
+    while (++last < ed.line.len && ((unsigned char)ed.line.data[last] & 0xc0) == 0x80)
+      ;
+
+  sb_write(&sb, ed.line.data + first, last - first);
+  sb_str(&sb, "\033[K\r");
+  size_t cursor = prompt_cols + text_cols(ed.line.data + first, ed.pos - first);
+  if (cursor > 0)
+  {
+    sb_str(&sb, "\033[");
+    sb_uint(&sb, cursor);
+    sb_write(&sb, "C", 1);
+  }
+  if (!sb.failed)
+    write_all(STDOUT_FILENO, sb.data, sb.len);
+  free(sb.data);
+}
+
+/*
+*@brief  replaces the line with text, the cursor at the end
+*/
+static void editor_set(const char* text, size_t len)
+{
+  ed.line.len = 0;
+  sb_write(&ed.line, text, len);
+  ed.pos = ed.line.len;
+}
+
+/*
+*@brief  looks for the search pattern from entry from back, and shows
+*        what it found
+*/
+static void editor_search(size_t from)
+{
+  size_t at = 0;
+  long i = ed.search.len ? hist_search(ed.search.data, ed.search.len, from, &at) : -1;
+  ed.failing = ed.search.len > 0 && i < 0;
+  if (i >= 0)
+  {
+    size_t len;
+    const char* e = hist_entry((size_t)i, &len);
+    ed.found = i;
+    editor_set(e, len);
+    ed.pos = at;
+  }
+}
+
+/*
+*@brief  handles a key while searching
+*@return true if the key is done with, false if it ends the search and
+*        is then for the editor
+*/
+static bool editor_search_key(int c)
+{
+  if (c == 18) //Ctrl-R: the next older match
+  {
+    editor_search(ed.found >= 0 ? (size_t)ed.found : hist.count);
+    return true;
+  }
+  if (c == 127 || c == 8)
+  {
+    while (ed.search.len > 0 &&
+           ((unsigned char)ed.search.data[--ed.search.len] & 0xc0) == 0x80)
+      ;
+    ed.found = -1;
+    editor_search(hist.count);
+    return true;
+  }
+  if (c == 7 || c == KEY_ESCAPE) //Ctrl-G: back to the line as it was
+  {
+    editor_set(ed.saved.data, ed.saved.len);
+    ed.searching = false;
+    return true;
+  }
+  if (c >= 32 && c < 256 && c != 127)
+  {
+    char byte = (char)c;
+    sb_write(&ed.search, &byte, 1);
+    //the entry found so far is the first to look at again
+    editor_search(ed.found >= 0 ? (size_t)ed.found + 1 : hist.count);
+    return true;
+  }
+  ed.searching = false;
+  return false;
+}
+
+/*
+*@brief  opens the history the first time a key needs it, so a shell that
+*        never looks back doesn't pay for mapping it at startup. The index
+*        for reverse search is then built in the background
+*/
+static void editor_history(void)
+{
+  if (tri.started)
+    return;
+  tri.started = true;
+  bool at_new = ed.browse == hist.count;
+  if (hist_open() == 0)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, tri_main, NULL) == 0)
+      pthread_detach(thread);
+  }
+  if (at_new)
+    ed.browse = hist.count;
+}
+
+/*
+*@brief  shows history entry i on the line (hist.count for the new line)
+*/
+static void editor_browse(size_t i)
+{
+  if (ed.browse == hist.count)
+  {
+    ed.saved.len = 0;
+    sb_write(&ed.saved, ed.line.data, ed.line.len);
+  }
+  ed.browse = i;
+  if (i == hist.count)
+    editor_set(ed.saved.data, ed.saved.len);
+  else
+  {
+    size_t len;
+    const char* e = hist_entry(i, &len);
+    editor_set(e, len);
+  }
+}
+
+static void editor_complete(bool again);
+
+/*
+*@brief  reads a command line from the terminal with the line editor. The
+*        prompt has already been shown. The terminal is raw only while the
+*        line is being edited, commands run with it as it was
+*@return length of the line (with a newline), 0 at end of input, or -1 if
+*        the terminal can't be used this way (nothing was read then)
+*/
+static ssize_t editor_read(const char** line)
+{
+  struct termios raw;
+  if (tcgetattr(STDIN_FILENO, &ed.cooked) < 0)
+    return -1;
+  raw = ed.cooked;
+  raw.c_iflag &= ~(unsigned)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_lflag &= ~(unsigned)(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0)
+    return -1;
+
+  ed.line.len = 0;
+  ed.pos = 0;
+  ed.browse = hist.count;
+  ed.searching = false;
+  ssize_t result = -2;
+  int prev = 0;
+  while (result == -2)
+  {
+    int c = editor_key();
+    if (c < 0)
+    {
+      result = ed.line.len ? (ssize_t)ed.line.len : -3;
+      break;
+    }
+    if (ed.searching && editor_search_key(c))
+    {
+      editor_refresh();
+      continue;
+    }
+
+    switch (c)
+    {
+      case '\r':
+      case '\n':
+        result = (ssize_t)ed.line.len;
+        break;
+      case 3: //Ctrl-C: drop the line
+        ed.pos = ed.line.len;
+        editor_refresh();
+        write_all(STDOUT_FILENO, "^C", 2);
+        ed.line.len = ed.pos = 0;
+        result = 0;
+        break;
+      case 4: //Ctrl-D: end of input on an empty line
+        if (ed.line.len == 0)
+        {
+          result = -3;
+          break;
+        }
+        /* fall through */
+      case KEY_DELETE:
+        if (ed.pos < ed.line.len)
+        {
+          size_t next = ed.pos + 1;
+          while (next < ed.line.len && ((unsigned char)ed.line.data[next] & 0xc0) == 0x80)
+            next++;
+          memmove(ed.line.data + ed.pos, ed.line.data + next, ed.line.len - next);
+          ed.line.len -= next - ed.pos;
+        }
+        break;
+      case 127:
+      case 8: //Backspace
+        if (ed.pos > 0)
+        {
+          size_t prev = ed.pos - 1;
+          while (prev > 0 && ((unsigned char)ed.line.data[prev] & 0xc0) == 0x80)
+            prev--;
+          memmove(ed.line.data + prev, ed.line.data + ed.pos, ed.line.len - ed.pos);
+          ed.line.len -= ed.pos - prev;
+          ed.pos = prev;
+        }
+        break;
+      case KEY_LEFT:
+      case 2: //Ctrl-B
+        while (ed.pos > 0 && ((unsigned char)ed.line.data[--ed.pos] & 0xc0) == 0x80)
+          ;
+        break;
+      case KEY_RIGHT:
+      case 6: //Ctrl-F
+        while (ed.pos < ed.line.len &&
+               ((unsigned char)ed.line.data[++ed.pos] & 0xc0) == 0x80)
+          ;
+        break;
+      case KEY_HOME:
+      case 1: //Ctrl-A
+        ed.pos = 0;
+        break;
+      case KEY_END:
+      case 5: //Ctrl-E
+        ed.pos = ed.line.len;
+        break;
+      case 11: //Ctrl-K
+        ed.line.len = ed.pos;
+        break;
+      case 21: //Ctrl-U
+        memmove(ed.line.data, ed.line.data + ed.pos, ed.line.len - ed.pos);
+        ed.line.len -= ed.pos;
+        ed.pos = 0;
+        break;
+      case 23: //Ctrl-W: the word before the cursor
+      {
+        size_t start = ed.pos;
+        while (start > 0 && isblank((unsigned char)ed.line.data[start - 1]))
+          start--;
+        while (start > 0 && !isblank((unsigned char)ed.line.data[start - 1]))
+          start--;
+        memmove(ed.line.data + start, ed.line.data + ed.pos, ed.line.len - ed.pos);
+        ed.line.len -= ed.pos - start;
+        ed.pos = start;
+        break;
+      }
+      case '\t':
+        editor_complete(prev == '\t');
+        break;
+      case 12: //Ctrl-L
+        write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+        break;
+      case KEY_UP:
+      case 16: //Ctrl-P
+        editor_history();
+        if (ed.browse > 0 && hist.fd >= 0)
+          editor_browse(ed.browse - 1);
+        break;
+      case KEY_DOWN:
+      case 14: //Ctrl-N
+        if (ed.browse < hist.count)
+          editor_browse(ed.browse + 1);
+        break;
+      case 18: //Ctrl-R
+        editor_history();
+        if (hist.fd >= 0)
+        {
+          ed.saved.len = 0;
+          sb_write(&ed.saved, ed.line.data, ed.line.len);
+          ed.search.len = 0;
+          ed.searching = true;
+          ed.failing = false;
+          ed.found = -1;
+        }
+        break;
+      default:
+        if (c >= 32 && c < 256)
+        {
+          char byte = (char)c;
+          if (sb_reserve(&ed.line, 1) == 0)
+          {
+            memmove(ed.line.data + ed.pos + 1, ed.line.data + ed.pos, ed.line.len - ed.pos);
+            ed.line.data[ed.pos++] = byte;
+            ed.line.len++;
+          }
+        }
+        break;
+    }
+    if (result == -2)
+      editor_refresh();
+    prev = c;
+  }
+
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &ed.cooked);
+  if (result == -3)
+    return 0;
+  //the newline the terminal didn't echo, and one execute_command expects
+  if (ed.searching || ed.pos != ed.line.len)
+  {
+    ed.searching = false;
+    ed.pos = ed.line.len;
+    editor_refresh();
+  }
+  write_all(STDOUT_FILENO, "\n", 1);
+  sb_write(&ed.line, "\n", 1);
+  if (ed.line.failed)
+    return -1;
+  *line = ed.line.data;
+  return (ssize_t)ed.line.len;
+}
+
+//batch mode bookkeeping, reported when the shell exits
+static struct timespec batch_start;
+static _Atomic unsigned long commands_run = 0;
+static bool shell_interactive = false; //reading commands from a terminal
+
+//set on the --serve worker threads, where exit ends the connection instead
+//of the shell
+static __thread bool serving = false;
+static __thread bool serve_exit = false;
+
+static int serve_run(const char* path, int workers);
+
+//a shell run by --startup-bench reports to this fd when it is ready for its
+//first command and when that command is done (set from MYSHELL_STARTUP_FD)
+static int startup_fd = -1;
+static int startup_marks = 0;
+
+/*
+*@brief  reports the next point of startup to --startup-bench, as
+*        CLOCK_MONOTONIC nanoseconds
+*/
+static void startup_mark(void)
+{
+  if (startup_fd < 0)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ns = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+  if (write_all(startup_fd, (const char*)&ns, sizeof(ns)) < 0 || ++startup_marks == 2)
+  {
+    close(startup_fd);
+    startup_fd = -1;
+  }
+}
+
+/*
+*@brief  nanoseconds as milliseconds for the --startup-bench table, or how
+*        many runs didn't get that far
+*/
+static void startup_column(char* buf, size_t size, const uint64_t* ns, int count, int runs,
+                           int percentile)
+{
+  if (count < runs)
+    snprintf(buf, size, "%9s", "-");
+  else
+    snprintf(buf, size, "%9.3f", (double)ns[(size_t)(count - 1) * (size_t)percentile / 100] / 1e6);
+}
+
+static int startup_cmp(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+*@brief  starts the shell runs times with the rest of the command line
+*        (input and output /dev/null) and prints the time from exec to
+*        the first prompt (or the first read in batch mode), to the end of
+*        the first command and to exit. self is the argv word that asked
+*        for the bench (getopt takes abbreviations, so only it is dropped)
+*@return EXIT_SUCCESS, or EXIT_FAILURE if a run couldn't be started
+*/
+static int startup_bench(int argc, char** argv, const char* self, int runs)
+{
+  //the same options, less this one
+  char** args = calloc((size_t)argc + 1, sizeof(*args));
+  uint64_t* ns = calloc((size_t)runs * 3, sizeof(*ns));
+  int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (!args || !ns || devnull < 0)
+  {
+    fprintf(err_out(), "myshell: --startup-bench: %s\n", strerror(args && ns ? errno : ENOMEM));
+    return EXIT_FAILURE;
+  }
+  int nargs = 0;
+  for (int i = 0; i < argc; i++)
+    if (argv[i] != self)
+      args[nargs++] = argv[i];
+  setenv("MYSHELL_STARTUP_FD", "3", 1);
+
+  uint64_t* ready = ns;
+  uint64_t* first = ns + runs;
+  uint64_t* done = ns + 2 * runs;
+  int nready = 0, nfirst = 0, failed = 0;
+  for (int i = 0; i < runs; i++)
+  {
+    int p[2];
+    posix_spawn_file_actions_t actions;
+    if (pipe2(p, O_CLOEXEC) < 0)
+    {
+      fprintf(err_out(), "myshell: --startup-bench: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, devnull, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, devnull, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, devnull, STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, p[1], 3);
+
+    struct timespec start, end;
+    pid_t pid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int err = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(p[1]);
+    if (err)
+    {
+      fprintf(err_out(), "myshell: --startup-bench: %s\n", strerror(err));
+      close(p[0]);
+      return EXIT_FAILURE;
+    }
+
+    uint64_t base = (uint64_t)start.tv_sec * 1000000000u + (uint64_t)start.tv_nsec;
+    uint64_t marks[2];
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(marks) &&
+           ((n = read(p[0], (char*)marks + got, sizeof(marks) - got)) > 0 ||
+            (n < 0 && errno == EINTR)))
+      got += n > 0 ? (size_t)n : 0;
+    close(p[0]);
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+      ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (got >= sizeof(uint64_t))
+      ready[nready++] = marks[0] - base;
+    if (got >= 2 * sizeof(uint64_t))
+      first[nfirst++] = marks[1] - base;
+    done[i] = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u +
+              (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+      failed++;
+  }
+
+  qsort(ready, (size_t)nready, sizeof(*ready), startup_cmp);
+  qsort(first, (size_t)nfirst, sizeof(*first), startup_cmp);
+  qsort(done, (size_t)runs, sizeof(*done), startup_cmp);
+  const struct { const char* name; const uint64_t* ns; int count; } rows[] = {
+    { "exec to ready", ready, nready },
+    { "exec to first command", first, nfirst },
+    { "exec to exit", done, runs },
+  };
+  char line[160];
+  snprintf(line, sizeof(line), "%-22s %9s %9s %9s %9s\n", "ms over runs", "min", "median",
+           "p90", "max");
+  out_str(ctx->out, line);
+  for (size_t r = 0; r < sizeof(rows) / sizeof(rows[0]); r++)
+  {
+    char cols[4][32];
+    const int at[4] = { 0, 50, 90, 100 };
+    for (int k = 0; k < 4; k++)
+      startup_column(cols[k], sizeof(cols[k]), rows[r].ns, rows[r].count, runs, at[k]);
+    snprintf(line, sizeof(line), "%-22s %s %s %s %s\n", rows[r].name, cols[0], cols[1],
+             cols[2], cols[3]);
+    out_str(ctx->out, line);
+  }
+  snprintf(line, sizeof(line), "%d runs", runs);
+  out_str(ctx->out, line);
+  if (failed)
+  {
+    snprintf(line, sizeof(line), ", %d of them exited with a failure status", failed);
+    out_str(ctx->out, line);
+  }
+  out_write(ctx->out, "\n", 1);
+  out_flush(ctx->out);
+  free(args);
+  free(ns);
+  close(devnull);
+  return EXIT_SUCCESS;
+}
+
+/*
+*@brief  prints how long a batch run took and how many commands it ran
+*/
+static void batch_report(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (double)(now.tv_sec - batch_start.tv_sec) +
+                (double)(now.tv_nsec - batch_start.tv_nsec) / 1e9;
+
+  out_flush(ctx->out);
+  fprintf(err_out(), "myshell: %lu commands in %.6f s (%.0f commands/s)\n",
+          (unsigned long)commands_run, secs, secs > 0 ? (double)commands_run / secs : 0.0);
+}
+
+/**
+ * @brief  Main program function
+ * @param  Options: "-f script" reads commands from a file instead of stdin,
+ *         "-e" stops at the first command that fails. Without a terminal on
+ *         stdin (or with -f) the shell runs in batch mode: no prompt, and
+ *         the runtime and command count are reported at exit; "-c
+ *         commands" runs the given lines and nothing else; "--serve
+ *         socket" runs commands for clients of a unix socket instead, on
+ *         "--workers n" threads; "--startup-bench[=runs]" times how long
+ *         the shell with the other options takes to start up
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if -e stopped the run or the
+ *         input could not be read
+ */
+int main(int argc, char** argv) {
+  struct line_reader input = { STDIN_FILENO, NULL, 0, 0, 0, false };
+  bool stop_on_error = false;
+  int status = EXIT_SUCCESS;
+  int opt;
+
+  // MYSHELL_STATS=file (or -) is the same as -j file, for batch runs
+  // where changing the command line is awkward
+  const char* stats_env = getenv("MYSHELL_STATS");
+  if (stats_env && *stats_env)
+    stats_enable_json(stats_env);
+
+  // A shell being timed by --startup-bench says where to report, and
+  // mustn't pass that on to the programs it runs
+  const char* startup_env = getenv("MYSHELL_STARTUP_FD");
+  bool timed = startup_env != NULL;
+  if (startup_env) {
+    startup_fd = atoi(startup_env);
+    if (fcntl(startup_fd, F_SETFD, FD_CLOEXEC) < 0)
+      startup_fd = -1;
+    unsetenv("MYSHELL_STARTUP_FD");
+  }
+
+  // --serve PATH runs commands for clients of a unix socket instead
+  const char* serve_path = NULL;
+  const char* command = NULL;
+  int bench_runs = 0;
+  const char* bench_arg = NULL;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 4)
+    workers = 4;
+  static const struct option long_options[] = {
+    { "serve", required_argument, NULL, 'S' },
+    { "workers", required_argument, NULL, 'W' },
+    { "startup-bench", optional_argument, NULL, 'B' },
+    { NULL, 0, NULL, 0 },
+  };
+
+  while ((opt = getopt_long(argc, argv, "c:ef:j:", long_options, NULL)) != -1) {
+    if (opt == 'S')
+      serve_path = optarg;
+    else if (opt == 'c')
+      command = optarg;
+    else if (opt == 'B') {
+      char* end;
+      long runs = optarg ? strtol(optarg, &end, 10) : 100;
+      if ((optarg && *end) || runs < 1 || runs > 1000000) {
+        fprintf(err_out(), "myshell: --startup-bench: not a number of runs: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      bench_runs = (int)runs;
+      //getopt may move words around later, the word itself stays the same
+      bench_arg = argv[optind - 1];
+    }
+    else if (opt == 'W') {
+      char* end;
+      workers = strtol(optarg, &end, 10);
+      if (*end || workers < 1 || workers > 1024) {
+        fprintf(err_out(), "myshell: --workers: not a number from 1 to 1024: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (opt == 'e')
+      stop_on_error = true;
+    else if (opt == 'j')
+      stats_enable_json(optarg);
+    else if (opt == 'f') {
+      input.fd = open(optarg, O_RDONLY | O_CLOEXEC);
+      if (input.fd < 0) {
+        fprintf(err_out(), "myshell: %s: %s\n", optarg, strerror(errno));
+        return EXIT_FAILURE;
+      }
+    }
+    else {
+      fprintf(err_out(), "usage: myshell [-e] [-c commands | -f script] [-j stats.json]"
+              " [--startup-bench[=runs]] [--serve socket [--workers n]]\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (bench_runs && timed) {
+    //a shell that is itself being timed must never start more of them
+    fprintf(err_out(), "myshell: --startup-bench: already running under one\n");
+    return EXIT_FAILURE;
+  }
+  if (bench_runs)
+    return startup_bench(argc, argv, bench_arg, bench_runs);
+
+  if (serve_path) {
+    signal(SIGPIPE, SIG_IGN);
+    return serve_run(serve_path, (int)workers);
+  }
+
+  out_init(&out_stdout, STDOUT_FILENO);
+
+  // Builtins in a pipeline write from threads, so a reader going away has
+  // to show up as EPIPE rather than kill the whole shell
+  signal(SIGPIPE, SIG_IGN);
+
+  // -c runs the given command lines instead of reading any, like sh -c,
+  // and exits with the status of the last one
+  if (command) {
+    int result = 0;
+    startup_mark();
+    for (const char* p = command; *p; ) {
+      size_t len = strcspn(p, "\n");
+      if (p[len] == '\n')
+        len++;
+      result = execute_command(p, len);
+      out_flush(ctx->out);
+      startup_mark();
+      if (result != 0 && stop_on_error)
+        break;
+      p += len;
+    }
+    return result < 0 ? EXIT_FAILURE : result;
+  }
+
+  bool interactive = input.fd == STDIN_FILENO && isatty(STDIN_FILENO);
+  bool editing = interactive && isatty(STDOUT_FILENO);
+  shell_interactive = interactive;
+  if (!interactive) {
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+    atexit(batch_report);
+  }
+
+  while (true) {
+    if (interactive) {
+      jobs_notify();
+      display_prompt();
+    }
+    
+    // Read a line representing a command to execute. Lines can be any
+    // length; at a terminal they come from the line editor (and go into
+    // the history), in batch mode the input is read in big blocks
+    const char* line;
+    if (startup_marks == 0)
+      startup_mark();
+    ssize_t len = editing ? editor_read(&line) : -1;
+    if (len < 0) {
+      editing = false;
+      len = reader_next(&input, &line);
+    }
+    else if (len > 0)
+      hist_add(line, (size_t)len);
+    if (len < 0) {
+      fprintf(err_out(), "myshell: error reading commands: %s\n", strerror(errno));
+      status = EXIT_FAILURE;
+      break;
+    }
+    if (len == 0)
+      break;
+
+    // "cd" and "exit" are in the command table too, flagged as commands
+    // that change the state of the shell itself
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int result = execute_command(line, (size_t)len);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (startup_marks == 1)
+      startup_mark();
+    prompt_last_status = result;
+    prompt_last_ns = (uint64_t)(finished.tv_sec - started.tv_sec) * 1000000000u +
+                     (uint64_t)finished.tv_nsec - (uint64_t)started.tv_nsec;
+
+    out_flush(ctx->out);
+    if (result != 0 && stop_on_error) {
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  // End of input works like exit, on a fresh line if someone is watching
+  if (interactive && ctx->out->tty)
+    out_write(ctx->out, "\n", 1);
+  out_flush(ctx->out);
+  free(input.buf);
+  return status;
+}
+
+/**
+ * @brief  Changes the current working directory
+ * @param  The directory to change to, or if none, use the user's home
+ *         directory
+ * @return -1 on error, 0 on success
+ */
+int do_cd(int argc, char** argv) {
+  const char* dirname = argc > 0 ? argv[0] : NULL;
+
+  // If no argument, change to current user's home directory. The password
+  // database is only asked when $HOME doesn't say
+  if (!dirname) {
+    dirname = getenv("HOME");
+    struct passwd *p = dirname && *dirname ? NULL : getpwuid(getuid());
+    if (p)
+      dirname = p->pw_dir;
+    else if (!dirname || !*dirname) {
+      fprintf(err_out(), "cd: no home directory\n");
+      return -1;
+    }
+  }
+
+  // Work out where that is by name, so symlinks and ".." behave like
+  // they do in other shells and the prompt doesn't need getcwd
+  static __thread struct strbuf target;
+  const char* base = cwd_get(false);
+  if (base)
+    cwd_resolve(&target, base, dirname);
+
+  // Change to directory specified and check for error. A logical path
+  // too long for the kernel to take in one go is entered as typed instead
+  bool logical = base && !target.failed;
+  int rc = logical ? chdir(target.data) : chdir(dirname);
+  if (rc < 0 && logical && errno == ENAMETOOLONG)
+    rc = chdir(dirname);
+  if (rc < 0) {
+    fprintf(err_out(), "cd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (logical)
+    cwd_set(target.data, target.len);
+  else
+    cwd_reload();
+  return 0;
+}
+
+/*
+* @brief  one record as filled in by getdents64. glibc only started exporting
+*         this around 2.30, so it is spelled out here
+*/
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+*@brief  reads as many directory entries as fit into buf in one system call
+*@return bytes filled in, 0 at the end of the directory, -1 on error
+*/
+static ssize_t read_dirents(int dirfd, char* buf, size_t size)
+{
+  return syscall(SYS_getdents64, dirfd, buf, size);
+}
+
+/*
+*@brief  turns the d_type hint from getdents into the matching S_IF* bits
+*@return the file type bits, or 0 if the filesystem didn't tell us
+*/
+static mode_t dtype_mode(unsigned char d_type)
+{
+  switch (d_type)
+  {
+    case DT_REG:  return S_IFREG;
+    case DT_DIR:  return S_IFDIR;
+    case DT_LNK:  return S_IFLNK;
+    case DT_CHR:  return S_IFCHR;
+    case DT_BLK:  return S_IFBLK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    default:      return 0;
+  }
+}
+
+/*
+*@brief  stats name relative to an open directory, asking the filesystem
+*        only for the fields in mask. flags is AT_SYMLINK_NOFOLLOW to look at
+*        symlinks themselves, or 0 to follow them. Kernels without statx get
+*        an fstatat whose result is copied into stx
+*@return 0 on success, -1 on error
+*/
+static int statx_at(int dirfd, const char* name, int flags, unsigned int mask,
+                    struct statx* stx)
+{
+  static bool no_statx = false;
+
+  if (!no_statx)
+  {
+    if (statx(dirfd, name, flags | AT_NO_AUTOMOUNT, mask, stx) == 0)
+      return 0;
+    if (errno != ENOSYS)
+      return -1;
+    no_statx = true;
+  }
+
+  struct stat st;
+  if (fstatat(dirfd, name, &st, flags) != 0)
+    return -1;
+
+  memset(stx, 0, sizeof(*stx));
+  stx->stx_mask = STATX_BASIC_STATS;
+  stx->stx_mode = st.st_mode;
+  stx->stx_nlink = st.st_nlink;
+  stx->stx_ino = st.st_ino;
+  stx->stx_size = st.st_size;
+  stx->stx_blocks = st.st_blocks;
+  stx->stx_blksize = st.st_blksize;
+  stx->stx_dev_major = major(st.st_dev);
+  stx->stx_dev_minor = minor(st.st_dev);
+  stx->stx_mtime.tv_sec = st.st_mtim.tv_sec;
+  stx->stx_mtime.tv_nsec = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/*
+* @brief  one lookup in a stat batch. A mask of 0 means the entry doesn't
+*         need a stat and is skipped. error is 0 or the errno of the lookup
+*/
+struct stat_request {
+  const char* name;
+  unsigned int mask;
+  mode_t dtype; //file type from getdents, when the caller had one
+  int error;
+  struct statx stx;
+};
+
+#ifdef HAVE_IO_URING
+/*
+* @brief  the shell's io_uring instance, set up on first use. Only the
+*         pieces of the ring layout we touch are kept
+*/
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+};
+
+static struct uring ring = { .fd = -1 };
+static bool ring_broken = false; //setup failed or STATX isn't supported
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+*@brief  creates the ring and maps its submission and completion queues
+*@return 0 on success, -1 if this kernel (or sandbox) has no io_uring
+*/
+static int uring_setup(struct uring* r)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0)
+    return -1;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+  char* cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+  {
+    //the mappings die with the fd's last reference, nothing else to undo
+    close(fd);
+    return -1;
+  }
+
+  r->fd = fd;
+  r->sq_entries = p.sq_entries;
+  r->sq_head = (unsigned*)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  r->sqes = sqes;
+  return 0;
+}
+
+/*
+*@brief  runs a batch of stats through io_uring: keeps the submission queue
+*        full, then reaps completions in whatever order they finish. Each
+*        completion carries its request index, so results land in place
+*@return 0 when every request has a result, -1 if the ring is unusable
+*        (nothing was left in flight and the caller should go synchronous)
+*/
+static int stat_batch_uring(struct uring* r, int dirfd, int flags,
+                            struct stat_request* reqs, size_t count)
+{
+  size_t next = 0, inflight = 0;
+
+  while (true)
+  {
+    while (next < count && reqs[next].mask == 0)
+      reqs[next++].error = 0;
+    if (next == count && inflight == 0)
+      return 0;
+
+    unsigned tail = *r->sq_tail;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    while (next < count && inflight < r->sq_entries && tail - head < r->sq_entries)
+    {
+      struct stat_request* req = &reqs[next];
+      if (req->mask == 0)
+      {
+        req->error = 0;
+        next++;
+        continue;
+      }
+
+      unsigned idx = tail & *r->sq_mask;
+      struct io_uring_sqe* sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = dirfd;
+      sqe->addr = (uintptr_t)req->name;
+      sqe->len = req->mask;
+      sqe->off = (uintptr_t)&req->stx;
+      sqe->statx_flags = flags | AT_NO_AUTOMOUNT;
+      sqe->user_data = next;
+      r->sq_array[idx] = idx;
+      tail++;
+      next++;
+      inflight++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned pending = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (inflight == 0)
+      continue;
+    if (syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      //nothing we queued was taken, so nothing can still be writing into reqs
+      if (pending == inflight)
+        return -1;
+      continue;
+    }
+
+    unsigned chead = *r->cq_head;
+    unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; chead != ctail; chead++)
+    {
+      struct io_uring_cqe* cqe = &r->cqes[chead & *r->cq_mask];
+      struct stat_request* req = &reqs[cqe->user_data];
+      req->error = cqe->res < 0 ? -cqe->res : 0;
+      //kernels before 5.6 reject the opcode itself; redo it the slow way
+      if (req->error == EINVAL)
+      {
+        ring_broken = true;
+        req->error = statx_at(dirfd, req->name, flags, req->mask, &req->stx) ? errno : 0;
+      }
+      inflight--;
+    }
+    __atomic_store_n(r->cq_head, chead, __ATOMIC_RELEASE);
+
+    if (ring_broken && inflight == 0)
+    {
+      //finish whatever is left without the ring
+      for (; next < count; next++)
+        if (reqs[next].mask != 0)
+          reqs[next].error = statx_at(dirfd, reqs[next].name, flags, reqs[next].mask,
+                                      &reqs[next].stx) ? errno : 0;
+      return 0;
+    }
+  }
+}
+#endif
+
+/*
+*@brief  stats every request in the batch relative to dirfd, through
+*        io_uring when it is available and enabled, otherwise one by one
+*/
+static void stat_batch(int dirfd, int flags, struct stat_request* reqs, size_t count)
+{
+#ifdef HAVE_IO_URING
+  //there is one ring; a pipeline stage that finds it busy stats by itself
+  if (stat_backend == STAT_BACKEND_IO_URING && count > 1 &&
+      pthread_mutex_trylock(&ring_lock) == 0)
+  {
+    bool done = false;
+    if (!ring_broken)
+    {
+      if (ring.fd < 0 && uring_setup(&ring) < 0)
+        ring_broken = true;
+      else if (stat_batch_uring(&ring, dirfd, flags, reqs, count) == 0)
+        done = true;
+      else
+        ring_broken = true;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if (done)
+      return;
+  }
+#endif
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (reqs[i].mask == 0)
+      reqs[i].error = 0;
+    else
+      reqs[i].error = statx_at(dirfd, reqs[i].name, flags, reqs[i].mask, &reqs[i].stx) ? errno : 0;
+  }
+}
+
+/*
+* @brief  one step of a compiled glob component. A class is a 256 bit set
+*         of the bytes it matches, already inverted for [!...]
+*/
+enum glob_kind { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS, GLOB_END };
+
+struct glob_step {
+  unsigned char kind;
+  unsigned char ch;
+  uint32_t* set;  //GLOB_CLASS only
+};
+
+/*
+* @brief  one path component of a pattern: either plain text (looked up,
+*         not listed) or a compiled matcher. dot says whether it may match
+*         names starting with '.', which, as in sh, takes a literal '.'
+*/
+struct glob_part {
+  bool literal;
+  bool dot;
+  const char* text;         //unescaped, literal components only
+  struct glob_step* steps;
+};
+
+/*
+*@brief  compiles one component (pattern form, n bytes) into steps
+*@return 0 on success, -1 if out of memory
+*/
+static int glob_compile(struct arena* a, const char* p, size_t n, struct glob_part* part)
+{
+  struct glob_step* steps = arena_alloc(a, (n + 1) * sizeof(*steps));
+  if (!steps)
+    return -1;
+
+  size_t count = 0;
+  bool literal = true;
+  for (size_t i = 0; i < n; i++)
+  {
+    struct glob_step* st = &steps[count++];
+    char c = p[i];
+    st->set = NULL;
+
+    if (c == '\\' && i + 1 < n)
+    {
+      st->kind = GLOB_CHAR;
+      st->ch = (unsigned char)p[++i];
+    }
+    else if (c == '?' || c == '*')
+    {
+      //a run of stars is one star
+      if (c == '*' && count > 1 && steps[count - 2].kind == GLOB_STAR)
+        count--;
+      else
+        st->kind = c == '?' ? GLOB_ANY : GLOB_STAR;
+      literal = false;
+    }
+    else if (c == '[')
+    {
+      //find the end first, without one the [ is just a character
+      size_t j = i + 1;
+      if (j < n && (p[j] == '!' || p[j] == '^'))
+        j++;
+      if (j < n && p[j] == ']')
+        j++;
+      while (j < n && p[j] != ']')
+        j += p[j] == '\\' && j + 1 < n ? 2 : 1;
+      if (j >= n)
+      {
+        st->kind = GLOB_CHAR;
+        st->ch = '[';
+        continue;
+      }
+
+      st->kind = GLOB_CLASS;
+      st->set = arena_alloc(a, 8 * sizeof(uint32_t));
+      if (!st->set)
+        return -1;
+      memset(st->set, 0, 8 * sizeof(uint32_t));
+      size_t k = i + 1;
+      bool negate = p[k] == '!' || p[k] == '^';
+      k += negate;
+      for (bool first = true; k < j; first = false)
+      {
+        unsigned char lo = (unsigned char)p[k];
+        if (lo == '\\' && k + 1 < j)
+          lo = (unsigned char)p[++k];
+        else if (lo == ']' && !first)
+          break;
+        k++;
+        unsigned char hi = lo;
+        if (k + 1 < j && p[k] == '-')
+        {
+          hi = (unsigned char)p[k + 1];
+          if (hi == '\\' && k + 2 < j)
+            hi = (unsigned char)p[++k + 1];
+          k += 2;
+        }
+        for (unsigned int b = lo; b <= hi; b++)
+          st->set[b / 32] |= 1u << (b % 32);
+      }
+      if (negate)
+        for (int w = 0; w < 8; w++)
+          st->set[w] = ~st->set[w];
+      st->set[0] &= ~1u; //never the NUL at the end of a name
+      literal = false;
+      i = j;
+    }
+    else
+    {
+      st->kind = GLOB_CHAR;
+      st->ch = (unsigned char)c;
+    }
+  }
+  steps[count].kind = GLOB_END;
+
+  part->literal = literal;
+  part->steps = steps;
+  part->dot = count > 0 && steps[0].kind == GLOB_CHAR && steps[0].ch == '.';
+  part->text = NULL;
+  if (literal)
+  {
+    char* text = arena_alloc(a, n + 1);
+    if (!text)
+      return -1;
+    memcpy(text, p, n);
+    text[n] = '\0';
+    glob_unescape(text);
+    part->text = text;
+  }
+  return 0;
+}
+
+/*
+*@brief  matches a name against compiled steps. A star remembers where it
+*        was, and a mismatch later on retries from there one byte further,
+*        so there is no recursion and the cost stays linear-ish
+*@return true if the whole name matches
+*/
+static bool glob_match(const struct glob_step* steps, const char* name)
+{
+  const struct glob_step* p = steps;
+  const struct glob_step* star = NULL;
+  const char* retry = NULL;
+  const unsigned char* s = (const unsigned char*)name;
+
+  while (*s)
+  {
+    if (p->kind == GLOB_STAR)
+    {
+      star = ++p;
+      retry = (const char*)s;
+      continue;
+    }
+    if ((p->kind == GLOB_CHAR && p->ch == *s) || p->kind == GLOB_ANY ||
+        (p->kind == GLOB_CLASS && (p->set[*s / 32] >> (*s % 32) & 1)))
+    {
+      p++;
+      s++;
+      continue;
+    }
+    if (!star)
+      return false;
+    p = star;
+    s = (const unsigned char*)++retry;
+  }
+  while (p->kind == GLOB_STAR)
+    p++;
+  return p->kind == GLOB_END;
+}
+
+/*
+* @brief  a directory listing kept for glob. It is only used again while
+*         the directory still has the same device, inode and mtime. Names
+*         are packed one after the other; types holds d_type for each
+*/
+struct glob_dir {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  bool trusted;             //old enough to be reused, see glob_list
+  char* names;
+  size_t len, cap;
+  uint32_t* offs;
+  unsigned char* types;
+  size_t count, slots;
+  uint32_t* order;          //names in order once glob_dir_sort has run
+  size_t sorted;            //entries order covers, 0 until then
+  unsigned long hits;
+};
+
+static struct glob_dir glob_cache[GLOB_CACHE_SIZE];
+static pthread_mutex_t glob_lock = PTHREAD_MUTEX_INITIALIZER; //for --serve workers
+
+/*
+*@brief  adds one name to a listing
+*@return 0 on success, -1 if out of memory
+*/
+static int glob_dir_add(struct glob_dir* d, const char* name, unsigned char type)
+{
+  size_t n = strlen(name) + 1;
+  if (d->len + n > d->cap)
+  {
+    size_t cap = d->cap ? d->cap * 2 : 4096;
+    while (cap < d->len + n)
+      cap *= 2;
+    char* names = realloc(d->names, cap);
+    if (!names)
+      return -1;
+    d->names = names;
+    d->cap = cap;
+  }
+  if (d->count == d->slots)
+  {
+    size_t slots = d->slots ? d->slots * 2 : 256;
+    uint32_t* offs = realloc(d->offs, slots * sizeof(*offs));
+    if (offs)
+      d->offs = offs;
+    unsigned char* types = offs ? realloc(d->types, slots) : NULL;
+    if (!types)
+      return -1;
+    d->types = types;
+    d->slots = slots;
+  }
+  memcpy(d->names + d->len, name, n);
+  d->offs[d->count] = (uint32_t)d->len;
+  d->types[d->count++] = type;
+  d->len += n;
+  return 0;
+}
+
+/*
+*@brief  the entries of a directory, from the cache when it hasn't changed,
+*        otherwise read with getdents in big batches. A listing is only
+*        trusted later if the directory's mtime was already a little in the
+*        past when it was read: timestamps are coarse, and a file created in
+*        the same tick right after the read would not change it
+*@return the listing (valid until the next call), or NULL if the directory
+*        can't be read
+*/
+static struct glob_dir* glob_list(const char* path)
+{
+  struct stat st;
+  if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  struct glob_dir* d = &glob_cache[(st.st_ino * 31 + st.st_dev) % GLOB_CACHE_SIZE];
+  if (d->trusted && d->dev == st.st_dev && d->ino == st.st_ino &&
+      d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec)
+  {
+    d->hits++;
+    return d;
+  }
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  char* buf = fd >= 0 ? malloc(DIRENT_BUFFER_SIZE) : NULL;
+  if (!buf)
+  {
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  d->trusted = false;
+  d->dev = st.st_dev;
+  d->ino = st.st_ino;
+  d->mtime = st.st_mtim;
+  d->len = d->count = d->sorted = 0;
+  d->hits = 0;
+
+  ssize_t nread;
+  int status = 0;
+  while (status == 0 && (nread = read_dirents(fd, buf, DIRENT_BUFFER_SIZE)) > 0)
+  {
+    for (ssize_t pos = 0; pos < nread && status == 0; )
+    {
+      struct linux_dirent64* entry = (struct linux_dirent64*)(buf + pos);
+      pos += entry->d_reclen;
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        status = glob_dir_add(d, entry->d_name, entry->d_type);
+    }
+  }
+  if (nread < 0)
+    status = -1;
+  free(buf);
+  close(fd);
+  if (status < 0)
+  {
+    d->dev = 0;
+    d->ino = 0;
+    return NULL;
+  }
+
+  long long age = (long long)(now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL +
+                  (now.tv_nsec - st.st_mtim.tv_nsec);
+  d->trusted = age > GLOB_RACY_NS;
+  return d;
+}
+
+static int glob_dir_cmp(const void* a, const void* b, void* arg)
+{
+  const struct glob_dir* d = arg;
+  return strcmp(d->names + d->offs[*(const uint32_t*)a], d->names + d->offs[*(const uint32_t*)b]);
+}
+
+/*
+*@brief  puts a listing's names in order (in order, not in the listing
+*        itself, which glob walks as it came), once per listing
+*@return 0 on success, -1 if out of memory
+*/
+static int glob_dir_sort(struct glob_dir* d)
+{
+  if (d->sorted == d->count && (d->order || d->count == 0))
+    return 0;
+  uint32_t* order = realloc(d->order, (d->slots ? d->slots : 1) * sizeof(*order));
+  if (!order)
+    return -1;
+  for (size_t i = 0; i < d->count; i++)
+    order[i] = (uint32_t)i;
+  qsort_r(order, d->count, sizeof(*order), glob_dir_cmp, d);
+  d->order = order;
+  d->sorted = d->count;
+  return 0;
+}
+
+/*
+*@brief  qsort comparison of expanded paths
+*/
+static int glob_path_cmp(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+* @brief  the paths a pattern has matched so far, all in the arena
+*/
+struct glob_paths {
+  char** v;
+  size_t n, cap;
+};
+
+/*
+*@brief  appends a path (or any word) to a list
+*@return 0 on success, -1 if out of memory
+*/
+static int glob_paths_push(struct arena* a, struct glob_paths* paths, char* path)
+{
+  if (paths->n == paths->cap)
+  {
+    size_t cap = paths->cap ? paths->cap * 2 : 16;
+    char** v = arena_alloc(a, cap * sizeof(*v));
+    if (!v)
+      return -1;
+    if (paths->n)
+      memcpy(v, paths->v, paths->n * sizeof(*v));
+    paths->v = v;
+    paths->cap = cap;
+  }
+  paths->v[paths->n++] = path;
+  return 0;
+}
+
+/*
+*@brief  appends prefix/name to a list of paths
+*@return 0 on success, -1 if out of memory
+*/
+static int glob_paths_add(struct arena* a, struct glob_paths* paths,
+                          const char* prefix, const char* name)
+{
+  size_t plen = strlen(prefix), nlen = strlen(name);
+  bool slash = plen > 0 && prefix[plen - 1] != '/';
+  char* path = arena_alloc(a, plen + slash + nlen + 1);
+  if (!path)
+    return -1;
+  memcpy(path, prefix, plen);
+  if (slash)
+    path[plen] = '/';
+  memcpy(path + plen + slash, name, nlen + 1);
+  return glob_paths_push(a, paths, path);
+}
+
+/*
+*@brief  expands one word in pattern form, component by component: plain
+*        components are just appended, the others are matched against the
+*        (cached) listing of every directory found so far
+*@return 0 on success (paths may be empty), -1 if out of memory
+*/
+static int glob_word(struct arena* a, char* word, struct glob_paths* result)
+{
+  struct glob_paths cur = { NULL, 0, 0 };
+  bool matched_any = false;
+  struct glob_part part = { true, false, NULL, NULL };
+
+  const char* p = word;
+  if (*p == '/')
+  {
+    if (glob_paths_add(a, &cur, "", "/") < 0)
+      return -1;
+    while (*p == '/')
+      p++;
+  }
+  else if (glob_paths_add(a, &cur, "", "") < 0)
+    return -1;
+
+  //"*/" only matches directories, and they keep the slash
+  size_t wlen = strlen(word);
+  bool trailing = wlen > 1 && word[wlen - 1] == '/';
+
+  while (*p && cur.n > 0)
+  {
+    const char* end = strchrnul(p, '/');
+    bool last = !trailing && (*end == '\0' || end[strspn(end, "/")] == '\0');
+    if (glob_compile(a, p, (size_t)(end - p), &part) < 0)
+      return -1;
+
+    struct glob_paths next = { NULL, 0, 0 };
+    for (size_t i = 0; i < cur.n; i++)
+    {
+      if (part.literal)
+      {
+        if (glob_paths_add(a, &next, cur.v[i], part.text) < 0)
+          return -1;
+        continue;
+      }
+
+      struct glob_dir* d = glob_list(cur.v[i][0] ? cur.v[i] : ".");
+      for (size_t k = 0; d && k < d->count; k++)
+      {
+        const char* name = d->names + d->offs[k];
+        if (name[0] == '.' && !part.dot)
+          continue;
+        //only directories (or links that may be ones) lead anywhere
+        if (!last && d->types[k] != DT_DIR && d->types[k] != DT_LNK &&
+            d->types[k] != DT_UNKNOWN)
+          continue;
+        if (glob_match(part.steps, name) && glob_paths_add(a, &next, cur.v[i], name) < 0)
+          return -1;
+      }
+    }
+    matched_any |= !part.literal;
+    cur = next;
+    p = end;
+    while (*p == '/')
+      p++;
+  }
+
+  //a plain component after a pattern has to exist, nothing checked it yet
+  size_t start = result->n;
+  for (size_t i = 0; i < cur.n; i++)
+  {
+    struct stat st;
+    if (trailing && matched_any)
+    {
+      //joining with "" puts the slash back on
+      if (stat(cur.v[i], &st) == 0 && S_ISDIR(st.st_mode) &&
+          glob_paths_add(a, result, cur.v[i], "") < 0)
+        return -1;
+      continue;
+    }
+    if (matched_any && part.literal && lstat(cur.v[i], &st) < 0)
+      continue;
+    if (glob_paths_push(a, result, cur.v[i]) < 0)
+      return -1;
+  }
+  qsort(result->v + start, result->n - start, sizeof(char*), glob_path_cmp);
+  return 0;
+}
+
+/**
+ * @brief  Replaces the words tokenize flagged as patterns with the paths
+ *         they match, in sorted order. A pattern that matches nothing is
+ *         kept, minus its escapes, as in sh
+ * @param  Arena for the new words, and the argc/argv/flags from tokenize,
+ *         which are updated
+ * @return 0 on success, -1 if out of memory
+ */
+int glob_expand(struct arena* a, int* argc, char*** argv, const bool* globbed) {
+  int i = 0;
+  while (i < *argc && !globbed[i])
+    i++;
+  if (i == *argc)
+    return 0;
+
+  struct glob_paths words = { NULL, 0, 0 };
+  int status = 0;
+  pthread_mutex_lock(&glob_lock);
+  for (i = 0; i < *argc && status == 0; i++)
+  {
+    char* word = (*argv)[i];
+    size_t before = words.n;
+    if (globbed[i])
+      status = glob_word(a, word, &words);
+    if (status < 0 || words.n > before)
+      continue;
+    if (globbed[i])
+      glob_unescape(word);
+    //the very same pointer, it may be an operator
+    status = glob_paths_push(a, &words, word);
+  }
+  pthread_mutex_unlock(&glob_lock);
+  if (status < 0 || glob_paths_push(a, &words, NULL) < 0)
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(ENOMEM));
+    return -1;
+  }
+  *argc = (int)words.n - 1;
+  *argv = words.v;
+  return 0;
+}
+
+/*
+* @brief  a directory found by the walker. It is opened relative to its
+*         parent's fd once a worker gets to it, and if held, that fd stays
+*         open while any subdirectory still needs it. Deep down only every
+*         WALK_FD_STRIDE'th level is held, so a deep chain doesn't run out
+*         of fds; the others close once read, and their subdirectories
+*         open a short path from the nearest held ancestor. refs counts
+*         the directory itself until it has been read, plus one for every
+*         subdirectory that isn't finished yet, so the last one out closes
+*         it (post-order). sum is only touched by the worker reading the
+*         directory, below is where finished subdirectories add theirs, so
+*         totals merge without locks
+*/
+struct walk_dir {
+  struct walk_dir* parent;
+  int fd;
+  int depth;
+  bool held;     //keeps fd open for the subdirectories
+  bool opened;   //fd could be opened (it may be closed again since)
+  atomic_int refs;
+  uintmax_t sum;          //for visitors: what the directory's own entries add up to
+  atomic_uintmax_t below; //for visitors: what its subdirectories passed up
+  void* data;             //for visitors, while the directory is being read
+  size_t name_off; //where the last component starts in path
+  size_t path_len;
+  char path[];     //as printed: the root argument joined with each name
+};
+
+/*
+* @brief  a worker's queue of directories. The owner pushes and pops at the
+*         tail (depth first, the directory it just read is still in cache),
+*         idle workers steal from the head, where the oldest and usually
+*         biggest subtrees are
+*/
+struct walk_deque {
+  pthread_mutex_t lock;
+  struct walk_dir** items;
+  size_t head, tail, cap; //cap is a power of two, items live in [head, tail)
+};
+
+/*
+* @brief  sorted-mode output lines, copied into big chunks so a listing of
+*         millions of entries doesn't mean millions of mallocs
+*/
+struct walk_chunk {
+  struct walk_chunk* next;
+  size_t used;
+  char data[WALK_CHUNK_SIZE];
+};
+
+struct walker;
+
+/*
+* @brief  everything one walker thread owns. Visitors build their output line
+*         in line (path is scratch space for joining names) and hand it over
+*         with walk_emit
+*/
+struct walk_worker {
+  struct walker* w;
+  int id;
+  pthread_t thread;
+  bool started;
+  struct walk_deque deque;
+  char* dirents;
+  struct strbuf path, line;
+  struct outbuf* out;
+  struct walk_chunk* chunks;
+  char** lines;
+  size_t nlines, lines_cap;
+};
+
+/*
+* @brief  what a walk does with each entry. Entries are stat'ed for
+*         stat_mask before visit is called (stx is NULL when nothing was
+*         needed). leave runs once a directory and everything below it is done.
+*         enter, if set, gets each directory as soon as it is open and may
+*         deal with it itself (returning true), then it isn't read; otherwise
+*         done follows the reading, complete if every entry made it. With
+*         enter, entries known to be directories aren't stat'ed: enter can
+*         ask the directory itself
+*/
+struct walk_ops {
+  unsigned int stat_mask;
+  void (*visit)(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                mode_t mode, const struct statx* stx);
+  void (*leave)(struct walk_worker* wk, struct walk_dir* dir);
+  void* arg;
+  bool (*enter)(struct walk_worker* wk, struct walk_dir* dir);
+  void (*done)(struct walk_worker* wk, struct walk_dir* dir, bool complete);
+};
+
+/*
+* @brief  one parallel walk. pending counts directories queued or being
+*         read, the walk is over when it reaches 0. work_seq changes with
+*         every push so idle workers can sleep without missing new work
+*/
+struct walker {
+  const struct walk_ops* ops;
+  bool sorted;
+  int nworkers;
+  struct walk_worker* workers;
+  atomic_long pending;
+  atomic_ulong work_seq;
+  atomic_int idle;
+  atomic_bool failed;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  pthread_mutex_t out_lock;
+  int held_depth;       //directories above this depth all keep their fd
+  struct exec_ctx* ctx; //of the command walking
+};
+
+/*
+*@brief  adds a directory at the owner's end of a deque
+*@return 0 on success, -1 if out of memory
+*/
+static int deque_push(struct walk_deque* dq, struct walk_dir* dir)
+{
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail - dq->head == dq->cap)
+  {
+    size_t cap = dq->cap ? dq->cap * 2 : 64;
+    struct walk_dir** items = malloc(cap * sizeof(*items));
+    if (!items)
+    {
+      pthread_mutex_unlock(&dq->lock);
+      return -1;
+    }
+    for (size_t i = dq->head; i != dq->tail; i++)
+      items[i & (cap - 1)] = dq->items[i & (dq->cap - 1)];
+    free(dq->items);
+    dq->items = items;
+    dq->cap = cap;
+  }
+  dq->items[dq->tail++ & (dq->cap - 1)] = dir;
+  pthread_mutex_unlock(&dq->lock);
+  return 0;
+}
+
+/*
+*@brief  takes the newest directory (owner) or the oldest one (thief)
+*@return the directory, or NULL if the deque is empty
+*/
+static struct walk_dir* deque_take(struct walk_deque* dq, bool steal)
+{
+  struct walk_dir* dir = NULL;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->head != dq->tail)
+    dir = steal ? dq->items[dq->head++ & (dq->cap - 1)]
+                : dq->items[--dq->tail & (dq->cap - 1)];
+  pthread_mutex_unlock(&dq->lock);
+  return dir;
+}
+
+/*
+*@brief  puts dir/name into sb, without doubling a trailing slash on dir
+*/
+static void walk_join(struct strbuf* sb, const char* dir, const char* name)
+{
+  size_t len = strlen(dir);
+  sb->len = 0;
+  sb_write(sb, dir, len);
+  if (len == 0 || dir[len - 1] != '/')
+    sb_write(sb, "/", 1);
+  sb_str(sb, name);
+}
+
+/*
+*@brief  orders output lines by path so each directory comes right before
+*        its contents: the '\t'/'\n' ending a path sorts first, then '/'
+*/
+static int walk_line_cmp(const void* a, const void* b)
+{
+  const unsigned char* x = *(const unsigned char* const*)a;
+  const unsigned char* y = *(const unsigned char* const*)b;
+
+  for (;; x++, y++)
+  {
+    unsigned int cx = *x == '\t' || *x == '\n' ? 0 : *x == '/' ? 1 : *x + 2u;
+    unsigned int cy = *y == '\t' || *y == '\n' ? 0 : *y == '/' ? 1 : *y + 2u;
+    if (cx != cy || *x == '\0')
+      return (cx > cy) - (cx < cy);
+  }
+}
+
+/*
+*@brief  hands over the line a visitor built. In completion order it goes
+*        to the worker's output buffer, which only ever flushes whole
+*        lines; in sorted order it is kept until the walk is over
+*/
+static void walk_emit(struct walk_worker* wk)
+{
+  struct strbuf* line = &wk->line;
+
+  if (line->failed)
+  {
+    atomic_store(&wk->w->failed, true);
+  }
+  else if (!wk->w->sorted)
+  {
+    out_write(wk->out, line->data, line->len);
+  }
+  else
+  {
+    struct walk_chunk* chunk = wk->chunks;
+    if (!chunk || WALK_CHUNK_SIZE - chunk->used < line->len + 1)
+    {
+      //deep walks open paths relative to a held ancestor, so a path can
+      //be longer than PATH_MAX; the limit on a line is WALK_CHUNK_SIZE
+      chunk = line->len + 1 > WALK_CHUNK_SIZE ? NULL : malloc(sizeof(*chunk));
+      if (!chunk)
+      {
+        fprintf(err_out(), "walk: %.64s...: %s\n", line->data,
+                line->len + 1 > WALK_CHUNK_SIZE ? "line too long to sort" : strerror(ENOMEM));
+        atomic_store(&wk->w->failed, true);
+        line->len = 0;
+        return;
+      }
+      chunk->next = wk->chunks;
+      chunk->used = 0;
+      wk->chunks = chunk;
+    }
+    if (wk->nlines == wk->lines_cap)
+    {
+      size_t cap = wk->lines_cap ? wk->lines_cap * 2 : 4096;
+      char** lines = realloc(wk->lines, cap * sizeof(*lines));
+      if (!lines)
+      {
+        atomic_store(&wk->w->failed, true);
+        line->len = 0;
+        return;
+      }
+      wk->lines = lines;
+      wk->lines_cap = cap;
+    }
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, line->data, line->len + 1);
+    chunk->used += line->len + 1;
+    wk->lines[wk->nlines++] = copy;
+  }
+  line->len = 0;
+}
+
+static void walk_process(struct walk_worker* wk, struct walk_dir* dir);
+
+/*
+*@brief  queues a directory on this worker and wakes up an idle one
+*/
+static void walk_push(struct walk_worker* wk, struct walk_dir* dir)
+{
+  struct walker* w = wk->w;
+
+  atomic_fetch_add(&w->pending, 1);
+  if (deque_push(&wk->deque, dir) < 0)
+  {
+    //can't queue it, so read it right here instead
+    walk_process(wk, dir);
+    return;
+  }
+  atomic_fetch_add(&w->work_seq, 1);
+  if (atomic_load(&w->idle) > 0)
+  {
+    pthread_mutex_lock(&w->idle_lock);
+    pthread_cond_broadcast(&w->idle_cond);
+    pthread_mutex_unlock(&w->idle_lock);
+  }
+}
+
+/*
+*@brief  makes the node for a subdirectory, holding a reference on parent
+*@return the node, or NULL if out of memory
+*/
+static struct walk_dir* walk_child(struct walk_worker* wk, struct walk_dir* parent,
+                                   const char* name)
+{
+  walk_join(&wk->path, parent->path, name);
+  if (wk->path.failed)
+    return NULL;
+
+  struct walk_dir* dir = malloc(sizeof(*dir) + wk->path.len + 1);
+  if (!dir)
+    return NULL;
+  dir->parent = parent;
+  dir->fd = -1;
+  dir->depth = parent->depth + 1;
+  dir->held = dir->depth < wk->w->held_depth || dir->depth % WALK_FD_STRIDE == 0;
+  dir->opened = false;
+  atomic_init(&dir->refs, 1);
+  dir->sum = 0;
+  atomic_init(&dir->below, 0);
+  dir->data = NULL;
+  dir->name_off = wk->path.len - strlen(name);
+  dir->path_len = wk->path.len;
+  memcpy(dir->path, wk->path.data, wk->path.len + 1);
+  atomic_fetch_add(&parent->refs, 1);
+  return dir;
+}
+
+/*
+*@brief  opens a directory below at one component at a time, so no symlink
+*        on the way is followed
+*@return the new fd, or -1 on error
+*/
+static int walk_open_path(int at, const char* rel)
+{
+  char name[NAME_MAX + 1];
+  int fd = at;
+
+  while (true)
+  {
+    const char* slash = strchr(rel, '/');
+    size_t len = slash ? (size_t)(slash - rel) : strlen(rel);
+    int next = -1;
+    if (len > NAME_MAX)
+      errno = ENAMETOOLONG;
+    else
+    {
+      memcpy(name, rel, len);
+      name[len] = '\0';
+      next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd != at)
+    {
+      int saved = errno;
+      close(fd);
+      errno = saved;
+    }
+    if (next < 0 || !slash)
+      return next;
+    fd = next;
+    rel = slash + 1;
+  }
+}
+
+/*
+*@brief  opens a new fd on dir (not the root), from the nearest ancestor
+*        that holds one
+*@return the fd, or -1 on error
+*/
+static int walk_reopen(const struct walk_dir* dir)
+{
+  const struct walk_dir* at = dir->parent;
+  while (!at->held)
+    at = at->parent;
+  if (at->fd < 0)
+  {
+    errno = EBADF;
+    return -1;
+  }
+  const char* rel = dir->path + at->path_len;
+  if (*rel == '/')
+    rel++;
+  return walk_open_path(at->fd, rel);
+}
+
+/*
+*@brief  queues the subdirectory name of dir
+*@return 0 on success, -1 if out of memory (reported)
+*/
+static int walk_descend(struct walk_worker* wk, struct walk_dir* dir, const char* name)
+{
+  struct walk_dir* child = walk_child(wk, dir, name);
+  if (!child)
+  {
+    fprintf(err_out(), "walk: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+    atomic_store(&wk->w->failed, true);
+    return -1;
+  }
+  walk_push(wk, child);
+  return 0;
+}
+
+/*
+*@brief  drops one reference on dir. Whoever drops the last one finishes
+*        the directory and then lets go of its parent the same way
+*/
+static void walk_release(struct walk_worker* wk, struct walk_dir* dir)
+{
+  while (dir && atomic_fetch_sub(&dir->refs, 1) == 1)
+  {
+    struct walk_dir* parent = dir->parent;
+    if (wk->w->ops->leave)
+      wk->w->ops->leave(wk, dir);
+    if (dir->fd >= 0)
+      close(dir->fd);
+    free(dir);
+    dir = parent;
+  }
+}
+
+/*
+*@brief  reads one directory: every entry goes to the visitor and every
+*        subdirectory is queued. Symlinks to directories are not followed
+*/
+static void walk_process(struct walk_worker* wk, struct walk_dir* dir)
+{
+  struct walker* w = wk->w;
+  if (!dir->parent)
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  else if (dir->parent->held)
+    dir->fd = openat(dir->parent->fd, dir->path + dir->name_off,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  else
+    dir->fd = walk_reopen(dir);
+  dir->opened = dir->fd >= 0;
+  if (dir->fd < 0)
+  {
+    fprintf(err_out(), "Could not open directory %s %s\n", dir->path, strerror(errno));
+    atomic_store(&w->failed, true);
+  }
+
+  bool reading = dir->fd >= 0 && !(w->ops->enter && w->ops->enter(wk, dir));
+  bool complete = true;
+  ssize_t nread = 0;
+  while (reading && (nread = read_dirents(dir->fd, wk->dirents, DIRENT_BUFFER_SIZE)) > 0)
+  {
+    for (ssize_t pos = 0; pos < nread; )
+    {
+      struct linux_dirent64* entry = (struct linux_dirent64*)(wk->dirents + pos);
+      pos += entry->d_reclen;
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        continue;
+
+      mode_t mode = dtype_mode(entry->d_type);
+      unsigned int mask = (S_ISDIR(mode) && w->ops->enter ? 0 : w->ops->stat_mask) |
+                          (mode ? 0 : STATX_TYPE);
+      struct statx stx;
+      if (mask && statx_at(dir->fd, entry->d_name, AT_SYMLINK_NOFOLLOW, mask, &stx) != 0)
+      {
+        fprintf(err_out(), "stat failed for '%s/%s': %s\n", dir->path, entry->d_name,
+                strerror(errno));
+        atomic_store(&w->failed, true);
+        complete = false;
+        continue;
+      }
+      if (!mode)
+        mode = stx.stx_mode & S_IFMT;
+
+      w->ops->visit(wk, dir, entry->d_name, mode, mask ? &stx : NULL);
+
+      if (S_ISDIR(mode) && walk_descend(wk, dir, entry->d_name) < 0)
+        complete = false;
+    }
+  }
+  if (nread < 0)
+  {
+    fprintf(err_out(), "Error reading directory %s :  %s\n", dir->path, strerror(errno));
+    atomic_store(&w->failed, true);
+    complete = false;
+  }
+  if (reading && w->ops->done)
+    w->ops->done(wk, dir, complete);
+  if (!dir->held && dir->fd >= 0)
+  {
+    //nothing below uses it, they go from the nearest held ancestor
+    close(dir->fd);
+    dir->fd = -1;
+  }
+
+  walk_release(wk, dir);
+  if (atomic_fetch_sub(&w->pending, 1) == 1)
+  {
+    //that was the last directory anywhere, wake everyone up to go home
+    pthread_mutex_lock(&w->idle_lock);
+    pthread_cond_broadcast(&w->idle_cond);
+    pthread_mutex_unlock(&w->idle_lock);
+  }
+}
+
+/*
+*@brief  finds the next directory for a worker: its own newest one first,
+*        then the oldest one of any other worker, otherwise it sleeps until
+*        something is pushed or the walk is over
+*@return the directory, or NULL when there is nothing left at all
+*/
+static struct walk_dir* walk_next(struct walk_worker* wk)
+{
+  struct walker* w = wk->w;
+
+  while (true)
+  {
+    unsigned long seq = atomic_load(&w->work_seq);
+    struct walk_dir* dir = deque_take(&wk->deque, false);
+    for (int i = 1; !dir && i < w->nworkers; i++)
+      dir = deque_take(&w->workers[(wk->id + i) % w->nworkers].deque, true);
+    if (dir)
+      return dir;
+    if (atomic_load(&w->pending) == 0)
+      return NULL;
+
+    pthread_mutex_lock(&w->idle_lock);
+    atomic_fetch_add(&w->idle, 1);
+    while (atomic_load(&w->work_seq) == seq && atomic_load(&w->pending) != 0)
+      pthread_cond_wait(&w->idle_cond, &w->idle_lock);
+    atomic_fetch_sub(&w->idle, 1);
+    pthread_mutex_unlock(&w->idle_lock);
+  }
+}
+
+/*
+*@brief  thread body of every walker worker
+*/
+static void* walk_worker_main(void* arg)
+{
+  struct walk_worker* wk = arg;
+  struct walk_dir* dir;
+
+  ctx = wk->w->ctx;
+  while ((dir = walk_next(wk)) != NULL)
+    walk_process(wk, dir);
+  return NULL;
+}
+
+/*
+*@brief  how many walker threads to run: walk_threads, or one per CPU
+*/
+static int walk_thread_count(void)
+{
+  long n = walk_threads ? walk_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int)n;
+}
+
+/*
+*@brief  walks the tree below root on a pool of threads, calling the
+*        visitor for every entry. root itself is not visited. Output from
+*        walk_emit comes out in completion order, or sorted by path once
+*        the walk is over
+*@return -1 if anything could not be read, 0 on success
+*/
+static int walk_tree(const char* root, const struct walk_ops* ops, bool sorted)
+{
+  struct walker w;
+  memset(&w, 0, sizeof(w));
+  w.ops = ops;
+  w.ctx = ctx;
+  w.sorted = sorted;
+  w.nworkers = walk_thread_count();
+  //every worker's chain of directories can hold fds: half of the limit is
+  //left for everything else, and half of the rest for the strided levels
+  struct rlimit nofile;
+  rlim_t fds = getrlimit(RLIMIT_NOFILE, &nofile) == 0 ? nofile.rlim_cur : 1024;
+  if (fds == RLIM_INFINITY || fds > INT_MAX)
+    fds = INT_MAX;
+  w.held_depth = (int)(fds / 4 / (rlim_t)w.nworkers);
+  if (w.held_depth < WALK_FD_STRIDE)
+    w.held_depth = WALK_FD_STRIDE;
+  atomic_init(&w.pending, 0);
+  atomic_init(&w.work_seq, 0);
+  atomic_init(&w.idle, 0);
+  atomic_init(&w.failed, false);
+  pthread_mutex_init(&w.idle_lock, NULL);
+  pthread_cond_init(&w.idle_cond, NULL);
+  pthread_mutex_init(&w.out_lock, NULL);
+
+  size_t rootlen = strlen(root);
+  struct walk_dir* top = malloc(sizeof(*top) + rootlen + 1);
+  w.workers = calloc(w.nworkers, sizeof(*w.workers));
+  if (!top || !w.workers)
+  {
+    fprintf(err_out(), "walk: %s\n", strerror(ENOMEM));
+    free(top);
+    free(w.workers);
+    return -1;
+  }
+  top->parent = NULL;
+  top->fd = -1;
+  top->depth = 0;
+  top->held = true;
+  top->opened = false;
+  atomic_init(&top->refs, 1);
+  top->sum = 0;
+  atomic_init(&top->below, 0);
+  top->data = NULL;
+  top->name_off = 0;
+  top->path_len = rootlen;
+  memcpy(top->path, root, rootlen + 1);
+
+  //the workers write to the fd directly, so whatever came before goes first
+  out_flush(ctx->out);
+
+  for (int i = 0; i < w.nworkers; i++)
+    pthread_mutex_init(&w.workers[i].deque.lock, NULL);
+
+  int nready = 0;
+  for (int i = 0; i < w.nworkers; i++)
+  {
+    struct walk_worker* wk = &w.workers[i];
+    wk->w = &w;
+    wk->id = i;
+    wk->dirents = malloc(DIRENT_BUFFER_SIZE);
+    wk->out = out_alloc();
+    if (!wk->dirents || !wk->out)
+      break;
+    out_init(wk->out, ctx->out->fd);
+    wk->out->lock = &w.out_lock;
+    nready++;
+  }
+
+  int status = -1;
+  if (nready == w.nworkers)
+  {
+    walk_push(&w.workers[0], top);
+    top = NULL;
+
+    //worker 0 is this thread; if a thread can't be started its deque just
+    //stays empty and the others pick up the slack
+    for (int i = 1; i < w.nworkers; i++)
+      w.workers[i].started = pthread_create(&w.workers[i].thread, NULL, walk_worker_main,
+                                            &w.workers[i]) == 0;
+    walk_worker_main(&w.workers[0]);
+    for (int i = 1; i < w.nworkers; i++)
+      if (w.workers[i].started)
+        pthread_join(w.workers[i].thread, NULL);
+    status = atomic_load(&w.failed) ? -1 : 0;
+  }
+  else
+  {
+    fprintf(err_out(), "walk: %s\n", strerror(ENOMEM));
+  }
+  free(top);
+
+  //sorted output is merged from every worker and printed from here
+  size_t nlines = 0;
+  for (int i = 0; i < w.nworkers; i++)
+    nlines += w.workers[i].nlines;
+  char** lines = sorted && nlines ? malloc(nlines * sizeof(*lines)) : NULL;
+  if (sorted && nlines && !lines)
+  {
+    fprintf(err_out(), "walk: %s\n", strerror(ENOMEM));
+    status = -1;
+  }
+  nlines = 0;
+
+  for (int i = 0; i < w.nworkers; i++)
+  {
+    struct walk_worker* wk = &w.workers[i];
+    if (wk->out)
+      out_flush(wk->out);
+    if (lines)
+    {
+      memcpy(lines + nlines, wk->lines, wk->nlines * sizeof(*lines));
+      nlines += wk->nlines;
+    }
+  }
+
+  if (lines)
+  {
+    qsort(lines, nlines, sizeof(*lines), walk_line_cmp);
+    for (size_t i = 0; i < nlines; i++)
+      out_str(ctx->out, lines[i]);
+    free(lines);
+  }
+
+  for (int i = 0; i < w.nworkers; i++)
+  {
+    struct walk_worker* wk = &w.workers[i];
+    while (wk->chunks)
+    {
+      struct walk_chunk* next = wk->chunks->next;
+      free(wk->chunks);
+      wk->chunks = next;
+    }
+    free(wk->lines);
+    free(wk->dirents);
+    free(wk->out);
+    free(wk->path.data);
+    free(wk->line.data);
+    free(wk->deque.items);
+    pthread_mutex_destroy(&wk->deque.lock);
+  }
+  free(w.workers);
+  pthread_mutex_destroy(&w.idle_lock);
+  pthread_cond_destroy(&w.idle_cond);
+  pthread_mutex_destroy(&w.out_lock);
+  return status;
+}
+
+/*
+* @brief  the entries of a directory kept around for sorted output, after
+*         their dirent batches have been overwritten. Struct of arrays: the
+*         names are packed back to back in one buffer and each field has an
+*         array of its own, so a sort pass only touches the key it sorts on
+*/
+struct ls_entries {
+  struct strbuf names; //NUL terminated names, one after another
+  uint32_t* name_at;   //where each name starts in names
+  mode_t* mode;
+  off_t* size;
+  int64_t* mtime;      //ns since the epoch
+  size_t count, cap;
+};
+
+/*
+* @brief  what ls sorts on
+*/
+enum ls_sort { LS_UNSORTED, LS_BY_NAME, LS_BY_SIZE, LS_BY_MTIME };
+
+/*
+*@brief  the name of entry i
+*/
+static const char* ls_name(const struct ls_entries* e, uint32_t i)
+{
+  return e->names.data + e->name_at[i];
+}
+
+/*
+*@brief  appends an entry, growing every array together
+*@return 0 on success, -1 when out of memory
+*/
+static int ls_entries_push(struct ls_entries* e, const char* name, mode_t mode, off_t size,
+                           int64_t mtime)
+{
+  if (e->count == e->cap)
+  {
+    size_t cap = e->cap ? e->cap * 2 : 1024;
+    uint32_t* name_at = realloc(e->name_at, cap * sizeof(*name_at));
+    if (name_at)
+      e->name_at = name_at;
+    mode_t* modes = realloc(e->mode, cap * sizeof(*modes));
+    if (modes)
+      e->mode = modes;
+    off_t* sizes = realloc(e->size, cap * sizeof(*sizes));
+    if (sizes)
+      e->size = sizes;
+    int64_t* mtimes = realloc(e->mtime, cap * sizeof(*mtimes));
+    if (mtimes)
+      e->mtime = mtimes;
+    if (!name_at || !modes || !sizes || !mtimes || cap > UINT32_MAX)
+      return -1;
+    e->cap = cap;
+  }
+  if (e->names.len > UINT32_MAX)
+    return -1;
+
+  size_t at = e->names.len;
+  sb_write(&e->names, name, strlen(name) + 1);
+  if (e->names.failed)
+    return -1;
+  e->name_at[e->count] = (uint32_t)at;
+  e->mode[e->count] = mode;
+  e->size[e->count] = size;
+  e->mtime[e->count] = mtime;
+  e->count++;
+  return 0;
+}
+
+static void ls_entries_free(struct ls_entries* e)
+{
+  free(e->names.data);
+  free(e->name_at);
+  free(e->mode);
+  free(e->size);
+  free(e->mtime);
+}
+
+/*
+* @brief  an entry on its way through the radix sort: its key and index
+*/
+struct ls_key {
+  uint64_t key;
+  uint32_t index;
+};
+
+/*
+*@brief  sort key of entry i: the first 8 bytes of the name big endian (so
+*        integer order is byte order), or the size or mtime flipped so the
+*        biggest / newest comes first like ls -S / ls -t
+*/
+static uint64_t ls_key_of(const struct ls_entries* e, uint32_t i, enum ls_sort by)
+{
+  if (by == LS_BY_SIZE)
+    return ~(uint64_t)e->size[i];
+  if (by == LS_BY_MTIME)
+    return ~((uint64_t)e->mtime[i] ^ ((uint64_t)1 << 63));
+
+  const unsigned char* name = (const unsigned char*)ls_name(e, i);
+  uint64_t key = 0;
+  int n = 0;
+  for (; n < 8 && name[n]; n++)
+    key = key << 8 | name[n];
+  return n ? key << (8 * (8 - n)) : 0;
+}
+
+/*
+*@brief  qsort_r comparison for entries whose keys tie: by whole name
+*/
+static int ls_name_cmp(const void* a, const void* b, void* arg)
+{
+  const struct ls_entries* e = arg;
+  return strcmp(ls_name(e, ((const struct ls_key*)a)->index),
+                ls_name(e, ((const struct ls_key*)b)->index));
+}
+
+/*
+*@brief  works out the order to print entries in. An LSD radix sort, a byte
+*        per pass, over (key, index) pairs; passes where every key has the
+*        same byte are skipped, which is most of them for sizes and times.
+*        Runs that still tie (equal sizes or times, names sharing 8 bytes)
+*        are put in name order afterwards
+*@return the entry indexes in order, to free, or NULL when out of memory
+*/
+static uint32_t* ls_sort(const struct ls_entries* e, enum ls_sort by)
+{
+  size_t n = e->count;
+  struct ls_key* keys = malloc((n ? n : 1) * sizeof(*keys));
+  struct ls_key* tmp = malloc((n ? n : 1) * sizeof(*tmp));
+  uint32_t* order = malloc((n ? n : 1) * sizeof(*order));
+  size_t counts[8][256];
+
+  if (!keys || !tmp || !order)
+  {
+    free(keys);
+    free(tmp);
+    free(order);
+    return NULL;
+  }
+
+  //every byte's histogram in one pass over the keys
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < n; i++)
+  {
+    keys[i].key = ls_key_of(e, (uint32_t)i, by);
+    keys[i].index = (uint32_t)i;
+    for (int b = 0; b < 8; b++)
+      counts[b][(keys[i].key >> (8 * b)) & 0xff]++;
+  }
+
+  for (int b = 0; b < 8; b++)
+  {
+    size_t* count = counts[b];
+    if (n == 0 || count[(keys[0].key >> (8 * b)) & 0xff] == n)
+      continue;
+    size_t pos = 0;
+    for (int v = 0; v < 256; v++)
+    {
+      size_t c = count[v];
+      count[v] = pos;
+      pos += c;
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[count[(keys[i].key >> (8 * b)) & 0xff]++] = keys[i];
+    struct ls_key* swap = keys;
+    keys = tmp;
+    tmp = swap;
+  }
+
+  for (size_t i = 0; i < n; )
+  {
+    size_t j = i + 1;
+    while (j < n && keys[j].key == keys[i].key)
+      j++;
+    if (j - i > 1)
+      qsort_r(keys + i, j - i, sizeof(*keys), ls_name_cmp, (void*)e);
+    i = j;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    order[i] = keys[i].index;
+  free(keys);
+  free(tmp);
+  return order;
+}
+
+/*
+* @brief  one name in a cached directory: what lstat said about it, or that
+*         it doesn't exist
+*/
+struct meta_entry {
+  struct meta_entry* next;                 //hash chain
+  struct meta_entry *dir_prev, *dir_next;  //the other names of the directory
+  struct meta_dir* dir;
+  uint32_t hash;
+  int error;                               //0, or ENOENT
+  struct statx stx;                        //STATX_BASIC_STATS, symlinks not followed
+  char name[];
+};
+
+/*
+* @brief  a directory the metadata cache knows things about, watched with
+*         inotify so anything that changes in it drops what was cached.
+*         gen changes with every event, so a lookup that raced with a change
+*         can tell and not store what it found
+*/
+struct meta_dir {
+  struct meta_dir* next;    //by (dev, ino)
+  struct meta_dir* wd_next; //by watch descriptor
+  dev_t dev;
+  ino_t ino;
+  int wd;
+  unsigned long gen;
+  struct meta_entry* entries;
+  struct ls_entries* listing; //the whole directory as ls last read it
+};
+
+/*
+* @brief  the optional metadata cache behind stat and ls ("set meta_cache
+*         on"). Entries are keyed by their directory (dev, inode) and name,
+*         the way stat_batch looks them up relative to a dirfd. Everything
+*         is under one lock: lookups are short, and the stats themselves
+*         happen outside it
+*/
+static struct {
+  pthread_mutex_t lock;
+  int fd; //inotify; -1 until first used, -2 if there is none
+  struct meta_entry** table;
+  size_t buckets, count;
+  struct meta_dir* dirs[META_DIR_HASH];
+  struct meta_dir* by_wd[META_DIR_HASH];
+  size_t ndirs, nlistings, bytes;
+  unsigned long gen;
+  unsigned long hits, misses, invalidations;
+} meta = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, 0, 0, { NULL }, { NULL }, 0, 0, 0, 0, 0, 0, 0 };
+
+/*
+*@brief  memory a listing takes
+*/
+static size_t ls_entries_bytes(const struct ls_entries* e)
+{
+  return sizeof(*e) + e->names.cap +
+         e->cap * (sizeof(*e->name_at) + sizeof(*e->mode) + sizeof(*e->size) + sizeof(*e->mtime));
+}
+
+/*
+*@brief  copies a listing, for use outside the lock
+*@return 0 on success, -1 when out of memory
+*/
+static int ls_entries_copy(struct ls_entries* dst, const struct ls_entries* src)
+{
+  memset(dst, 0, sizeof(*dst));
+  size_t n = src->count ? src->count : 1;
+  dst->name_at = malloc(n * sizeof(*dst->name_at));
+  dst->mode = malloc(n * sizeof(*dst->mode));
+  dst->size = malloc(n * sizeof(*dst->size));
+  dst->mtime = malloc(n * sizeof(*dst->mtime));
+  sb_write(&dst->names, src->names.data, src->names.len);
+  if (!dst->name_at || !dst->mode || !dst->size || !dst->mtime || dst->names.failed)
+  {
+    ls_entries_free(dst);
+    memset(dst, 0, sizeof(*dst));
+    return -1;
+  }
+  memcpy(dst->name_at, src->name_at, src->count * sizeof(*dst->name_at));
+  memcpy(dst->mode, src->mode, src->count * sizeof(*dst->mode));
+  memcpy(dst->size, src->size, src->count * sizeof(*dst->size));
+  memcpy(dst->mtime, src->mtime, src->count * sizeof(*dst->mtime));
+  dst->count = dst->cap = src->count;
+  return 0;
+}
+
+static uint32_t meta_hash(const struct meta_dir* d, const char* name)
+{
+  uint32_t hash = 2166136261u ^ (uint32_t)d->ino; //FNV-1a
+  for (const char* c = name; *c; c++)
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  return hash;
+}
+
+/*
+*@brief  frees one entry. Lock held
+*/
+static void meta_drop_entry(struct meta_entry* e)
+{
+  struct meta_entry** slot = &meta.table[e->hash & (meta.buckets - 1)];
+  while (*slot != e)
+    slot = &(*slot)->next;
+  *slot = e->next;
+  if (e->dir_prev)
+    e->dir_prev->dir_next = e->dir_next;
+  else
+    e->dir->entries = e->dir_next;
+  if (e->dir_next)
+    e->dir_next->dir_prev = e->dir_prev;
+  meta.count--;
+  meta.bytes -= sizeof(*e) + strlen(e->name) + 1;
+  free(e);
+}
+
+/*
+*@brief  forgets the listing of a directory. Lock held
+*/
+static void meta_drop_listing(struct meta_dir* d)
+{
+  if (!d->listing)
+    return;
+  meta.bytes -= ls_entries_bytes(d->listing);
+  meta.nlistings--;
+  ls_entries_free(d->listing);
+  free(d->listing);
+  d->listing = NULL;
+}
+
+/*
+*@brief  forgets a directory and everything in it, and stops watching it.
+*        Lock held
+*/
+static void meta_drop_dir(struct meta_dir* d)
+{
+  while (d->entries)
+    meta_drop_entry(d->entries);
+  meta_drop_listing(d);
+
+  struct meta_dir** slot = &meta.dirs[d->ino % META_DIR_HASH];
+  while (*slot != d)
+    slot = &(*slot)->next;
+  *slot = d->next;
+  slot = &meta.by_wd[(unsigned int)d->wd % META_DIR_HASH];
+  while (*slot != d)
+    slot = &(*slot)->wd_next;
+  *slot = d->wd_next;
+
+  inotify_rm_watch(meta.fd, d->wd);
+  meta.ndirs--;
+  meta.bytes -= sizeof(*d);
+  free(d);
+}
+
+/*
+*@brief  forgets everything. Lock held
+*/
+static void meta_clear(void)
+{
+  for (size_t i = 0; i < META_DIR_HASH; i++)
+    while (meta.dirs[i])
+      meta_drop_dir(meta.dirs[i]);
+}
+
+/*
+*@brief  applies the inotify events that came in since last time: a name
+*        that changed is forgotten along with its directory's listing, a
+*        directory that went away (or an event queue that overflowed) drops
+*        more. Lock held
+*/
+static void meta_drain(void)
+{
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  while (meta.fd >= 0 && (n = read(meta.fd, buf, sizeof(buf))) > 0)
+  {
+    for (char* p = buf; p < buf + n; )
+    {
+      struct inotify_event* ev = (struct inotify_event*)p;
+      p += sizeof(*ev) + ev->len;
+      meta.invalidations++;
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        meta_clear();
+        continue;
+      }
+
+      struct meta_dir* d = meta.by_wd[(unsigned int)ev->wd % META_DIR_HASH];
+      while (d && d->wd != ev->wd)
+        d = d->wd_next;
+      if (!d)
+        continue;
+      d->gen = ++meta.gen;
+      if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+      {
+        meta_drop_dir(d);
+        continue;
+      }
+      meta_drop_listing(d);
+      if (ev->len == 0)
+        continue;
+      uint32_t hash = meta_hash(d, ev->name);
+      for (struct meta_entry* e = meta.table[hash & (meta.buckets - 1)]; e; e = e->next)
+      {
+        if (e->hash == hash && e->dir == d && strcmp(e->name, ev->name) == 0)
+        {
+          meta_drop_entry(e);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/*
+*@brief  finds the cache's record of the directory open as dirfd (AT_FDCWD
+*        for the cwd), starting to watch it if create is set. Lock held
+*@return the directory, or NULL if it isn't cached or can't be watched
+*/
+static struct meta_dir* meta_dir_get(int dirfd, bool create)
+{
+  struct stat st;
+  if ((dirfd == AT_FDCWD ? stat(".", &st) : fstat(dirfd, &st)) < 0)
+    return NULL;
+
+  struct meta_dir* d = meta.dirs[st.st_ino % META_DIR_HASH];
+  while (d && (d->ino != st.st_ino || d->dev != st.st_dev))
+    d = d->next;
+  if (d || !create)
+    return d;
+
+  if (meta.fd == -1)
+  {
+    meta.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (meta.fd < 0)
+      meta.fd = -2;
+  }
+  if (meta.fd < 0)
+    return NULL;
+
+  char path[64];
+  if (dirfd != AT_FDCWD)
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+  int wd = inotify_add_watch(meta.fd, dirfd == AT_FDCWD ? "." : path,
+                             IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
+                             IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+  d = wd >= 0 ? calloc(1, sizeof(*d)) : NULL;
+  if (!d)
+  {
+    if (wd >= 0)
+      inotify_rm_watch(meta.fd, wd);
+    return NULL;
+  }
+  d->dev = st.st_dev;
+  d->ino = st.st_ino;
+  d->wd = wd;
+  d->gen = ++meta.gen;
+  d->next = meta.dirs[st.st_ino % META_DIR_HASH];
+  meta.dirs[st.st_ino % META_DIR_HASH] = d;
+  d->wd_next = meta.by_wd[(unsigned int)wd % META_DIR_HASH];
+  meta.by_wd[(unsigned int)wd % META_DIR_HASH] = d;
+  meta.ndirs++;
+  meta.bytes += sizeof(*d);
+  return d;
+}
+
+/*
+*@brief  remembers what lstat said about a name. Lock held
+*/
+static void meta_put(struct meta_dir* d, const char* name, int error, const struct statx* stx)
+{
+  if (meta.count >= (size_t)meta_cache_max)
+    meta_clear();
+  if (meta.count >= meta.buckets / 2 * 3 || !meta.table)
+  {
+    //grow the table, rehashing every entry into it
+    size_t buckets = meta.buckets ? meta.buckets * 2 : 1024;
+    struct meta_entry** table = calloc(buckets, sizeof(*table));
+    if (!table)
+      return;
+    for (size_t i = 0; i < meta.buckets; i++)
+    {
+      while (meta.table[i])
+      {
+        struct meta_entry* e = meta.table[i];
+        meta.table[i] = e->next;
+        e->next = table[e->hash & (buckets - 1)];
+        table[e->hash & (buckets - 1)] = e;
+      }
+    }
+    meta.bytes += (buckets - meta.buckets) * sizeof(*table);
+    free(meta.table);
+    meta.table = table;
+    meta.buckets = buckets;
+  }
+
+  uint32_t hash = meta_hash(d, name);
+  for (struct meta_entry* e = meta.table[hash & (meta.buckets - 1)]; e; e = e->next)
+    if (e->hash == hash && e->dir == d && strcmp(e->name, name) == 0)
+      return; //someone else got there first
+
+  size_t len = strlen(name);
+  struct meta_entry* e = malloc(sizeof(*e) + len + 1);
+  if (!e)
+    return;
+  e->hash = hash;
+  e->dir = d;
+  e->error = error;
+  if (stx)
+    e->stx = *stx;
+  memcpy(e->name, name, len + 1);
+  e->next = meta.table[hash & (meta.buckets - 1)];
+  meta.table[hash & (meta.buckets - 1)] = e;
+  e->dir_prev = NULL;
+  e->dir_next = d->entries;
+  if (d->entries)
+    d->entries->dir_prev = e;
+  d->entries = e;
+  meta.count++;
+  meta.bytes += sizeof(*e) + len + 1;
+}
+
+/*
+*@brief  stat_batch through the metadata cache. Names it knows are answered
+*        from memory; the rest are lstat'ed together in one batch and
+*        remembered. A followed stat of a symlink isn't cached, since its
+*        target could be anywhere, but the cached lstat of anything else
+*        answers a followed stat just as well
+*/
+static void meta_stat_batch(int dirfd, int flags, struct stat_request* reqs, size_t count)
+{
+  if (meta_cache != 1)
+  {
+    stat_batch(dirfd, flags, reqs, count);
+    return;
+  }
+
+  bool follow = !(flags & AT_SYMLINK_NOFOLLOW);
+  struct stat_request* miss = malloc((count ? count : 1) * sizeof(*miss));
+  size_t* from = malloc((count ? count : 1) * sizeof(*from));
+  size_t nmiss = 0;
+  unsigned long gen = 0;
+  dev_t dev = 0;
+  ino_t ino = 0;
+
+  if (!miss || !from)
+  {
+    free(miss);
+    free(from);
+    stat_batch(dirfd, flags, reqs, count);
+    return;
+  }
+
+  pthread_mutex_lock(&meta.lock);
+  meta_drain();
+  struct meta_dir* d = meta_dir_get(dirfd, true);
+  if (d)
+  {
+    gen = d->gen;
+    dev = d->dev;
+    ino = d->ino;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    struct stat_request* req = &reqs[i];
+    struct meta_entry* e = NULL;
+    if (req->mask == 0)
+    {
+      req->error = 0;
+      continue;
+    }
+    if (d && meta.table)
+    {
+      uint32_t hash = meta_hash(d, req->name);
+      for (e = meta.table[hash & (meta.buckets - 1)]; e; e = e->next)
+        if (e->hash == hash && e->dir == d && strcmp(e->name, req->name) == 0)
+          break;
+    }
+    if (e && (!follow || e->error || !S_ISLNK(e->stx.stx_mode)))
+    {
+      meta.hits++;
+      req->error = e->error;
+      req->stx = e->stx;
+      continue;
+    }
+    meta.misses++;
+    miss[nmiss] = *req;
+    miss[nmiss].mask = STATX_BASIC_STATS;
+    from[nmiss++] = i;
+  }
+  pthread_mutex_unlock(&meta.lock);
+
+  stat_batch(dirfd, AT_SYMLINK_NOFOLLOW, miss, nmiss);
+  for (size_t k = 0; k < nmiss; k++)
+  {
+    struct stat_request* req = &reqs[from[k]];
+    req->error = miss[k].error;
+    req->stx = miss[k].stx;
+    if (follow && !req->error && S_ISLNK(req->stx.stx_mode))
+      req->error = statx_at(dirfd, req->name, flags, req->mask, &req->stx) ? errno : 0;
+  }
+
+  //only store what was found if nothing changed in the directory since
+  //the lookup started. Subdirectories are left out: their mtime and size
+  //change with what is created in them, which the watch on this directory
+  //never hears about
+  pthread_mutex_lock(&meta.lock);
+  meta_drain();
+  d = d ? meta_dir_get(dirfd, false) : NULL;
+  if (d && d->gen == gen && d->dev == dev && d->ino == ino)
+    for (size_t k = 0; k < nmiss; k++)
+      if ((miss[k].error == 0 && !S_ISDIR(miss[k].stx.stx_mode)) || miss[k].error == ENOENT)
+        meta_put(d, miss[k].name, miss[k].error, miss[k].error ? NULL : &miss[k].stx);
+  pthread_mutex_unlock(&meta.lock);
+  free(miss);
+  free(from);
+}
+
+/*
+*@brief  copies the cached listing of the directory open as dirfd into e.
+*        The subdirectories in it are stat'ed again, since the watch on
+*        dirfd doesn't see their mtime and size change
+*@return 1 if there was one, 0 if not (gen is set for meta_listing_put)
+*/
+static int meta_listing_get(int dirfd, struct ls_entries* e, unsigned long* gen)
+{
+  int found = 0;
+  pthread_mutex_lock(&meta.lock);
+  meta_drain();
+  struct meta_dir* d = meta_dir_get(dirfd, true);
+  *gen = d ? d->gen : 0;
+  if (d && d->listing && ls_entries_copy(e, d->listing) == 0)
+    found = 1;
+  if (found)
+    meta.hits++;
+  else
+    meta.misses++;
+  pthread_mutex_unlock(&meta.lock);
+
+  for (uint32_t i = 0; found && i < e->count; i++)
+  {
+    struct stat st;
+    if (!S_ISDIR(e->mode[i]))
+      continue;
+    if (fstatat(dirfd, ls_name(e, i), &st, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      //gone since: let the caller read the directory again
+      ls_entries_free(e);
+      memset(e, 0, sizeof(*e));
+      found = 0;
+      break;
+    }
+    e->size[i] = st.st_size;
+    e->mtime[i] = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+  return found;
+}
+
+/*
+*@brief  hands a complete listing of dirfd over to the cache, unless the
+*        directory changed since meta_listing_get. e is left empty either way
+*/
+static void meta_listing_put(int dirfd, struct ls_entries* e, unsigned long gen)
+{
+  struct ls_entries* keep = malloc(sizeof(*keep));
+
+  pthread_mutex_lock(&meta.lock);
+  meta_drain();
+  struct meta_dir* d = meta_dir_get(dirfd, false);
+  if (keep && d && d->gen == gen && !d->listing && meta.count < (size_t)meta_cache_max)
+  {
+    *keep = *e;
+    d->listing = keep;
+    meta.nlistings++;
+    meta.bytes += ls_entries_bytes(keep);
+    keep = NULL;
+  }
+  else
+    ls_entries_free(e);
+  pthread_mutex_unlock(&meta.lock);
+  free(keep);
+  memset(e, 0, sizeof(*e));
+}
+
+/**
+ * @brief  Shows what the metadata cache holds and how well it is doing, or
+ *         empties it
+ * @param  "stats" (the default) or "clear"
+ * @return 0 on success, -1 for anything else
+ */
+int do_cache(int argc, char** argv) {
+  if (argc > 0 && strcmp(argv[0], "clear") == 0)
+  {
+    pthread_mutex_lock(&meta.lock);
+    meta_clear();
+    pthread_mutex_unlock(&meta.lock);
+    return 0;
+  }
+  if (argc > 0 && strcmp(argv[0], "stats") != 0)
+  {
+    fprintf(err_out(), "cache: usage: cache [stats|clear]\n");
+    return -1;
+  }
+
+  char text[512];
+  pthread_mutex_lock(&meta.lock);
+  meta_drain();
+  unsigned long lookups = meta.hits + meta.misses;
+  snprintf(text, sizeof(text),
+           "state:         %s\n"
+           "entries:       %zu\n"
+           "listings:      %zu\n"
+           "directories:   %zu (watched)\n"
+           "hits:          %lu\n"
+           "misses:        %lu\n"
+           "hit rate:      %.1f%%\n"
+           "invalidations: %lu\n"
+           "memory:        %zu bytes\n",
+           meta_cache == 1 ? "on" : "off", meta.count, meta.nlistings, meta.ndirs, meta.hits,
+           meta.misses, lookups ? 100.0 * (double)meta.hits / (double)lookups : 0.0,
+           meta.invalidations, meta.bytes);
+  pthread_mutex_unlock(&meta.lock);
+  out_str(ctx->out, text);
+  return 0;
+}
+
+/*
+*@brief  formats one ls line into sb: name, [DIR]/[FILE], file type and
+*        maybe the size
+*/
+static void ls_format(struct strbuf* sb, const char* name, mode_t mode, off_t size, bool brief)
+{
+  //get dir/file label and file type
+  const char* fod = file_or_dir(mode);
+  const char* ftype = ftype_string(mode);
+
+  //omg this one line took eighteen years
+  //(and is now hand formatted, printf was most of the time on big listings)
+  sb_str(sb, name);
+  sb_write(sb, "\t[", 2);
+  sb_str(sb, fod);
+  sb_write(sb, "]\t(type=", 8);
+  sb_str(sb, ftype);
+  if (brief)
+  {
+    sb_write(sb, ")\n", 2);
+    return;
+  }
+  sb_write(sb, ")\tsize=", 7);
+  sb_uint(sb, (uintmax_t)size);
+  sb_write(sb, " bytes \n", 8);
+}
+
+/*
+*@brief  prints one ls line
+*/
+static void ls_print(struct strbuf* line, const char* name, mode_t mode, off_t size, bool brief)
+{
+  line->len = 0;
+  ls_format(line, name, mode, size, brief);
+  out_write(ctx->out, line->data, line->len);
+}
+
+/*
+*@brief  ls -R visitor: one line per entry, named by its path from the root
+*/
+static void ls_visit(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                     mode_t mode, const struct statx* stx)
+{
+  bool brief = *(const bool*)wk->w->ops->arg;
+
+  walk_join(&wk->path, dir->path, name);
+  ls_format(&wk->line, wk->path.data, mode, stx ? (off_t)stx->stx_size : 0, brief);
+  walk_emit(wk);
+}
+
+/*
+*@brief  lists one directory for do_ls: recursively on the walker, otherwise
+*        in batches, sorted by if asked
+*@return -1 on error, 0 on success
+*/
+static int ls_dir(const char* dir, bool brief, bool reverse, bool recursive, enum ls_sort by)
+{
+  if (recursive)
+  {
+    struct walk_ops ops = { brief ? 0 : STATX_SIZE, ls_visit, NULL, &brief, NULL, NULL };
+    return walk_tree(dir, &ops, by == LS_BY_NAME || walk_order == WALK_ORDER_SORTED);
+  }
+
+  int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+  {
+    fprintf(err_out(), "Could not open directory %s %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  //a getdents record is at least 24 bytes, which bounds the batch size
+  struct stat_request* reqs = calloc(DIRENT_BUFFER_SIZE / 24, sizeof(*reqs));
+  char* dirents = malloc(DIRENT_BUFFER_SIZE);
+  struct ls_entries entries = { { NULL, 0, 0, false }, NULL, NULL, NULL, NULL, 0, 0 };
+  unsigned int want = (brief && by != LS_BY_SIZE ? 0 : STATX_SIZE) |
+                      (by == LS_BY_MTIME ? STATX_MTIME : 0);
+  struct strbuf line = { NULL, 0, 0, false };
+  int status = 0;
+  ssize_t nread = 0;
+
+  //with the metadata cache on, the whole listing is kept (with everything
+  //any ls option could want) and the next ls of an unchanged directory
+  //doesn't read it at all
+  bool caching = meta_cache == 1, cached = false, complete = true;
+  bool collect = by != LS_UNSORTED || caching;
+  unsigned long gen = 0;
+  if (caching)
+  {
+    want = STATX_SIZE | STATX_MTIME;
+    cached = meta_listing_get(dirfd, &entries, &gen) == 1;
+  }
+
+  if (!reqs || !dirents)
+  {
+    fprintf(err_out(), "ls: %s\n", strerror(errno));
+    free(reqs);
+    free(dirents);
+    close(dirfd);
+    return -1;
+  }
+
+  while (status == 0 && !cached &&
+         (nread = read_dirents(dirfd, dirents, DIRENT_BUFFER_SIZE)) > 0)
+  {
+    size_t count = 0;
+    for (ssize_t pos = 0; pos < nread; )
+    {
+      struct linux_dirent64* entry = (struct linux_dirent64*)(dirents + pos);
+      pos += entry->d_reclen;
+
+      struct stat_request* req = &reqs[count++];
+      req->name = entry->d_name;
+      req->dtype = dtype_mode(entry->d_type);
+      req->mask = (req->dtype ? 0 : STATX_TYPE) | want;
+    }
+    meta_stat_batch(dirfd, AT_SYMLINK_NOFOLLOW, reqs, count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      struct stat_request* req = &reqs[i];
+      mode_t mode = req->mask & STATX_TYPE ? req->stx.stx_mode : req->dtype;
+      off_t size = req->mask & STATX_SIZE ? (off_t)req->stx.stx_size : 0; //bytes of the file
+
+      if (req->error)
+      {
+        fprintf(err_out(), "stat failed for '%s/%s': %s\n", dir, req->name, strerror(req->error));
+        complete = false;
+        continue;
+      }
+      if (!collect)
+      {
+        ls_print(&line, req->name, mode, size, brief);
+        continue;
+      }
+
+      int64_t mtime = req->mask & STATX_MTIME
+                      ? (int64_t)req->stx.stx_mtime.tv_sec * 1000000000 + req->stx.stx_mtime.tv_nsec
+                      : 0;
+      if (ls_entries_push(&entries, req->name, mode, size, mtime) < 0)
+      {
+        fprintf(err_out(), "ls: %s\n", strerror(ENOMEM));
+        status = -1;
+        break;
+      }
+    }
+  }
+
+  //post loop error check
+  if (nread < 0) //error not just end of stream here!
+  {
+    fprintf(err_out(), "Error reading directory %s :  %s\n", dir, strerror(errno));
+    status = -1;
+  }
+
+  if (status == 0 && collect && by == LS_UNSORTED)
+  {
+    for (uint32_t i = 0; i < entries.count; i++)
+      ls_print(&line, ls_name(&entries, i), entries.mode[i], entries.size[i], brief);
+  }
+  else if (status == 0 && collect)
+  {
+    uint32_t* order = ls_sort(&entries, by);
+    if (!order)
+    {
+      fprintf(err_out(), "ls: %s\n", strerror(ENOMEM));
+      status = -1;
+    }
+    for (size_t i = 0; order && i < entries.count; i++)
+    {
+      uint32_t at = order[reverse ? entries.count - 1 - i : i];
+      ls_print(&line, ls_name(&entries, at), entries.mode[at], entries.size[at], brief);
+    }
+    free(order);
+  }
+  if (caching && !cached && status == 0 && complete)
+    meta_listing_put(dirfd, &entries, gen);
+  ls_entries_free(&entries);
+  free(reqs);
+  free(dirents);
+  free(line.data);
+
+  if (close(dirfd) != 0)
+  {
+    fprintf(err_out(), "error closing directory %s :  %s\n", dir, strerror(errno));
+    return -1;
+  }
+  return status;
+}
+
+/**
+ * @brief  Lists the contents of a directory
+ * @param  Options ("-1" leaves out the size column, "-N" sorts by name, "-S"
+ *         by size and "-t" by modification time, biggest / newest first,
+ *         "-r" reverses the order, "-R" lists every subdirectory too, by
+ *         path) and the names of the directories to list, or if none, the
+ *         current working directory. Several are listed in order, each
+ *         under a "name:" header
+ * @return -1 on error, 0 on success
+ * Notes: entries are read in big batches with getdents64 and each batch is
+ * stat'ed relative to the directory fd in one go (through io_uring when it
+ * can), so the kernel never walks the full path again. The stat is skipped
+ * entirely when d_type already says what the entry is and the size isn't
+ * wanted. Symlinks are not followed, same as the lstat this replaced.
+ * I added functionality to list whether each entry is a file or a directory, as well as what type of file it would be if not a directory 
+ * (note ftype_string) above, and then list the num of bytes each entry takes up
+ */ 
+int do_ls(int argc, char** argv) {
+  //options are dropped from argv, what's left are the directories
+  char* here[] = { ".", NULL };
+  char** dirs = argv;
+  int ndirs = 0;
+  bool brief = false, reverse = false, recursive = false;
+  enum ls_sort by = LS_UNSORTED;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (argv[i][0] != '-' || argv[i][1] == '\0')
+    {
+      dirs[ndirs++] = argv[i];
+      continue;
+    }
+    for (const char* opt = argv[i] + 1; *opt; opt++)
+    {
+      if (*opt == '1')
+        brief = true;
+      else if (*opt == 'N')
+        by = LS_BY_NAME;
+      else if (*opt == 'S')
+        by = LS_BY_SIZE;
+      else if (*opt == 't')
+        by = LS_BY_MTIME;
+      else if (*opt == 'r')
+        reverse = true;
+      else if (*opt == 'R')
+        recursive = true;
+      else
+      {
+        fprintf(err_out(), "ls: invalid option -- '%c'\n", *opt);
+        return -1;
+      }
+    }
+  }
+
+  if (reverse && by == LS_UNSORTED)
+    by = LS_BY_NAME;
+  if (recursive && by != LS_UNSORTED && by != LS_BY_NAME)
+  {
+    fprintf(err_out(), "ls: -R only lists in name or directory order\n");
+    return -1;
+  }
+  if (ndirs == 0)
+  {
+    dirs = here;
+    ndirs = 1;
+  }
+
+  int status = 0;
+  for (int i = 0; i < ndirs; i++)
+  {
+    if (ndirs > 1)
+    {
+      if (i > 0)
+        out_write(ctx->out, "\n", 1);
+      out_str(ctx->out, dirs[i]);
+      out_write(ctx->out, ":\n", 2);
+    }
+    if (ls_dir(dirs[i], brief, reverse, recursive, by) < 0)
+      status = -1;
+  }
+  return status;
+}
+
+/*
+* @brief  the ways do_cat can move bytes from a file to the output. They are
+*         tried in the order picked by cat_plan() until one of them works
+*/
+enum cat_method { CAT_COPY_RANGE, CAT_SPLICE, CAT_SENDFILE, CAT_MMAP, CAT_BUFFERED };
+
+/*
+*@brief  what cat is writing to, looked up once per invocation
+*/
+struct cat_target {
+  int fd;
+  bool tty;
+  mode_t mode;  //0 when it could not be determined
+  char* buffer; //for the buffered loop, allocated the first time it runs
+};
+
+/*
+*@brief  tells a "this pair of fds can't do that" error apart from a real
+*        I/O error, so cat can fall back to the next method instead of failing
+*/
+static bool cat_unsupported(int err)
+{
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+         err == EBADF || err == ESPIPE || err == ENODEV;
+}
+
+/*
+*@brief  picks the transfer methods to try for one file, best first.
+*        regular files can be copied inside the kernel (even reflinked),
+*        pipes can take page references through splice, and sendfile works
+*        for sockets and most other targets. Terminals can't do any of that,
+*        so big files are written straight out of a mapping and small ones
+*        go through the buffered loop, which is always last as the fallback.
+*        cat_mode forces one family of methods for benchmarking
+*@return number of methods written into plan
+*/
+static int cat_plan(const struct cat_target* out, off_t size, enum cat_method* plan)
+{
+  bool zerocopy = cat_mode == CAT_MODE_ZEROCOPY ||
+                  (cat_mode == CAT_MODE_AUTO && size >= cat_zerocopy_min);
+  bool mapped = cat_mode == CAT_MODE_MMAP ||
+                (cat_mode == CAT_MODE_AUTO && size >= cat_mmap_min);
+  int n = 0;
+
+  if (zerocopy && !out->tty && out->mode != 0)
+  {
+    if (S_ISREG(out->mode))
+      plan[n++] = CAT_COPY_RANGE;
+    else if (S_ISFIFO(out->mode))
+      plan[n++] = CAT_SPLICE;
+    plan[n++] = CAT_SENDFILE;
+  }
+  if (mapped)
+    plan[n++] = CAT_MMAP;
+  plan[n++] = CAT_BUFFERED;
+  return n;
+}
+
+/*
+*@brief  hands len bytes of memory to a pipe by reference, retrying short
+*        transfers and EINTR. Falls back to write() where vmsplice isn't
+*        allowed
+*@return 0 on success, -1 on error
+*/
+static int vmsplice_all(int fd, const char* data, size_t len)
+{
+  while (len > 0)
+  {
+    struct iovec iov = { (void*)data, len };
+    ssize_t n = vmsplice(fd, &iov, 1, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (cat_unsupported(errno))
+        return write_all(fd, data, len);
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/*
+*@brief  writes the file from *offset up to size straight out of read-only
+*        mappings, one window at a time so huge files don't need that much
+*        address space. The kernel is told we read each window front to back
+*        so it starts reading ahead before write() gets there. A pipe is
+*        given the mapped pages themselves with vmsplice instead of a copy;
+*        the mapping is read-only, so they can't change under the reader
+*@return 1 when done, 0 if the file can't be mapped, -1 on error
+*/
+static int cat_mapped(int in_fd, const struct cat_target* out, off_t* offset, off_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+
+  while (*offset < size)
+  {
+    //mmap offsets have to be page aligned, so start at the page holding *offset
+    off_t base = *offset - (*offset % page);
+    size_t len = (size_t)(size - base) < CAT_MMAP_WINDOW ? (size_t)(size - base)
+                                                         : CAT_MMAP_WINDOW;
+    char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, in_fd, base);
+    if (map == MAP_FAILED)
+      return cat_unsupported(errno) ? 0 : -1;
+
+    madvise(map, len, MADV_SEQUENTIAL);
+    madvise(map, len, MADV_WILLNEED);
+
+    size_t skip = (size_t)(*offset - base);
+    int status = S_ISFIFO(out->mode) ? vmsplice_all(out->fd, map + skip, len - skip)
+                                     : write_all(out->fd, map + skip, len - skip);
+    int saved = errno;
+    munmap(map, len);
+    if (status < 0)
+    {
+      errno = saved;
+      return -1;
+    }
+    *offset = base + (off_t)len;
+  }
+  return 1;
+}
+
+/*
+*@brief  copies the rest of a file, starting at *offset, with one method.
+*        offset always points at the first byte not written yet, so the next
+*        method can pick up where this one gave up
+*@return 1 when the whole file was written, 0 if the method is not supported
+*        for these fds, -1 on error (errno is set)
+*/
+static int cat_transfer(enum cat_method method, int in_fd, bool seekable,
+                        off_t size, struct cat_target* out, off_t* offset)
+{
+  size_t bufsize = (size_t)cat_buffer_size;
+  int out_fd = out->fd;
+
+  if (method == CAT_MMAP)
+    return cat_mapped(in_fd, out, offset, size);
+  if (method == CAT_BUFFERED && !out->buffer &&
+      !(out->buffer = malloc(CAT_BUFFER_SIZE)))
+    return -1;
+
+  while (true)
+  {
+    ssize_t n;
+    switch (method)
+    {
+      case CAT_COPY_RANGE:
+        n = copy_file_range(in_fd, offset, out_fd, NULL, CAT_CHUNK_SIZE, 0);
+        break;
+      case CAT_SPLICE:
+        n = splice(in_fd, offset, out_fd, NULL, CAT_CHUNK_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        break;
+      case CAT_SENDFILE:
+        n = sendfile(out_fd, in_fd, offset, CAT_CHUNK_SIZE);
+        break;
+      default:
+        //pipes and ttys can't be read with pread, so fall back to read
+        n = seekable ? pread(in_fd, out->buffer, bufsize, *offset)
+                     : read(in_fd, out->buffer, bufsize);
+        if (n > 0)
+        {
+          if (write_all(out_fd, out->buffer, (size_t)n) < 0)
+            return -1;
+          *offset += n;
+        }
+        break;
+    }
+
+    if (n == 0)
+      return 1;
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (method != CAT_BUFFERED && cat_unsupported(errno))
+        return 0;
+      return -1;
+    }
+  }
+}
+
+/*
+*@brief  streams one open file to the target from offset from (0 for
+*        anything that can't seek), falling back through the plan
+*@return -1 on error, 0 on success
+*/
+static int cat_stream(int in_fd, const char* name, struct cat_target* out, off_t from)
+{
+  struct stat st;
+  if (fstat(in_fd, &st) != 0)
+  {
+    fprintf(err_out(), "Unable to stat %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+
+  //only regular files can be handed to the kernel copy paths or mapped,
+  //anything else (fifos, /dev/stdin, ...) goes through the buffered loop
+  bool seekable = S_ISREG(st.st_mode);
+  enum cat_method plan[5];
+  int nplan = cat_plan(out, st.st_size, plan);
+  int first = seekable ? 0 : nplan - 1;
+
+  if (seekable && st.st_size >= cat_zerocopy_min)
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  off_t offset = from;
+  for (int i = first; i < nplan; i++)
+  {
+    int status = cat_transfer(plan[i], in_fd, seekable, st.st_size, out, &offset);
+    if (status == 1)
+      return 0;
+    if (status < 0)
+    {
+      //whoever reads the pipe has gone away, nothing to complain about
+      if (errno != EPIPE)
+        fprintf(err_out(), "Error copying data from %s: %s\n", name, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief  Outputs the contents of one or more ordinary files, in order
+ * @param  Names of the files; "-" or no names at all reads the command's
+ *         input (the previous stage of a pipeline, or stdin)
+ * @return -1 if any file could not be output, 0 on success
+ */
+int do_cat(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  int nfiles = argc > 0 ? argc : 1;
+  char* const* files = argc > 0 ? argv : dash;
+  struct cat_target target = { ctx->out->fd, ctx->out->tty, 0, NULL };
+  struct stat st;
+  int status = 0;
+
+  if (!target.tty && fstat(target.fd, &st) == 0)
+    target.mode = st.st_mode;
+
+  //anything still buffered has to go out before we write to the fd
+  out_flush(ctx->out);
+
+  for (int i = 0; i < nfiles; i++)
+  {
+    if (strcmp(files[i], "-") == 0)
+    {
+      if (cat_stream(ctx->in_fd, "standard input", &target, 0) < 0)
+        status = -1;
+      continue;
+    }
+
+    int sourcefd = open(files[i], O_RDONLY, 0);
+    if (sourcefd < 0) //source file not opened, failure
+    {
+      fprintf(err_out(), "Unable to open %s: %s\n", files[i], strerror(errno));
+      status = -1;
+      continue;
+    }
+
+    if (cat_stream(sourcefd, files[i], &target, 0) < 0)
+      status = -1;
+
+    if (close(sourcefd) < 0)
+    {
+      fprintf(err_out(), "Error closing source file %s: %s\n", files[i], strerror(errno));
+      status = -1;
+    }
+  }
+
+  //keep the prompt on its own line, but leave piped output byte for byte
+  if (target.tty)
+    write_all(target.fd, "\n", 1);
+
+  free(target.buffer);
+  return status;
+}
+
+/*
+*@brief  counts the bytes equal to c, 8 at a time: a byte of w ^ pattern is
+*        zero exactly where c is, and the add below sets the top bit of every
+*        byte that isn't
+*/
+static size_t count_byte_scalar(const char* data, size_t len, char c)
+{
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL, pattern = 0x0101010101010101ULL * (unsigned char)c;
+  size_t count = 0, i = 0;
+
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    w ^= pattern;
+    w = ((w & low7) + low7) | w;
+    count += (size_t)__builtin_popcountll(~w & ~low7);
+  }
+  for (; i < len; i++)
+    count += data[i] == c;
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+*@brief  SSE2 count_byte: compares 16 bytes at a time and sums the 0xff
+*        matches as byte counters, folding them with psadbw before they can
+*        wrap
+*/
+static size_t count_byte_sse2(const char* data, size_t len, char c)
+{
+  const __m128i needle = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+  size_t count = 0, i = 0;
+
+  while (i + 16 <= len)
+  {
+    __m128i acc = zero;
+    for (int k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), needle));
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+  }
+  return count + count_byte_scalar(data + i, len - i, c);
+}
+
+/*
+*@brief  the same with 32 byte AVX2 registers
+*/
+__attribute__((target("avx2")))
+static size_t count_byte_avx2(const char* data, size_t len, char c)
+{
+  const __m256i needle = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+  size_t count = 0, i = 0;
+
+  while (i + 32 <= len)
+  {
+    __m256i acc = zero;
+    for (int k = 0; k < 255 && i + 32 <= len; k++, i += 32)
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)),
+                                                   needle));
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+             (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+  }
+  return count + count_byte_scalar(data + i, len - i, c);
+}
+
+/*
+*@brief  SSE2 fixed string search: compares the first and last byte of the
+*        needle against 16 positions at once and only memcmps where both
+*        match, which on text is rare
+*/
+static const char* find_fixed_sse2(const char* hay, size_t len, const char* needle, size_t m)
+{
+  const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 16 <= len; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                                      _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1)
+    {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+        return hay + at;
+    }
+  }
+  return memmem(hay + i, len - i, needle, m);
+}
+
+/*
+*@brief  the same with 32 byte AVX2 registers
+*/
+__attribute__((target("avx2")))
+static const char* find_fixed_avx2(const char* hay, size_t len, const char* needle, size_t m)
+{
+  const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 32 <= len; i += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1)
+    {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+        return hay + at;
+    }
+  }
+  return memmem(hay + i, len - i, needle, m);
+}
+#elif defined(__aarch64__)
+/*
+*@brief  NEON count_byte: 16 bytes at a time into byte counters, widened
+*        before they can wrap
+*/
+static size_t count_byte_neon(const char* data, size_t len, char c)
+{
+  const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+  size_t count = 0, i = 0;
+
+  while (i + 16 <= len)
+  {
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (int k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+      acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t*)data + i), needle));
+    count += vaddvq_u16(vpaddlq_u8(acc));
+  }
+  return count + count_byte_scalar(data + i, len - i, c);
+}
+
+/*
+*@brief  NEON fixed string search, first and last byte filter like the x86
+*        ones. NEON has no movemask; narrowing the compare result by 4 bits
+*        gives a 64 bit mask with a nibble per byte instead
+*/
+static const char* find_fixed_neon(const char* hay, size_t len, const char* needle, size_t m)
+{
+  const uint8x16_t first = vdupq_n_u8((uint8_t)needle[0]), last = vdupq_n_u8((uint8_t)needle[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 16 <= len; i += 16)
+  {
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t*)hay + i), first),
+                             vceqq_u8(vld1q_u8((const uint8_t*)hay + i + m - 1), last));
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    for (; mask; mask &= ~(0xfULL << (__builtin_ctzll(mask) & ~3)))
+    {
+      size_t at = i + (size_t)(__builtin_ctzll(mask) / 4);
+      if (memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+        return hay + at;
+    }
+  }
+  return memmem(hay + i, len - i, needle, m);
+}
+#endif
+
+typedef size_t (*count_byte_fn)(const char* data, size_t len, char c);
+typedef const char* (*find_fixed_fn)(const char* hay, size_t len, const char* needle, size_t m);
+
+/*
+* @brief  the byte scanners picked for this CPU, the first time one is needed
+*/
+static struct {
+  _Atomic(count_byte_fn) count;
+  _Atomic(find_fixed_fn) find;
+} scanners;
+
+/*
+*@brief  picks the widest scanners the CPU has. Racing threads pick the same
+*        ones, so there is nothing to lock
+*/
+static void scanners_init(void)
+{
+  count_byte_fn count = count_byte_scalar;
+  find_fixed_fn find = NULL;
+
+#if defined(__x86_64__) || defined(__i386__)
+  count = count_byte_sse2;
+  find = find_fixed_sse2;
+  if (simd_level == SIMD_AUTO && __builtin_cpu_supports("avx2"))
+  {
+    count = count_byte_avx2;
+    find = find_fixed_avx2;
+  }
+#elif defined(__aarch64__)
+  count = count_byte_neon;
+  find = find_fixed_neon;
+#endif
+  if (simd_level == SIMD_OFF)
+  {
+    count = count_byte_scalar;
+    find = NULL;
+  }
+  atomic_store_explicit(&scanners.find, find, memory_order_relaxed);
+  atomic_store_explicit(&scanners.count, count, memory_order_relaxed);
+}
+
+/*
+*@brief  how many times c occurs in data
+*/
+static size_t count_byte(const char* data, size_t len, char c)
+{
+  count_byte_fn fn = atomic_load_explicit(&scanners.count, memory_order_relaxed);
+  if (!fn)
+  {
+    scanners_init();
+    fn = atomic_load_explicit(&scanners.count, memory_order_relaxed);
+  }
+  return fn(data, len, c);
+}
+
+/*
+*@brief  finds the first occurrence of needle in hay. One and two byte
+*        needles and the no-SIMD case go to memchr / memmem
+*@return where it starts, or NULL
+*/
+static const char* find_fixed(const char* hay, size_t len, const char* needle, size_t m)
+{
+  if (m == 0)
+    return hay;
+  if (m == 1)
+    return memchr(hay, needle[0], len);
+  if (!atomic_load_explicit(&scanners.count, memory_order_relaxed))
+    scanners_init();
+  find_fixed_fn fn = atomic_load_explicit(&scanners.find, memory_order_relaxed);
+  if (!fn || m == 2 || len < m)
+    return memmem(hay, len, needle, m);
+  return fn(hay, len, needle, m);
+}
+
+/*
+*@brief  called by text_scan with each piece of a file, in order
+*@return 0 to keep going, 1 to stop early, -1 on error (already reported)
+*/
+typedef int (*scan_fn)(void* arg, const char* data, size_t len);
+
+/*
+* @brief  where a SIGBUS in a mapped scan goes back to, per thread. Pages of
+*         a mapping past the end of a file that was truncated meanwhile
+*         fault, and that must not take the whole shell (or server) down
+*/
+static __thread sigjmp_buf* scan_fault = NULL;
+
+/*
+*@brief  SIGBUS handler: back into text_scan if a scan was running, otherwise
+*        the default action (a fault anywhere else is a real crash)
+*/
+static void scan_sigbus(int sig)
+{
+  if (scan_fault)
+    siglongjmp(*scan_fault, 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/*
+*@brief  installs scan_sigbus, once for the process
+*/
+static void scan_sigbus_init(void)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = scan_sigbus;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, NULL);
+}
+
+/*
+*@brief  runs a scanner over a mapped window, catching a SIGBUS from it
+*@return what the scanner returned, or -2 if the window faulted
+*/
+static int scan_mapped(scan_fn fn, void* arg, const char* data, size_t len)
+{
+  sigjmp_buf fault;
+  if (sigsetjmp(fault, 1) != 0)
+  {
+    scan_fault = NULL;
+    return -2;
+  }
+  scan_fault = &fault;
+  int status = fn(arg, data, len);
+  scan_fault = NULL;
+  return status;
+}
+
+/*
+*@brief  feeds a file to a scanner. Big regular files are read through
+*        mapped windows (the same way cat writes them out) so the data is
+*        never copied, anything else through cat_buffer_size reads. map =
+*        false always reads, for scanners that stop after a little input.
+*        The size is checked again for every window, and a file cut short
+*        under a window is an error instead of a SIGBUS
+*@return -1 on error, 0 on success
+*/
+static int text_scan(int fd, const char* name, bool map, scan_fn fn, void* arg)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    fprintf(err_out(), "Unable to stat %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+
+  if (map && S_ISREG(st.st_mode) && cat_mode != CAT_MODE_BUFFERED &&
+      (st.st_size >= cat_mmap_min || cat_mode == CAT_MODE_MMAP))
+  {
+    static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+    pthread_once(&sigbus_once, scan_sigbus_init);
+
+    bool mapped = false;
+    for (off_t base = 0; base < st.st_size; base += CAT_MMAP_WINDOW)
+    {
+      //a file that shrank since is only scanned up to its new end
+      if (base > 0 && fstat(fd, &st) != 0)
+      {
+        fprintf(err_out(), "Unable to stat %s: %s\n", name, strerror(errno));
+        return -1;
+      }
+      if (base >= st.st_size)
+        break;
+      size_t len = (size_t)(st.st_size - base) < CAT_MMAP_WINDOW ? (size_t)(st.st_size - base)
+                                                                 : CAT_MMAP_WINDOW;
+      char* data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, base);
+      if (data == MAP_FAILED)
+      {
+        if (base == 0 && cat_unsupported(errno))
+          break; //read it instead
+        fprintf(err_out(), "Error reading %s: %s\n", name, strerror(errno));
+        return -1;
+      }
+      mapped = true;
+      madvise(data, len, MADV_SEQUENTIAL);
+      madvise(data, len, MADV_WILLNEED);
+      int status = scan_mapped(fn, arg, data, len);
+      if (status == -2)
+      {
+        fprintf(err_out(), "Error reading %s: file was truncated while being read\n", name);
+        status = -1;
+      }
+      munmap(data, len);
+      if (status != 0)
+        return status < 0 ? -1 : 0;
+    }
+    if (mapped)
+      return 0;
+  }
+
+  char* buffer = malloc(CAT_BUFFER_SIZE);
+  if (!buffer)
+  {
+    fprintf(err_out(), "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  int status = 0;
+  while (status == 0)
+  {
+    ssize_t n = read(fd, buffer, (size_t)cat_buffer_size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      fprintf(err_out(), "Error reading %s: %s\n", name, strerror(errno));
+      status = -1;
+    }
+    else if (n == 0)
+      break;
+    else
+      status = fn(arg, buffer, (size_t)n);
+  }
+  free(buffer);
+  return status < 0 ? -1 : 0;
+}
+
+/*
+*@brief  opens a text builtin's operand; "-" is the command's input
+*@return the fd, or -1 after saying why
+*/
+static int text_open(const char* name)
+{
+  if (strcmp(name, "-") == 0)
+    return ctx->in_fd;
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    fprintf(err_out(), "Unable to open %s: %s\n", name, strerror(errno));
+  return fd;
+}
+
+static void text_close(int fd)
+{
+  if (fd != ctx->in_fd)
+    close(fd);
+}
+
+/*
+*@brief  reads the count option of head and tail ("-n N" or "-N")
+*@return number of leading words that were options, or -1 on error
+*/
+static int parse_line_count(const char* cmd, int argc, char** argv, unsigned long long* lines)
+{
+  int i = 0;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    const char* value = argv[i] + 1;
+    if (strcmp(argv[i], "-n") == 0)
+    {
+      if (++i == argc)
+      {
+        fprintf(err_out(), "%s: option requires an argument -- 'n'\n", cmd);
+        return -1;
+      }
+      value = argv[i];
+    }
+    char* end;
+    errno = 0;
+    *lines = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || *value == '-')
+    {
+      fprintf(err_out(), "%s: invalid number of lines: '%s'\n", cmd, value);
+      return -1;
+    }
+  }
+  return i;
+}
+
+/*
+*@brief  prints "==> name <==" above each file when head or tail get more
+*        than one, like coreutils
+*/
+static void text_banner(const char* name, int index, int nfiles)
+{
+  if (nfiles < 2)
+    return;
+  if (index > 0)
+    out_write(ctx->out, "\n", 1);
+  out_str(ctx->out, "==> ");
+  out_str(ctx->out, strcmp(name, "-") == 0 ? "standard input" : name);
+  out_str(ctx->out, " <==\n");
+}
+
+/*
+* @brief  what wc has counted in one file
+*/
+struct wc_counts {
+  uint64_t lines, words, bytes;
+  bool in_word; //the last chunk ended inside a word
+};
+
+/*
+*@brief  wc scanner. Lines go through the SIMD byte count; words need a
+*        look at every byte and are only counted when asked for
+*/
+static int wc_chunk(void* arg, const char* data, size_t len)
+{
+  struct wc_counts* wc = arg;
+
+  wc->bytes += len;
+  wc->lines += count_byte(data, len, '\n');
+  if (wc->words == UINT64_MAX)
+    return 0;
+
+  bool in_word = wc->in_word;
+  uint64_t words = wc->words;
+  for (size_t i = 0; i < len; i++)
+  {
+    unsigned char ch = (unsigned char)data[i];
+    bool space = ch == ' ' || (ch >= '\t' && ch <= '\r');
+    words += !space && !in_word;
+    in_word = !space;
+  }
+  wc->words = words;
+  wc->in_word = in_word;
+  return 0;
+}
+
+/*
+*@brief  prints one wc line with the columns that were asked for, each
+*        width wide
+*/
+static void wc_print(const struct wc_counts* wc, bool lines, bool words, bool bytes,
+                     int width, const char* name)
+{
+  char line[96];
+  int n = 0;
+  if (lines)
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "%*" PRIu64 " ", width, wc->lines);
+  if (words)
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "%*" PRIu64 " ", width, wc->words);
+  if (bytes)
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "%*" PRIu64 " ", width, wc->bytes);
+  line[n > 0 ? n - 1 : 0] = '\0';
+  out_str(ctx->out, line);
+  if (name)
+  {
+    out_write(ctx->out, " ", 1);
+    out_str(ctx->out, name);
+  }
+  out_write(ctx->out, "\n", 1);
+}
+
+/**
+ * @brief  Counts lines, words and bytes, like wc
+ * @param  Options "-l", "-w", "-c" (all three when none is given) and file
+ *         names; none or "-" reads the command's input
+ * @return -1 if any file could not be read, 0 on success
+ * Notes: the byte count of a regular file comes from its size when that's
+ * all that's wanted, and lines are counted with SSE2/AVX2 (NEON on ARM)
+ * over mapped windows of the file, so wc -l on a big log doesn't copy it
+ */
+int do_wc(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  bool lines = false, words = false, bytes = false;
+  int status = 0, i = 0;
+
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    for (const char* opt = argv[i] + 1; *opt; opt++)
+    {
+      if (*opt == 'l')
+        lines = true;
+      else if (*opt == 'w')
+        words = true;
+      else if (*opt == 'c')
+        bytes = true;
+      else
+      {
+        fprintf(err_out(), "wc: invalid option -- '%c'\n", *opt);
+        return -1;
+      }
+    }
+  }
+  if (!lines && !words && !bytes)
+    lines = words = bytes = true;
+
+  int nfiles = i < argc ? argc - i : 1;
+  char* const* files = i < argc ? argv + i : dash;
+  struct wc_counts* counts = calloc((size_t)nfiles + 1, sizeof(*counts));
+  struct wc_counts* total = counts + nfiles;
+  bool* opened = calloc((size_t)nfiles, sizeof(*opened));
+  uint64_t sizes = 0;
+  bool streams = false;
+
+  if (!counts || !opened)
+  {
+    fprintf(err_out(), "wc: %s\n", strerror(errno));
+    free(counts);
+    free(opened);
+    return -1;
+  }
+
+  //everything is counted before anything is printed, since the column
+  //width depends on all of it, the way coreutils does it
+  for (int f = 0; f < nfiles; f++)
+  {
+    struct wc_counts* wc = &counts[f];
+    struct stat st;
+    int fd = text_open(files[f]);
+    if (fd < 0)
+    {
+      status = -1;
+      continue;
+    }
+    opened[f] = true;
+    wc->words = words ? 0 : UINT64_MAX;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular)
+      sizes += (uint64_t)st.st_size;
+    else
+      streams = true;
+
+    if (!lines && !words && regular && fd != ctx->in_fd)
+      wc->bytes = (uint64_t)st.st_size;
+    else if (text_scan(fd, files[f], true, wc_chunk, wc) < 0)
+      status = -1;
+    text_close(fd);
+
+    if (!words)
+      wc->words = 0;
+    total->lines += wc->lines;
+    total->words += wc->words;
+    total->bytes += wc->bytes;
+  }
+
+  int width = 1;
+  for (uint64_t v = sizes; v >= 10; v /= 10)
+    width++;
+  if (streams && width < 7)
+    width = 7;
+  if (nfiles == 1 && lines + words + bytes == 1)
+    width = 1;
+
+  for (int f = 0; f < nfiles; f++)
+    if (opened[f])
+      wc_print(&counts[f], lines, words, bytes, width, i < argc ? files[f] : NULL);
+  if (nfiles > 1)
+    wc_print(total, lines, words, bytes, width, "total");
+  free(counts);
+  free(opened);
+  return status;
+}
+
+/*
+* @brief  state of a grep over one file. Chunks are searched in place up to
+*         their last newline; the unfinished line at the end of a chunk is
+*         kept in carry until the next chunk completes it
+*/
+struct grep_state {
+  const char* needle;
+  size_t needle_len;
+  bool invert, count_only, numbers, names_only;
+  const char* prefix; //file name to put in front of lines, or NULL
+  uint64_t matches, lineno;
+  struct strbuf carry;
+};
+
+/*
+*@brief  prints one selected line
+*/
+static void grep_emit(struct grep_state* g, const char* line, size_t len, uint64_t lineno)
+{
+  g->matches++;
+  if (g->count_only || g->names_only)
+    return;
+  if (g->prefix)
+  {
+    out_str(ctx->out, g->prefix);
+    out_write(ctx->out, ":", 1);
+  }
+  if (g->numbers)
+  {
+    char num[24];
+    int n = snprintf(num, sizeof(num), "%" PRIu64 ":", lineno);
+    out_write(ctx->out, num, (size_t)n);
+  }
+  out_write(ctx->out, line, len);
+  if (len == 0 || line[len - 1] != '\n')
+    out_write(ctx->out, "\n", 1);
+}
+
+/*
+*@brief  greps a run of whole lines (the last one ends in a newline, or at
+*        the end of the file). The search runs over the whole run, not line
+*        by line; a hit is widened to its line afterwards, and line numbers
+*        are only counted when asked for
+*/
+static void grep_lines(struct grep_state* g, const char* s, const char* e)
+{
+  const char* counted = s; //lineno is the number of the line holding this
+
+  while (s < e)
+  {
+    const char* hit = find_fixed(s, (size_t)(e - s), g->needle, g->needle_len);
+    const char* start = e;
+    const char* end = e;
+    if (hit)
+    {
+      const char* nl = memrchr(s, '\n', (size_t)(hit - s));
+      start = nl ? nl + 1 : s;
+      nl = memchr(hit, '\n', (size_t)(e - hit));
+      end = nl ? nl + 1 : e;
+    }
+
+    if (g->invert)
+    {
+      //everything before the hit's line is selected
+      for (const char* line = s; line < start; )
+      {
+        const char* nl = memchr(line, '\n', (size_t)(start - line));
+        const char* next = nl ? nl + 1 : start;
+        if (g->numbers)
+        {
+          g->lineno += count_byte(counted, (size_t)(line - counted), '\n');
+          counted = line;
+        }
+        grep_emit(g, line, (size_t)(next - line), g->lineno);
+        line = next;
+      }
+    }
+    else if (hit)
+    {
+      if (g->numbers)
+      {
+        g->lineno += count_byte(counted, (size_t)(start - counted), '\n');
+        counted = start;
+      }
+      grep_emit(g, start, (size_t)(end - start), g->lineno);
+    }
+    if (g->names_only && g->matches > 0)
+      break;
+    s = end;
+  }
+  if (g->numbers)
+    g->lineno += count_byte(counted, (size_t)(e - counted), '\n');
+}
+
+/*
+*@brief  grep scanner
+*/
+static int grep_chunk(void* arg, const char* data, size_t len)
+{
+  struct grep_state* g = arg;
+  const char* end = data + len;
+
+  if (g->carry.len > 0)
+  {
+    //finish the line left over from the last chunk
+    const char* nl = memchr(data, '\n', len);
+    if (!nl)
+    {
+      sb_write(&g->carry, data, len);
+      return g->carry.failed ? -1 : 0;
+    }
+    sb_write(&g->carry, data, (size_t)(nl + 1 - data));
+    if (g->carry.failed)
+      return -1;
+    grep_lines(g, g->carry.data, g->carry.data + g->carry.len);
+    g->carry.len = 0;
+    data = nl + 1;
+  }
+
+  const char* last = data < end ? memrchr(data, '\n', (size_t)(end - data)) : NULL;
+  const char* whole = last ? last + 1 : data;
+  grep_lines(g, data, whole);
+  if (whole < end)
+  {
+    sb_write(&g->carry, whole, (size_t)(end - whole));
+    if (g->carry.failed)
+      return -1;
+  }
+  return g->names_only && g->matches > 0 ? 1 : 0;
+}
+
+/**
+ * @brief  Prints the lines that contain a fixed string, like grep -F
+ * @param  Options ("-c" counts matching lines, "-v" selects the lines that
+ *         don't match, "-n" numbers them, "-l" only names the files with a
+ *         match, "-F" is accepted for compatibility), the string and file
+ *         names; none or "-" reads the command's input
+ * @return 0 if a line was selected, -1 if none was or a file could not be
+ *         read
+ * Notes: there are no regular expressions, the pattern is matched byte for
+ * byte. The search runs over whole mapped windows with SSE2/AVX2 (NEON on
+ * ARM) instead of line by line
+ */
+int do_grep(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  struct grep_state g = { NULL, 0, false, false, false, false, NULL, 0, 0, { NULL, 0, 0, false } };
+  int status = 0, i = 0;
+  uint64_t selected = 0;
+
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    if (strcmp(argv[i], "--") == 0)
+    {
+      i++;
+      break;
+    }
+    for (const char* opt = argv[i] + 1; *opt; opt++)
+    {
+      if (*opt == 'c')
+        g.count_only = true;
+      else if (*opt == 'v')
+        g.invert = true;
+      else if (*opt == 'n')
+        g.numbers = true;
+      else if (*opt == 'l')
+        g.names_only = true;
+      else if (*opt != 'F')
+      {
+        fprintf(err_out(), "grep: invalid option -- '%c'\n", *opt);
+        return -1;
+      }
+    }
+  }
+  if (i == argc)
+  {
+    fprintf(err_out(), "grep: usage: grep [-cvnlF] string [file ...]\n");
+    return -1;
+  }
+  g.needle = argv[i];
+  g.needle_len = strlen(argv[i]);
+  i++;
+
+  int nfiles = i < argc ? argc - i : 1;
+  char* const* files = i < argc ? argv + i : dash;
+
+  for (int f = 0; f < nfiles; f++)
+  {
+    const char* name = strcmp(files[f], "-") == 0 ? "(standard input)" : files[f];
+    int fd = text_open(files[f]);
+    if (fd < 0)
+    {
+      status = -1;
+      continue;
+    }
+
+    g.prefix = nfiles > 1 ? name : NULL;
+    g.matches = 0;
+    g.lineno = 1;
+    g.carry.len = 0;
+    if (text_scan(fd, files[f], true, grep_chunk, &g) < 0)
+      status = -1;
+    else if (g.carry.failed)
+    {
+      fprintf(err_out(), "grep: %s\n", strerror(ENOMEM));
+      status = -1;
+    }
+    else if (g.carry.len > 0 && !(g.names_only && g.matches > 0))
+      grep_lines(&g, g.carry.data, g.carry.data + g.carry.len); //no newline at the end
+    text_close(fd);
+
+    selected += g.matches;
+    if (g.names_only && g.matches > 0)
+    {
+      out_str(ctx->out, name);
+      out_write(ctx->out, "\n", 1);
+    }
+    else if (g.count_only && !g.names_only)
+    {
+      char num[24];
+      if (g.prefix)
+      {
+        out_str(ctx->out, g.prefix);
+        out_write(ctx->out, ":", 1);
+      }
+      snprintf(num, sizeof(num), "%" PRIu64 "\n", g.matches);
+      out_str(ctx->out, num);
+    }
+  }
+  free(g.carry.data);
+  return status == 0 && selected > 0 ? 0 : -1;
+}
+
+/*
+* @brief  how far head has got in one file
+*/
+struct head_state {
+  unsigned long long left; //lines still to print
+};
+
+/*
+*@brief  head scanner: prints whole chunks while they have fewer newlines
+*        than are left, then finds the last one it needs
+*/
+static int head_chunk(void* arg, const char* data, size_t len)
+{
+  struct head_state* h = arg;
+  size_t lines = count_byte(data, len, '\n');
+
+  if (lines < h->left)
+  {
+    h->left -= lines;
+    out_write(ctx->out, data, len);
+    return 0;
+  }
+  const char* p = data;
+  for (; h->left > 0; h->left--)
+    p = (const char*)memchr(p, '\n', (size_t)(data + len - p)) + 1;
+  out_write(ctx->out, data, (size_t)(p - data));
+  return 1;
+}
+
+/**
+ * @brief  Prints the first lines of files, like head
+ * @param  "-n N" or "-N" for the number of lines (10 by default) and the
+ *         file names; none or "-" reads the command's input
+ * @return -1 if any file could not be read, 0 on success
+ * Notes: files are read in cat_buffer_size pieces rather than mapped, since
+ * head usually stops long before the end
+ */
+int do_head(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  unsigned long long lines = 10;
+  int status = 0;
+  int i = parse_line_count("head", argc, argv, &lines);
+  if (i < 0)
+    return -1;
+
+  int nfiles = i < argc ? argc - i : 1;
+  char* const* files = i < argc ? argv + i : dash;
+
+  for (int f = 0; f < nfiles; f++)
+  {
+    struct head_state h = { lines };
+    int fd = text_open(files[f]);
+    if (fd < 0)
+    {
+      status = -1;
+      continue;
+    }
+    text_banner(files[f], f, nfiles);
+    if (lines > 0 && text_scan(fd, files[f], false, head_chunk, &h) < 0)
+      status = -1;
+    text_close(fd);
+  }
+  return status;
+}
+
+/*
+*@brief  finds where the last lines of a regular file start by reading
+*        blocks backwards from the end and counting their newlines. A
+*        newline as the very last byte ends the last line rather than
+*        starting a new one, so it isn't counted
+*@return offset of the first byte to print, or -1 on error
+*/
+static off_t tail_start(int fd, off_t size, unsigned long long lines, char* buffer)
+{
+  off_t end = size;
+  unsigned long long need = lines; //newlines still to pass, counting back
+
+  if (lines == 0)
+    return size;
+  while (end > 0)
+  {
+    size_t len = end < (off_t)cat_buffer_size ? (size_t)end : (size_t)cat_buffer_size;
+    off_t base = end - (off_t)len;
+    ssize_t n = pread(fd, buffer, len, base);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n == 0 ? 0 : -1;
+
+    size_t scan = (size_t)n;
+    if (end == size && buffer[scan - 1] == '\n')
+      scan--;
+    size_t found = count_byte(buffer, scan, '\n');
+    if (found >= need)
+    {
+      //the one we want is in this block, walk back to it
+      size_t pos = scan;
+      for (; need > 0; need--)
+        pos = (size_t)((const char*)memrchr(buffer, '\n', pos) - buffer);
+      return base + (off_t)pos + 1;
+    }
+    need -= found;
+    end = base;
+  }
+  return 0;
+}
+
+/*
+*@brief  tail of something that can't seek: keeps reading, dropping what is
+*        older than the last lines every time the buffer doubles
+*@return -1 on error, 0 on success
+*/
+static int tail_stream(int fd, const char* name, unsigned long long lines)
+{
+  struct strbuf sb = { NULL, 0, 0, false };
+  size_t kept = 0;
+  int status = 0;
+
+  while (true)
+  {
+    if (sb_reserve(&sb, (size_t)cat_buffer_size) < 0)
+    {
+      fprintf(err_out(), "tail: %s\n", strerror(ENOMEM));
+      status = -1;
+      break;
+    }
+    ssize_t n = read(fd, sb.data + sb.len, (size_t)cat_buffer_size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      fprintf(err_out(), "Error reading %s: %s\n", name, strerror(errno));
+      status = -1;
+      break;
+    }
+    sb.len += (size_t)n;
+
+    if (n == 0 || sb.len > 2 * kept + (4u << 20))
+    {
+      //the start of the last lines, counting back from the end
+      size_t pos = sb.len;
+      unsigned long long need = lines;
+      if (pos > 0 && sb.data[pos - 1] == '\n')
+        pos--;
+      while (need > 0 && pos > 0)
+      {
+        const char* nl = memrchr(sb.data, '\n', pos);
+        if (!nl)
+        {
+          pos = 0;
+          break;
+        }
+        pos = (size_t)(nl - sb.data);
+        if (--need == 0)
+          pos++;
+      }
+      if (lines == 0)
+        pos = sb.len;
+      if (need == 0 || lines == 0)
+      {
+        memmove(sb.data, sb.data + pos, sb.len - pos);
+        sb.len -= pos;
+      }
+      kept = sb.len;
+    }
+    if (n == 0)
+      break;
+  }
+  if (status == 0)
+    out_write(ctx->out, sb.data, sb.len);
+  free(sb.data);
+  return status;
+}
+
+/**
+ * @brief  Prints the last lines of files, like tail
+ * @param  "-n N" or "-N" for the number of lines (10 by default) and the
+ *         file names; none or "-" reads the command's input
+ * @return -1 if any file could not be read, 0 on success
+ * Notes: a regular file is read backwards from its end only as far as the
+ * lines go, then the rest is sent out through cat's zero-copy paths, so
+ * tail of a multi-GB log reads a few blocks
+ */
+int do_tail(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  unsigned long long lines = 10;
+  int status = 0;
+  int i = parse_line_count("tail", argc, argv, &lines);
+  if (i < 0)
+    return -1;
+
+  int nfiles = i < argc ? argc - i : 1;
+  char* const* files = i < argc ? argv + i : dash;
+  struct cat_target target = { ctx->out->fd, ctx->out->tty, 0, NULL };
+  struct stat st;
+
+  if (!target.tty && fstat(target.fd, &st) == 0)
+    target.mode = st.st_mode;
+
+  for (int f = 0; f < nfiles; f++)
+  {
+    int fd = text_open(files[f]);
+    if (fd < 0)
+    {
+      status = -1;
+      continue;
+    }
+    text_banner(files[f], f, nfiles);
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+      if (!target.buffer && !(target.buffer = malloc(CAT_BUFFER_SIZE)))
+      {
+        fprintf(err_out(), "tail: %s\n", strerror(errno));
+        status = -1;
+      }
+      off_t from = target.buffer ? tail_start(fd, st.st_size, lines, target.buffer) : -1;
+      if (from < 0 && target.buffer)
+      {
+        fprintf(err_out(), "Error reading %s: %s\n", files[f], strerror(errno));
+        status = -1;
+      }
+      out_flush(ctx->out);
+      if (from >= 0 && cat_stream(fd, files[f], &target, from) < 0)
+        status = -1;
+    }
+    else if (tail_stream(fd, files[f], lines) < 0)
+      status = -1;
+    text_close(fd);
+  }
+  free(target.buffer);
+  return status;
+}
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror32(uint32_t x, int n)
+{
+  return x >> n | x << (32 - n);
+}
+
+/*
+*@brief  SHA-256 compression of whole 64 byte blocks, plain C
+*/
+static void sha256_blocks_scalar(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+  for (; blocks > 0; blocks--, data += 64)
+  {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+             (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+    for (int i = 16; i < 64; i++)
+    {
+      uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+      uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) +
+                    sha256_k[i] + w[i];
+      uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+*@brief  SHA-256 compression with the SHA extensions. Each sha256rnds2 does
+*        two rounds on the state kept as ABEF/CDGH halves, and msg1/msg2
+*        extend the message schedule four words at a time
+*/
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1); //CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b); //EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); //ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);     //CDGH
+
+  for (; blocks > 0; blocks--, data += 64)
+  {
+    __m128i abef = state0, cdgh = state1;
+    __m128i msg[4];
+
+#pragma GCC unroll 16
+    for (int g = 0; g < 16; g++)
+    {
+      if (g < 4)
+        msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), mask);
+      __m128i m = _mm_add_epi32(msg[g % 4], _mm_loadu_si128((const __m128i*)&sha256_k[4 * g]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+      if (g >= 3 && g < 15)
+      {
+        __m128i next = _mm_add_epi32(msg[(g + 1) % 4], _mm_alignr_epi8(msg[g % 4], msg[(g + 3) % 4], 4));
+        msg[(g + 1) % 4] = _mm_sha256msg2_epu32(next, msg[g % 4]);
+      }
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0e));
+      if (g >= 1 && g < 13)
+        msg[(g - 1) % 4] = _mm_sha256msg1_epu32(msg[(g - 1) % 4], msg[g % 4]);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);      //FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);   //DCHG
+  _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0)); //DCBA
+  _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));    //HGFE
+}
+#elif defined(__aarch64__)
+/*
+*@brief  SHA-256 compression with the ARMv8 crypto extensions: sha256h/h2
+*        do four rounds, su0/su1 extend the message schedule
+*/
+__attribute__((target("arch=armv8-a+crypto")))
+static void sha256_blocks_armv8(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+  uint32x4_t state0 = vld1q_u32(&state[0]), state1 = vld1q_u32(&state[4]);
+
+  for (; blocks > 0; blocks--, data += 64)
+  {
+    uint32x4_t abcd = state0, efgh = state1;
+    uint32x4_t msg[4];
+    for (int i = 0; i < 4; i++)
+      msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+    for (int g = 0; g < 16; g++)
+    {
+      uint32x4_t m = vaddq_u32(msg[g % 4], vld1q_u32(&sha256_k[4 * g]));
+      if (g < 12)
+        msg[g % 4] = vsha256su0q_u32(msg[g % 4], msg[(g + 1) % 4]);
+      uint32x4_t prev = state0;
+      state0 = vsha256hq_u32(state0, state1, m);
+      state1 = vsha256h2q_u32(state1, prev, m);
+      if (g < 12)
+        msg[g % 4] = vsha256su1q_u32(msg[g % 4], msg[(g + 2) % 4], msg[(g + 3) % 4]);
+    }
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
+#endif
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const unsigned char* data, size_t blocks);
+static _Atomic(sha256_blocks_fn) sha256_blocks;
+
+/*
+*@brief  picks the SHA-256 block function for this CPU. The instructions
+*        are checked for at run time so one binary runs anywhere
+*/
+static sha256_blocks_fn sha256_pick(void)
+{
+  sha256_blocks_fn fn = atomic_load_explicit(&sha256_blocks, memory_order_relaxed);
+  if (fn)
+    return fn;
+
+  fn = sha256_blocks_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (simd_level != SIMD_OFF && __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+    fn = sha256_blocks_shani;
+#elif defined(__aarch64__)
+  if (simd_level != SIMD_OFF && (getauxval(AT_HWCAP) & HWCAP_SHA2))
+    fn = sha256_blocks_armv8;
+#endif
+  atomic_store_explicit(&sha256_blocks, fn, memory_order_relaxed);
+  return fn;
+}
+
+#define XXH_PRIME1 0x9e3779b185ebca87ULL
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3 0x165667b19e3779f9ULL
+#define XXH_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5 0x27d4eb2f165667c5ULL
+
+static uint64_t rol64(uint64_t x, int n)
+{
+  return x << n | x >> (64 - n);
+}
+
+static uint64_t read64le(const unsigned char* p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+  return rol64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+/*
+* @brief  a hash being computed over a stream: SHA-256, or XXH64 (seed 0,
+*         the same digest as xxhsum -H1). Input that doesn't fill a block
+*         waits in buf for the next chunk
+*/
+enum hash_algo { HASH_SHA256, HASH_XXH64 };
+struct hash_state {
+  enum hash_algo algo;
+  uint64_t total;
+  union {
+    uint32_t sha[8];
+    uint64_t xxh[4];
+  } h;
+  unsigned char buf[64];
+  size_t buffered;
+  sha256_blocks_fn blocks;
+};
+
+static void hash_init(struct hash_state* hs, enum hash_algo algo)
+{
+  static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memset(hs, 0, sizeof(*hs));
+  hs->algo = algo;
+  if (algo == HASH_SHA256)
+  {
+    memcpy(hs->h.sha, sha256_iv, sizeof(sha256_iv));
+    hs->blocks = sha256_pick();
+  }
+  else
+  {
+    hs->h.xxh[0] = XXH_PRIME1 + XXH_PRIME2;
+    hs->h.xxh[1] = XXH_PRIME2;
+    hs->h.xxh[2] = 0;
+    hs->h.xxh[3] = -XXH_PRIME1;
+  }
+}
+
+/*
+*@brief  runs whole blocks (64 bytes of SHA-256, 32 byte stripes of XXH64)
+*/
+static void hash_blocks(struct hash_state* hs, const unsigned char* p, size_t blocks)
+{
+  if (hs->algo == HASH_SHA256)
+  {
+    hs->blocks(hs->h.sha, p, blocks);
+    return;
+  }
+  uint64_t v1 = hs->h.xxh[0], v2 = hs->h.xxh[1], v3 = hs->h.xxh[2], v4 = hs->h.xxh[3];
+  for (size_t i = 0; i < blocks * 2; i++, p += 32)
+  {
+    v1 = xxh64_round(v1, read64le(p));
+    v2 = xxh64_round(v2, read64le(p + 8));
+    v3 = xxh64_round(v3, read64le(p + 16));
+    v4 = xxh64_round(v4, read64le(p + 24));
+  }
+  hs->h.xxh[0] = v1;
+  hs->h.xxh[1] = v2;
+  hs->h.xxh[2] = v3;
+  hs->h.xxh[3] = v4;
+}
+
+/*
+*@brief  hashes more input. Whole blocks are hashed straight out of the
+*        caller's memory (the file mapping, mostly), only the ragged ends
+*        are copied
+*/
+static void hash_update(struct hash_state* hs, const unsigned char* p, size_t len)
+{
+  hs->total += len;
+  if (hs->buffered > 0)
+  {
+    size_t take = 64 - hs->buffered < len ? 64 - hs->buffered : len;
+    memcpy(hs->buf + hs->buffered, p, take);
+    hs->buffered += take;
+    p += take;
+    len -= take;
+    if (hs->buffered < 64)
+      return;
+    hash_blocks(hs, hs->buf, 1);
+    hs->buffered = 0;
+  }
+  hash_blocks(hs, p, len / 64);
+  memcpy(hs->buf, p + len / 64 * 64, len % 64);
+  hs->buffered = len % 64;
+}
+
+/*
+*@brief  finishes the hash and writes it as lower case hex into hex, which
+*        needs room for 65 bytes
+*/
+static void hash_final(struct hash_state* hs, char* hex)
+{
+  static const char digits[] = "0123456789abcdef";
+  unsigned char digest[32];
+  size_t size;
+
+  if (hs->algo == HASH_SHA256)
+  {
+    //a 1 bit, zeros and the length in bits, big endian, to fill the last block
+    uint64_t bits = hs->total * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (hs->buffered < 56 ? 56 : 120) - hs->buffered;
+    for (int i = 0; i < 8; i++)
+      pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    uint64_t total = hs->total;
+    hash_update(hs, pad, padlen + 8);
+    hs->total = total;
+    for (int i = 0; i < 8; i++)
+      for (int b = 0; b < 4; b++)
+        digest[4 * i + b] = (unsigned char)(hs->h.sha[i] >> (24 - 8 * b));
+    size = 32;
+  }
+  else
+  {
+    uint64_t h;
+    const unsigned char* p = hs->buf;
+    size_t left = hs->buffered;
+    if (left >= 32)
+    {
+      uint64_t v[4] = { hs->h.xxh[0], hs->h.xxh[1], hs->h.xxh[2], hs->h.xxh[3] };
+      for (int i = 0; i < 4; i++)
+        v[i] = xxh64_round(v[i], read64le(p + 8 * i));
+      memcpy(hs->h.xxh, v, sizeof(v));
+      p += 32;
+      left -= 32;
+    }
+    if (hs->total >= 32)
+    {
+      uint64_t* v = hs->h.xxh;
+      h = rol64(v[0], 1) + rol64(v[1], 7) + rol64(v[2], 12) + rol64(v[3], 18);
+      for (int i = 0; i < 4; i++)
+        h = (h ^ xxh64_round(0, v[i])) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    else
+      h = XXH_PRIME5;
+    h += hs->total;
+
+    for (; left >= 8; left -= 8, p += 8)
+      h = rol64(h ^ xxh64_round(0, read64le(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (left >= 4)
+    {
+      uint32_t w;
+      memcpy(&w, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      w = __builtin_bswap32(w);
+#endif
+      h = rol64(h ^ (uint64_t)w * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+      p += 4;
+      left -= 4;
+    }
+    for (; left > 0; left--, p++)
+      h = rol64(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    for (int i = 0; i < 8; i++)
+      digest[i] = (unsigned char)(h >> (56 - 8 * i));
+    size = 8;
+  }
+
+  for (size_t i = 0; i < size; i++)
+  {
+    hex[2 * i] = digits[digest[i] >> 4];
+    hex[2 * i + 1] = digits[digest[i] & 15];
+  }
+  hex[2 * size] = '\0';
+}
+
+/*
+*@brief  text_scan callback feeding a hash
+*/
+static int hash_chunk(void* arg, const char* data, size_t len)
+{
+  hash_update(arg, (const unsigned char*)data, len);
+  return 0;
+}
+
+/*
+* @brief  one file of a hash run, with its result (or expected result for
+*         -c)
+*/
+struct hash_item {
+  const char* name;
+  size_t name_at; //-c: where name is in the text of the lists, until it stops moving
+  enum hash_algo algo;
+  char expected[65];
+  char hex[65];
+  int status;
+};
+
+/*
+* @brief  a hash run. Files are handed out one at a time to whichever
+*         thread is free, so a few huge files and many small ones both keep
+*         every thread busy
+*/
+struct hash_job {
+  struct hash_item* items;
+  size_t count;
+  atomic_size_t next;
+  struct exec_ctx* ctx; //of the command, for "-" and error messages
+};
+
+/*
+*@brief  thread body: hashes files until there are none left
+*/
+static void* hash_worker(void* arg)
+{
+  struct hash_job* job = arg;
+  size_t i;
+
+  ctx = job->ctx;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->count)
+  {
+    struct hash_item* it = &job->items[i];
+    bool is_stdin = strcmp(it->name, "-") == 0;
+    int fd = is_stdin ? ctx->in_fd : open(it->name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      fprintf(err_out(), "hash: %s: %s\n", it->name, strerror(errno));
+      it->status = -1;
+      continue;
+    }
+    struct hash_state hs;
+    hash_init(&hs, it->algo);
+    it->status = text_scan(fd, it->name, true, hash_chunk, &hs);
+    if (it->status == 0)
+      hash_final(&hs, it->hex);
+    if (!is_stdin)
+      close(fd);
+  }
+  return NULL;
+}
+
+/*
+*@brief  hashes every item, the calling thread included in the pool
+*/
+static void hash_run(struct hash_item* items, size_t count)
+{
+  struct hash_job job = { items, count, 0, ctx };
+  size_t nthreads = (size_t)walk_thread_count();
+  if (nthreads > count)
+    nthreads = count;
+  pthread_t* threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+  size_t started = 0;
+
+  atomic_init(&job.next, 0);
+  for (; threads && started < nthreads - 1; started++)
+    if (pthread_create(&threads[started], NULL, hash_worker, &job) != 0)
+      break;
+  hash_worker(&job);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+/*
+*@brief  reads a sha256sum style list ("hex  name" or "hex *name", one per
+*        line) into items. The length of the hex says which algorithm
+*@return number of entries added, or -1 on error
+*/
+static int hash_read_list(const char* list, struct hash_item** items, size_t* count,
+                          size_t* cap, struct strbuf* text)
+{
+  int fd = text_open(list);
+  if (fd < 0)
+    return -1;
+  size_t start = text->len;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0)
+      sb_write(text, buffer, (size_t)n);
+  int saved = errno;
+  text_close(fd);
+  if (n < 0 || text->failed)
+  {
+    fprintf(err_out(), "hash: %s: %s\n", list, strerror(n < 0 ? saved : ENOMEM));
+    return -1;
+  }
+  sb_write(text, "", 1);
+
+  int added = 0;
+  for (char* line = text->data + start; *line; )
+  {
+    char* end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+    size_t hexlen = strspn(line, "0123456789abcdefABCDEF");
+    if ((hexlen == 64 || hexlen == 16) && line[hexlen] == ' ' &&
+        (line[hexlen + 1] == ' ' || line[hexlen + 1] == '*') && line[hexlen + 2])
+    {
+      if (*count == *cap)
+      {
+        size_t grown = *cap ? *cap * 2 : 64;
+        struct hash_item* more = realloc(*items, grown * sizeof(**items));
+        if (!more)
+        {
+          fprintf(err_out(), "hash: %s\n", strerror(ENOMEM));
+          return -1;
+        }
+        *items = more;
+        *cap = grown;
+      }
+      struct hash_item* it = &(*items)[(*count)++];
+      memset(it, 0, sizeof(*it));
+      it->name_at = (size_t)(line + hexlen + 2 - text->data);
+      it->algo = hexlen == 64 ? HASH_SHA256 : HASH_XXH64;
+      for (size_t i = 0; i < hexlen; i++)
+        it->expected[i] = (char)tolower((unsigned char)line[i]);
+      added++;
+    }
+    else if (*line)
+      fprintf(err_out(), "hash: %s: improperly formatted checksum line\n", list);
+    if (!end)
+      break;
+    line = end + 1;
+  }
+  return added;
+}
+
+/**
+ * @brief  Prints or checks checksums of files, in the format of sha256sum
+ * @param  "-a sha256" (the default) or "-a xxh64" for a much faster
+ *         non-cryptographic hash, "-c" to read "hash  name" lists from the
+ *         files instead and check them, then the file names; none or "-"
+ *         reads the command's input
+ * @return -1 if a file could not be read or didn't match, 0 on success
+ * Notes: files are read through the same mapped windows / big reads as
+ * grep and wc, and hashed several at a time on a pool of walk_threads
+ * threads. SHA-256 uses the SHA extensions of x86 or ARMv8 when the CPU
+ * has them. Output is in argument order whichever file finishes first
+ */
+int do_hash(int argc, char** argv) {
+  static char* const dash[] = { "-", NULL };
+  enum hash_algo algo = HASH_SHA256;
+  bool check = false;
+  int i = 0;
+
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    if (strcmp(argv[i], "-c") == 0)
+      check = true;
+    else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "sha256") == 0)
+        algo = HASH_SHA256;
+      else if (strcmp(argv[i], "xxh64") == 0)
+        algo = HASH_XXH64;
+      else
+      {
+        fprintf(err_out(), "hash: unknown algorithm %s (sha256 or xxh64)\n", argv[i]);
+        return -1;
+      }
+    }
+    else
+    {
+      fprintf(err_out(), "hash: usage: hash [-a sha256|xxh64] [-c] [file ...]\n");
+      return -1;
+    }
+  }
+
+  int nfiles = i < argc ? argc - i : 1;
+  char* const* files = i < argc ? argv + i : dash;
+  struct hash_item* items = NULL;
+  size_t count = 0, cap = 0;
+  struct strbuf text = { NULL, 0, 0, false };
+  int status = 0;
+
+  if (check)
+  {
+    for (int f = 0; f < nfiles && status == 0; f++)
+      if (hash_read_list(files[f], &items, &count, &cap, &text) < 0)
+        status = -1;
+    for (size_t k = 0; status == 0 && k < count; k++)
+      items[k].name = text.data + items[k].name_at;
+  }
+  else
+  {
+    items = calloc((size_t)nfiles, sizeof(*items));
+    if (!items)
+      status = -1;
+    for (int f = 0; items && f < nfiles; f++)
+    {
+      items[f].name = files[f];
+      items[f].algo = algo;
+    }
+    count = items ? (size_t)nfiles : 0;
+  }
+
+  if (status == 0)
+  {
+    out_flush(ctx->out);
+    hash_run(items, count);
+  }
+
+  unsigned long mismatched = 0, unreadable = 0;
+  for (size_t k = 0; status == 0 && k < count; k++)
+  {
+    struct hash_item* it = &items[k];
+    if (check)
+    {
+      bool ok = it->status == 0 && strcmp(it->hex, it->expected) == 0;
+      out_str(ctx->out, it->name);
+      out_str(ctx->out, ok ? ": OK\n" : it->status != 0 ? ": FAILED open or read\n" : ": FAILED\n");
+      mismatched += it->status == 0 && !ok;
+      unreadable += it->status != 0;
+    }
+    else if (it->status == 0)
+    {
+      out_str(ctx->out, it->hex);
+      out_str(ctx->out, "  ");
+      out_str(ctx->out, it->name);
+      out_write(ctx->out, "\n", 1);
+    }
+    if (it->status != 0)
+      status = -1;
+  }
+  if (mismatched > 0 || unreadable > 0)
+  {
+    out_flush(ctx->out);
+    if (unreadable > 0)
+      fprintf(err_out(), "hash: WARNING: %lu listed file%s could not be read\n", unreadable,
+              unreadable == 1 ? "" : "s");
+    if (mismatched > 0)
+      fprintf(err_out(), "hash: WARNING: %lu computed checksum%s did NOT match\n", mismatched,
+              mismatched == 1 ? "" : "s");
+    status = -1;
+  }
+  if (status < 0 && !items)
+    fprintf(err_out(), "hash: %s\n", strerror(ENOMEM));
+  free(items);
+  free(text.data);
+  return status;
+}
+
+/*
+* @brief  a share of a multi-target command. Names are handed over in runs
+*         that live in the same directory, along with an fd for that
+*         directory, so every operation only has to resolve the last path
+*         component. Output goes into text and is printed in argument order
+*/
+struct batch_slice {
+  const struct batch_op* op;
+  char** names;
+  int count;
+  struct strbuf text;
+  int dir_error;  //why the directory of the current run couldn't be opened
+  int status;
+  struct exec_ctx* ctx; //of the command, for error messages
+  pthread_t thread;
+  bool started;
+};
+
+/*
+*@brief  what a multi-target command does with a run of names from one
+*        directory. bases are the last components of names, relative to
+*        dirfd
+*/
+struct batch_op {
+  const char* cmd;
+  void (*apply)(struct batch_slice* s, int dirfd, char** names,
+                const char** bases, int n);
+};
+
+/*
+*@brief  the directory part of a name: where the last '/' is, ignoring
+*        trailing ones (which are cut off, "dir/" names the entry "dir")
+*@return the length of the directory part, 0 if there is none
+*/
+static size_t batch_split(char* name)
+{
+  size_t len = strlen(name);
+  while (len > 1 && name[len - 1] == '/')
+    name[--len] = '\0';
+
+  char* slash = memrchr(name, '/', len);
+  if (!slash || len == 1)
+    return 0;
+  //"/x" lives in "/", which is the one directory part ending in a slash
+  return slash == name ? 1 : (size_t)(slash - name);
+}
+
+/*
+*@brief  runs a slice: cuts it into runs of names with the same directory
+*        part, opens each directory once and hands the run to the op
+*/
+static void batch_slice_run(struct batch_slice* s, bool direct)
+{
+  const char* bases[BATCH_RUN_MAX];
+  int i = 0;
+
+  while (i < s->count)
+  {
+    size_t dirlen = batch_split(s->names[i]);
+    int n = 1;
+    while (n < BATCH_RUN_MAX && i + n < s->count)
+    {
+      char* next = s->names[i + n];
+      if (batch_split(next) != dirlen || memcmp(next, s->names[i], dirlen) != 0)
+        break;
+      n++;
+    }
+
+    int dirfd = AT_FDCWD;
+    if (dirlen)
+    {
+      char* dir = strndup(s->names[i], dirlen);
+      dirfd = dir ? open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+      s->dir_error = errno;
+      free(dir);
+    }
+    for (int k = 0; k < n; k++)
+    {
+      const char* name = s->names[i + k];
+      bases[k] = dirlen == 0 ? name : name + dirlen + (name[dirlen] == '/');
+    }
+
+    //a directory that can't be opened fails every name in it, with the
+    //reason the open failed for
+    s->op->apply(s, dirfd, s->names + i, bases, n);
+    if (dirfd >= 0)
+      close(dirfd);
+
+    if (direct && s->text.len)
+    {
+      out_write(ctx->out, s->text.data, s->text.len);
+      s->text.len = 0;
+    }
+    i += n;
+  }
+}
+
+/*
+*@brief  thread body for a slice
+*/
+static void* batch_slice_main(void* arg)
+{
+  struct batch_slice* s = arg;
+  ctx = s->ctx;
+  batch_slice_run(s, false);
+  return NULL;
+}
+
+/*
+*@brief  applies op to every name. Big lists are cut into one contiguous
+*        slice per thread; output is printed in argument order either way
+*@return -1 if it failed for any name, 0 on success
+*/
+static int batch_run(const struct batch_op* op, char** names, int count, bool parallel)
+{
+  int nslices = parallel ? count / BATCH_SLICE_MIN : 1;
+  if (nslices > walk_thread_count())
+    nslices = walk_thread_count();
+  if (nslices < 1)
+    nslices = 1;
+
+  struct batch_slice one;
+  struct batch_slice* slices = nslices > 1 ? calloc(nslices, sizeof(*slices)) : &one;
+  if (!slices)
+  {
+    slices = &one;
+    nslices = 1;
+  }
+  memset(slices, 0, nslices * sizeof(*slices));
+
+  int per = count / nslices, extra = count % nslices, next = 0;
+  for (int i = 0; i < nslices; i++)
+  {
+    slices[i].op = op;
+    slices[i].names = names + next;
+    slices[i].count = per + (i < extra);
+    slices[i].ctx = ctx;
+    next += slices[i].count;
+  }
+
+  if (nslices == 1)
+    batch_slice_run(&slices[0], true);
+  else
+  {
+    //this thread takes the first slice itself
+    for (int i = 1; i < nslices; i++)
+      slices[i].started = pthread_create(&slices[i].thread, NULL, batch_slice_main,
+                                         &slices[i]) == 0;
+    batch_slice_run(&slices[0], false);
+    for (int i = 1; i < nslices; i++)
+    {
+      if (slices[i].started)
+        pthread_join(slices[i].thread, NULL);
+      else
+        batch_slice_run(&slices[i], false);
+    }
+  }
+
+  int status = 0;
+  for (int i = 0; i < nslices; i++)
+  {
+    out_write(ctx->out, slices[i].text.data, slices[i].text.len);
+    free(slices[i].text.data);
+    if (slices[i].status < 0)
+      status = -1;
+  }
+  if (slices != &one)
+    free(slices);
+  return status;
+}
+
+/*
+*@brief  mkdir for a run of names
+*/
+static void mkdir_apply(struct batch_slice* s, int dirfd, char** names,
+                        const char** bases, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    //creates a new directory named dirname with read, write, and search permissions for owner and group
+    int err = dirfd == -1 ? s->dir_error
+            : mkdirat(dirfd, bases[i], S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0 ? errno : 0;
+    if (err)
+    {
+      fprintf(err_out(), "Error creating directory %s %s\n", names[i], strerror(err));
+      s->status = -1;
+    }
+  }
+}
+
+/*
+*@brief  rmdir for a run of names
+*/
+static void rmdir_apply(struct batch_slice* s, int dirfd, char** names,
+                        const char** bases, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    int err = dirfd == -1 ? s->dir_error
+            : unlinkat(dirfd, bases[i], AT_REMOVEDIR) < 0 ? errno : 0;
+    if (err)
+    {
+      fprintf(err_out(), "Error removing directory %s %s\n", names[i], strerror(err));
+      s->status = -1;
+    }
+  }
+}
+
+/*
+*@brief  rm for a run of names
+*/
+static void rm_apply(struct batch_slice* s, int dirfd, char** names,
+                     const char** bases, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    int err = dirfd == -1 ? s->dir_error : unlinkat(dirfd, bases[i], 0) < 0 ? errno : 0;
+    if (err)
+    {
+      fprintf(err_out(), "Error removing file %s %s\n", names[i], strerror(err));
+      s->status = -1;
+    }
+  }
+}
+
+/*
+*@brief  stat for a run of names: one stat_batch for the whole run, so
+*        they go to io_uring together when it is there
+*/
+static void stat_apply(struct batch_slice* s, int dirfd, char** names,
+                       const char** bases, int n)
+{
+  struct stat_request reqs[BATCH_RUN_MAX];
+  struct strbuf* sb = &s->text;
+
+  for (int i = 0; i < n; i++)
+  {
+    memset(&reqs[i], 0, sizeof(reqs[i]));
+    reqs[i].name = bases[i];
+    reqs[i].mask = STATX_BASIC_STATS;
+  }
+  if (dirfd != -1)
+    meta_stat_batch(dirfd, 0, reqs, n);
+  else
+    for (int i = 0; i < n; i++)
+      reqs[i].error = s->dir_error;
+
+  for (int i = 0; i < n; i++)
+  {
+    const struct statx* stx = &reqs[i].stx;
+    if (reqs[i].error)
+    {
+      sb_str(sb, "Error outputting stat: ");
+      sb_str(sb, names[i]);
+      sb_str(sb, ", ");
+      sb_str(sb, strerror(reqs[i].error));
+      sb_write(sb, "\n", 1);
+      s->status = -1;
+      continue;
+    }
+
+    char when[32];
+    time_t mtime = stx->stx_mtime.tv_sec;
+    sb_str(sb, "File: ");
+    sb_str(sb, names[i]);
+    sb_str(sb, "\nSize: ");
+    sb_uint(sb, stx->stx_size);
+    sb_str(sb, " bytes\tBlocks: ");
+    sb_uint(sb, stx->stx_blocks);
+    sb_str(sb, "\tLinks: ");
+    sb_uint(sb, stx->stx_nlink);
+    sb_str(sb, "\n");
+
+    sb_str(sb, "Inode: ");
+    sb_uint(sb, stx->stx_ino);
+    sb_str(sb, "\nTime Modified: ");
+    sb_str(sb, ctime_r(&mtime, when) ? when : "?\n");
+    sb_str(sb, "\n");
+  }
+}
+
+static const struct batch_op mkdir_op = { "mkdir", mkdir_apply };
+static const struct batch_op rmdir_op = { "rmdir", rmdir_apply };
+static const struct batch_op rm_op = { "rm", rm_apply };
+static const struct batch_op stat_op = { "stat", stat_apply };
+
+/*
+*@brief  mkdir -p for one name: every component is looked up relative to
+*        the fd of the one before, so the path is only resolved once even
+*        when most of it has to be created
+*@return -1 on error (reported), 0 on success
+*/
+static int mkdir_parents(const char* name)
+{
+  const mode_t mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
+  struct stat st;
+
+  //the usual case is a parent that is already there
+  if (mkdir(name, mode) == 0 || (errno == EEXIST && stat(name, &st) == 0 && S_ISDIR(st.st_mode)))
+    return 0;
+  if (errno != ENOENT)
+  {
+    fprintf(err_out(), "Error creating directory %s %s\n", name, strerror(errno));
+    return -1;
+  }
+
+  int fd = name[0] == '/' ? open("/", O_PATH | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+  const char* p = name;
+  char part[NAME_MAX + 1];
+  int status = fd == -1 ? -1 : 0;
+
+  while (status == 0)
+  {
+    while (*p == '/')
+      p++;
+    if (*p == '\0')
+      break;
+    const char* end = strchrnul(p, '/');
+    size_t n = (size_t)(end - p);
+    if (n > NAME_MAX)
+    {
+      errno = ENAMETOOLONG;
+      status = -1;
+      break;
+    }
+    memcpy(part, p, n);
+    part[n] = '\0';
+    p = end;
+
+    if (mkdirat(fd, part, mode) < 0 && errno != EEXIST)
+    {
+      status = -1;
+      break;
+    }
+    int next = openat(fd, part, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (next < 0)
+      status = -1;
+    if (fd != AT_FDCWD)
+      close(fd);
+    fd = next;
+  }
+  int saved = errno;
+  if (fd >= 0 && fd != AT_FDCWD)
+    close(fd);
+  if (status < 0)
+    fprintf(err_out(), "Error creating directory %s %s\n", name, strerror(saved));
+  return status;
+}
+
+/*
+*@brief  rm -r visitor: files go as soon as they are seen, directories in
+*        rm_leave once everything in them is gone
+*/
+static void rm_visit(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                     mode_t mode, const struct statx* stx)
+{
+  (void)stx;
+  if (S_ISDIR(mode))
+    return;
+  if (unlinkat(dir->fd, name, 0) < 0)
+  {
+    fprintf(err_out(), "Error removing file %s/%s %s\n", dir->path, name, strerror(errno));
+    atomic_store(&wk->w->failed, true);
+  }
+}
+
+/*
+*@brief  rm -r: removes a directory after the walker is done with it. A
+*        held parent's fd is still open, as the parent waits for its
+*        children; one that isn't held is opened again for this
+*/
+static void rm_leave(struct walk_worker* wk, struct walk_dir* dir)
+{
+  struct walk_dir* parent = dir->parent;
+
+  //it couldn't be opened (already reported), or its parent couldn't
+  if (!dir->opened || (parent && !parent->opened))
+    return;
+  int parent_fd = !parent ? AT_FDCWD : parent->held ? parent->fd : walk_reopen(parent);
+  if (parent_fd == -1 ||
+      (unlinkat(parent_fd, dir->path + dir->name_off, AT_REMOVEDIR) < 0 &&
+       !(errno == ENOTEMPTY && atomic_load(&wk->w->failed))))
+  {
+    fprintf(err_out(), "Error removing directory %s %s\n", dir->path, strerror(errno));
+    atomic_store(&wk->w->failed, true);
+  }
+  if (parent && !parent->held && parent_fd >= 0)
+    close(parent_fd);
+}
+
+/*
+*@brief  splits leading options off a builtin's words. Every character of
+*        an option word has to be in allowed; "--" ends the options
+*@return index of the first name, or -1 for an invalid option (reported)
+*/
+static int parse_flags(const char* cmd, int argc, char** argv, const char* allowed,
+                       char* seen)
+{
+  int i = 0;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    if (!strcmp(argv[i], "--"))
+      return i + 1;
+    for (const char* opt = argv[i] + 1; *opt; opt++)
+    {
+      const char* at = strchr(allowed, *opt);
+      if (!at)
+      {
+        fprintf(err_out(), "%s: invalid option -- '%c'\n", cmd, *opt);
+        return -1;
+      }
+      seen[at - allowed] = 1;
+    }
+  }
+  return i;
+}
+
+/**
+ * @brief  Creates new directories
+ * @param  "-p" to create missing parents too (and not complain about
+ *         directories that exist), then the names of the directories
+ * @return -1 if any could not be created, 0 on success
+ */
+int do_mkdir(int argc, char** argv) {
+  char seen[1] = { 0 };
+  int first = parse_flags("mkdir", argc, argv, "p", seen);
+  if (first < 0)
+    return -1;
+  if (first == argc)
+  {
+    fprintf(err_out(), "mkdir: missing operand\n");
+    return -1;
+  }
+
+  //in order, so "mkdir a a/b" works
+  int status = 0;
+  if (seen[0])
+  {
+    for (int i = first; i < argc; i++)
+      if (mkdir_parents(argv[i]) < 0)
+        status = -1;
+  }
+  else
+    status = batch_run(&mkdir_op, argv + first, argc - first, false);
+  return status;
+}
+
+/**
+ * @brief  Removes existing (empty) directories, in order
+ * @param  Names of the directories to remove
+ * @return -1 if any could not be removed, 0 on success
+ */
+int do_rmdir(int argc, char** argv) {
+  return batch_run(&rmdir_op, argv, argc, false);
+}
+
+/**
+ * @brief  Outputs the name of the current working directory
+ * @param  Not used
+ * @return Cannot fail. Always returns 1.
+ */
+int do_pwd(int argc, char** argv) {
+(void)argc;
+(void)argv;
+const char* current_dir = cwd_get(true);
+if (current_dir != NULL)
+{
+  out_str(ctx->out, "myshell:\033[32;1m");
+  out_str(ctx->out, current_dir);
+  out_str(ctx->out, "\033[0m> ");
+}
+else
+{
+  fprintf(err_out(), "Error outputting current directory: %s\n", strerror(errno));
+  return -1;
+}
+out_write(ctx->out, "\n", 1);
+return 0;
+}
+
+
+/**
+ * @brief  Removes (unlinks) files, or whole trees with -r
+ * @param  "-r" (or "-R") to remove directories and everything in them,
+ *         then the names of the files to delete
+ * @return -1 if anything could not be removed, 0 on success
+ * Notes: long lists are spread over a few threads. -r walks each tree in
+ * parallel, removing files as they are found and every directory once its
+ * last entry is gone
+ */
+int do_rm(int argc, char** argv) {
+  char seen[2] = { 0, 0 };
+  int first = parse_flags("rm", argc, argv, "rR", seen);
+  if (first < 0)
+    return -1;
+  if (first == argc)
+  {
+    fprintf(err_out(), "rm: missing operand\n");
+    return -1;
+  }
+
+  int status = 0;
+  if (seen[0] || seen[1])
+  {
+    struct walk_ops ops = { 0, rm_visit, rm_leave, NULL, NULL, NULL };
+    for (int i = first; i < argc; i++)
+    {
+      const char* name = argv[i];
+      struct stat st;
+      if (lstat(name, &st) < 0)
+      {
+        fprintf(err_out(), "Error removing file %s %s\n", name, strerror(errno));
+        status = -1;
+      }
+      else if (!S_ISDIR(st.st_mode))
+      {
+        if (unlink(name) < 0)
+        {
+          fprintf(err_out(), "Error removing file %s %s\n", name, strerror(errno));
+          status = -1;
+        }
+      }
+      else if (walk_tree(name, &ops, false) < 0)
+        status = -1;
+    }
+  }
+  else
+    status = batch_run(&rm_op, argv + first, argc - first, true);
+  return status;
+}
+
+/*
+* @brief  one thread's share of a big file copy: the bytes [done, end).
+*         done moves as copy_file_range goes, so whatever a thread couldn't
+*         do in the kernel is left for the buffered copy
+*/
+struct cp_chunk {
+  int in, out;
+  off_t done, end;
+  int error;
+  pthread_t thread;
+  bool started;
+};
+
+/*
+*@brief  copies [done, end) of a chunk inside the kernel
+*/
+static void* cp_chunk_main(void* arg)
+{
+  struct cp_chunk* c = arg;
+
+  while (c->done < c->end)
+  {
+    off_t in_off = c->done, out_off = c->done;
+    off_t left = c->end - c->done;
+    ssize_t n = copy_file_range(c->in, &in_off, c->out, &out_off,
+                                left < CAT_CHUNK_SIZE ? (size_t)left : CAT_CHUNK_SIZE, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      c->error = n < 0 ? errno : 0; //0: the file got shorter
+      break;
+    }
+    c->done += n;
+  }
+  return NULL;
+}
+
+/*
+*@brief  the slow path of cp: pread/pwrite through a buffer, for [from, end)
+*        or up to end of file when end is -1 (files that don't know their
+*        size, like the ones in /proc)
+*@return 0 on success, -1 on error (errno is set)
+*/
+static int cp_buffered(int in, int out, off_t from, off_t end)
+{
+  char* buffer = malloc(CAT_BUFFER_SIZE);
+  if (!buffer)
+    return -1;
+
+  int status = 0;
+  while (end < 0 || from < end)
+  {
+    size_t want = end < 0 || end - from > (off_t)cat_buffer_size ? (size_t)cat_buffer_size
+                                                                 : (size_t)(end - from);
+    ssize_t n = pread(in, buffer, want, from);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      status = n < 0 ? -1 : 0;
+      break;
+    }
+    for (ssize_t put = 0; put < n; )
+    {
+      ssize_t w = pwrite(out, buffer + put, (size_t)(n - put), from + put);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0)
+      {
+        status = -1;
+        break;
+      }
+      put += w;
+    }
+    if (status < 0)
+      break;
+    from += n;
+  }
+  int saved = errno;
+  free(buffer);
+  errno = saved;
+  return status;
+}
+
+/*
+*@brief  copies the contents of in to out, which is empty: a reflink if the
+*        filesystem can share the blocks, else copy_file_range (split over
+*        threads for files of cp_split_min and up), else a buffered copy
+*        picking up wherever the kernel copy stopped
+*@return 0 on success, -1 on error (errno is set)
+*/
+static int cp_contents(int in, int out, off_t size)
+{
+  if (size == 0)
+    return cp_buffered(in, out, 0, -1);
+  if (ioctl(out, FICLONE, in) == 0)
+    return 0;
+
+  int nchunks = 1;
+  if (size >= cp_split_min && cp_split_min > 0)
+  {
+    nchunks = walk_thread_count();
+    if (size / nchunks < CP_CHUNK_MIN)
+      nchunks = (int)(size / CP_CHUNK_MIN) > 0 ? (int)(size / CP_CHUNK_MIN) : 1;
+  }
+
+  struct cp_chunk one;
+  struct cp_chunk* chunks = nchunks > 1 ? calloc((size_t)nchunks, sizeof(*chunks)) : &one;
+  if (!chunks)
+  {
+    chunks = &one;
+    nchunks = 1;
+  }
+  //threads write their pieces out of order, so the file gets its size first
+  if (nchunks > 1 && ftruncate(out, size) < 0)
+    nchunks = 1;
+
+  off_t step = size / nchunks;
+  for (int i = 0; i < nchunks; i++)
+  {
+    struct cp_chunk* c = &chunks[i];
+    c->in = in;
+    c->out = out;
+    c->done = step * i;
+    c->end = i == nchunks - 1 ? size : step * (i + 1);
+    c->error = 0;
+    c->started = i > 0 && pthread_create(&c->thread, NULL, cp_chunk_main, c) == 0;
+  }
+  //this thread takes the first piece, and any that didn't get a thread
+  for (int i = 0; i < nchunks; i++)
+    if (!chunks[i].started)
+      cp_chunk_main(&chunks[i]);
+
+  int status = 0;
+  for (int i = 0; i < nchunks; i++)
+  {
+    struct cp_chunk* c = &chunks[i];
+    if (c->started)
+      pthread_join(c->thread, NULL);
+    if (c->error != 0 && !cat_unsupported(c->error))
+    {
+      errno = c->error;
+      status = -1;
+    }
+    else if (c->done < c->end && cp_buffered(in, out, c->done, c->end) < 0)
+      status = -1;
+  }
+  int saved = errno;
+  if (chunks != &one)
+    free(chunks);
+  errno = saved;
+  return status;
+}
+
+/*
+*@brief  copies one regular file to dst, relative to the directory fds.
+*        The new file gets the source's permissions minus the umask, like
+*        cp without -p. Copying a file onto itself is refused before
+*        anything is truncated
+*@return 0 on success, -1 after saying why
+*/
+static int cp_file(int src_dir, const char* src, int dst_dir, const char* dst, const char* shown)
+{
+  int in = openat(src_dir, src, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+  {
+    fprintf(err_out(), "cp: cannot open %s: %s\n", shown, strerror(errno));
+    return -1;
+  }
+  struct stat st, dst_st;
+  if (fstat(in, &st) < 0)
+  {
+    fprintf(err_out(), "cp: cannot stat %s: %s\n", shown, strerror(errno));
+    close(in);
+    return -1;
+  }
+
+  int out = openat(dst_dir, dst, O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+  int status = 0;
+  if (out < 0 || fstat(out, &dst_st) < 0)
+  {
+    fprintf(err_out(), "cp: cannot create %s: %s\n", dst, strerror(errno));
+    status = -1;
+  }
+  else if (dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino)
+  {
+    fprintf(err_out(), "cp: %s and %s are the same file\n", shown, dst);
+    status = -1;
+  }
+  else if (ftruncate(out, 0) < 0 || cp_contents(in, out, st.st_size) < 0)
+  {
+    fprintf(err_out(), "cp: error copying %s to %s: %s\n", shown, dst, strerror(errno));
+    status = -1;
+  }
+  if (out >= 0 && close(out) < 0 && status == 0)
+  {
+    fprintf(err_out(), "cp: error closing %s: %s\n", dst, strerror(errno));
+    status = -1;
+  }
+  close(in);
+  return status;
+}
+
+/*
+*@brief  copies a symlink as a symlink, replacing whatever dst was
+*@return 0 on success, -1 after saying why
+*/
+static int cp_symlink(int src_dir, const char* src, const char* dst, const char* shown)
+{
+  char target[PATH_MAX];
+  ssize_t n = readlinkat(src_dir, src, target, sizeof(target) - 1);
+  if (n < 0)
+  {
+    fprintf(err_out(), "cp: cannot read link %s: %s\n", shown, strerror(errno));
+    return -1;
+  }
+  target[n] = '\0';
+  unlink(dst);
+  if (symlink(target, dst) < 0)
+  {
+    fprintf(err_out(), "cp: cannot create link %s: %s\n", dst, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+* @brief  a cp -r in progress: entries below src (src_len bytes of each walk
+*         path) go to the same place below dst
+*/
+struct cp_tree {
+  const char* dst;
+  size_t src_len;
+};
+
+/*
+*@brief  cp -r visitor. Directories are made here, before the walker queues
+*        them, so their contents always have somewhere to go
+*/
+static void cp_visit(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                     mode_t mode, const struct statx* stx)
+{
+  const struct cp_tree* t = wk->w->ops->arg;
+  struct strbuf* dst = &wk->line;
+
+  dst->len = 0;
+  sb_str(dst, t->dst);
+  sb_str(dst, dir->path + t->src_len);
+  sb_write(dst, "/", 1);
+  sb_str(dst, name);
+  sb_write(dst, "", 1);
+  walk_join(&wk->path, dir->path, name);
+  if (dst->failed || wk->path.failed)
+  {
+    atomic_store(&wk->w->failed, true);
+    return;
+  }
+
+  int status = 0;
+  if (S_ISDIR(mode))
+  {
+    status = mkdir(dst->data, stx ? stx->stx_mode & 07777 : 0777);
+    if (status < 0 && errno == EEXIST)
+      status = 0;
+    else if (status < 0)
+      fprintf(err_out(), "cp: cannot create directory %s: %s\n", dst->data, strerror(errno));
+  }
+  else if (S_ISREG(mode))
+    status = cp_file(dir->fd, name, AT_FDCWD, dst->data, wk->path.data);
+  else if (S_ISLNK(mode))
+    status = cp_symlink(dir->fd, name, dst->data, wk->path.data);
+  else
+  {
+    fprintf(err_out(), "cp: skipping special file %s\n", wk->path.data);
+    status = -1;
+  }
+  if (status < 0)
+    atomic_store(&wk->w->failed, true);
+  dst->len = 0;
+}
+
+/*
+*@brief  copies one operand to dst, which is the final name
+*@return 0 on success, -1 on error
+*/
+static int cp_one(const char* src, const char* dst, bool recursive)
+{
+  struct stat st;
+  if (lstat(src, &st) < 0)
+  {
+    fprintf(err_out(), "cp: cannot stat %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return S_ISLNK(st.st_mode) && recursive ? cp_symlink(AT_FDCWD, src, dst, src)
+                                            : cp_file(AT_FDCWD, src, AT_FDCWD, dst, src);
+  if (!recursive)
+  {
+    fprintf(err_out(), "cp: -r not specified; omitting directory %s\n", src);
+    return -1;
+  }
+
+  //copying a directory into itself would never end: check dst and
+  //everything above it
+  struct strbuf up = { NULL, 0, 0, false };
+  struct stat up_st;
+  int status = 0;
+  sb_str(&up, dst);
+  sb_write(&up, "", 1);
+  while (!up.failed)
+  {
+    if (stat(up.data, &up_st) == 0 && up_st.st_dev == st.st_dev && up_st.st_ino == st.st_ino)
+    {
+      fprintf(err_out(), "cp: cannot copy %s into itself, %s\n", src, dst);
+      status = -1;
+      break;
+    }
+    char* slash = strrchr(up.data, '/');
+    if (!slash || strcmp(up.data, "/") == 0)
+      break;
+    slash[slash == up.data ? 1 : 0] = '\0';
+  }
+  free(up.data);
+  if (status < 0)
+    return -1;
+
+  if (mkdir(dst, st.st_mode & 07777) < 0 && errno != EEXIST)
+  {
+    fprintf(err_out(), "cp: cannot create directory %s: %s\n", dst, strerror(errno));
+    return -1;
+  }
+  struct cp_tree tree = { dst, strlen(src) };
+  struct walk_ops ops = { STATX_MODE, cp_visit, NULL, &tree, NULL, NULL };
+  return walk_tree(src, &ops, false);
+}
+
+/**
+ * @brief  Copies files, and with -r whole directory trees
+ * @param  "-r" (or "-R") to copy directories, then one source and the new
+ *         name, or any number of sources and an existing directory to copy
+ *         them into
+ * @return -1 if anything could not be copied, 0 on success
+ * Notes: on filesystems that can share blocks (btrfs, xfs, ...) files are
+ * reflinked, which takes no time at all whatever their size. Otherwise the
+ * data is copied inside the kernel with copy_file_range, a big file as
+ * several pieces on several threads, and only when that isn't possible
+ * (across some filesystems, or from /proc) through a buffer. -r walks the
+ * source tree in parallel like rm -r and du, copying symlinks as symlinks
+ */
+int do_cp(int argc, char** argv) {
+  char seen[2] = { 0, 0 };
+  int first = parse_flags("cp", argc, argv, "rR", seen);
+  if (first < 0)
+    return -1;
+  if (argc - first < 2)
+  {
+    fprintf(err_out(), "cp: usage: cp [-r] source... destination\n");
+    return -1;
+  }
+
+  bool recursive = seen[0] || seen[1];
+  const char* dst = argv[argc - 1];
+  struct stat st;
+  bool into = stat(dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if (!into && argc - first > 2)
+  {
+    fprintf(err_out(), "cp: target %s is not a directory\n", dst);
+    return -1;
+  }
+
+  int status = 0;
+  struct strbuf target = { NULL, 0, 0, false };
+  for (int i = first; i < argc - 1; i++)
+  {
+    const char* name = argv[i];
+    if (into)
+    {
+      //dst/basename of the source, ignoring trailing slashes on it
+      size_t len = strlen(name);
+      while (len > 1 && name[len - 1] == '/')
+        len--;
+      size_t base = len;
+      while (base > 0 && name[base - 1] != '/')
+        base--;
+      target.len = 0;
+      sb_str(&target, dst);
+      if (target.len > 0 && target.data[target.len - 1] != '/')
+        sb_write(&target, "/", 1);
+      sb_write(&target, name + base, len - base);
+      sb_write(&target, "", 1);
+      if (target.failed)
+      {
+        fprintf(err_out(), "cp: %s\n", strerror(ENOMEM));
+        status = -1;
+        break;
+      }
+    }
+    if (cp_one(name, into ? target.data : dst, recursive) < 0)
+      status = -1;
+  }
+  free(target.data);
+  return status;
+}
+
+/**
+ * @brief  Outputs information about files
+ * @param  Names of the files to stat
+ * @return -1 if any could not be stat'ed, 0 on success
+ * Notes: names in the same directory are stat'ed relative to one fd for it,
+ * in batches (through io_uring when it can), and long lists are spread over
+ * a few threads. Output comes in argument order
+ */
+int do_stat(int argc, char** argv) {
+  return batch_run(&stat_op, argv, argc, true);
+}
+
+/*
+* @brief  one directory in a du size index, followed by the names of its
+*         subdirectories (each NUL terminated, padded to 8 bytes). blocks
+*         counts the directory itself and everything in it that isn't a
+*         directory, so it holds for as long as the directory's mtime does
+*/
+struct du_record {
+  uint64_t dev, ino;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t names_len;
+  uint64_t blocks;
+};
+
+/*
+* @brief  a directory being read for a record, kept in walk_dir's data
+*/
+struct du_dir {
+  struct du_record rec;
+  struct strbuf names;
+};
+
+/*
+* @brief  one du command. The index of the last run stays mapped, hashed by
+*         dev and ino; records for the next one are collected per walker
+*         thread (NULL without --index)
+*/
+struct du_run {
+  int max_depth;  //-1 for no limit
+  bool human;
+  uintmax_t total; //blocks of the last tree walked
+  const char* map;
+  size_t map_len;
+  const struct du_record** table;
+  size_t mask;
+  struct strbuf* records;
+  int nrecords;
+};
+
+/*
+*@brief  bytes a record takes up in the index, names and padding included
+*/
+static size_t du_record_size(const struct du_record* rec)
+{
+  return sizeof(*rec) + ((rec->names_len + 7) & ~(size_t)7);
+}
+
+/*
+*@brief  the hash slot to start looking for a directory at
+*/
+static size_t du_slot(const struct du_run* run, uint64_t dev, uint64_t ino)
+{
+  return (size_t)(((ino ^ dev << 40) * 0x9e3779b97f4a7c15ull) >> 20) & run->mask;
+}
+
+/*
+*@brief  checks that a record's names are all plain names, so a damaged
+*        index can't send the walk anywhere else
+*@return true if the record can be used
+*/
+static bool du_record_ok(const struct du_record* rec, size_t room)
+{
+  if (room < sizeof(*rec) || du_record_size(rec) > room)
+    return false;
+  const char* names = (const char*)(rec + 1);
+  if (rec->names_len > 0 && names[rec->names_len - 1] != '\0')
+    return false;
+  for (size_t at = 0; at < rec->names_len; at += strlen(names + at) + 1)
+  {
+    const char* name = names + at;
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+      return false;
+  }
+  return true;
+}
+
+/*
+*@brief  maps the index left by an earlier run and hashes its records. A
+*        missing index is just empty; a damaged one is used up to the damage
+*/
+static void du_index_load(struct du_run* run, const char* path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno != ENOENT)
+      fprintf(err_out(), "du: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  struct stat st;
+  size_t len = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+  const size_t magic = sizeof(DU_INDEX_MAGIC) - 1;
+  char* map = len >= magic ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED || memcmp(map, DU_INDEX_MAGIC, magic) != 0)
+  {
+    fprintf(err_out(), "du: %s: not a size index, ignored\n", path);
+    if (map != MAP_FAILED)
+      munmap(map, len);
+    return;
+  }
+  run->map = map;
+  run->map_len = len;
+
+  size_t n = 0, end = magic;
+  while (du_record_ok((const struct du_record*)(map + end), len - end))
+  {
+    end += du_record_size((const struct du_record*)(map + end));
+    n++;
+  }
+  size_t cap = 16;
+  while (cap < n * 2)
+    cap *= 2;
+  run->table = calloc(cap, sizeof(*run->table));
+  if (!run->table)
+    return;
+  run->mask = cap - 1;
+  for (size_t at = magic; at < end; )
+  {
+    const struct du_record* rec = (const struct du_record*)(map + at);
+    size_t slot = du_slot(run, rec->dev, rec->ino);
+    while (run->table[slot])
+      slot = (slot + 1) & run->mask;
+    run->table[slot] = rec;
+    at += du_record_size(rec);
+  }
+}
+
+/*
+*@brief  looks a directory up in the loaded index
+*@return its record, or NULL if the last run didn't see it
+*/
+static const struct du_record* du_index_find(const struct du_run* run, uint64_t dev,
+                                             uint64_t ino)
+{
+  if (!run->table)
+    return NULL;
+  for (size_t slot = du_slot(run, dev, ino); run->table[slot]; slot = (slot + 1) & run->mask)
+    if (run->table[slot]->dev == dev && run->table[slot]->ino == ino)
+      return run->table[slot];
+  return NULL;
+}
+
+/*
+*@brief  writes every record collected next to path and renames it over
+*        path, so a run that dies halfway leaves the old index in place
+*@return 0 on success, -1 on error (reported)
+*/
+static int du_index_save(const struct du_run* run, const char* path)
+{
+  struct strbuf tmp = { 0 };
+  sb_str(&tmp, path);
+  sb_str(&tmp, ".tmp");
+  int fd = tmp.failed ? -1 : open(tmp.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int status = fd < 0 ? -1 : write_all(fd, DU_INDEX_MAGIC, sizeof(DU_INDEX_MAGIC) - 1);
+  for (int i = 0; status == 0 && i < run->nrecords; i++)
+    if (run->records[i].failed ||
+        write_all(fd, run->records[i].data, run->records[i].len) < 0)
+      status = -1;
+  if (fd >= 0 && close(fd) < 0)
+    status = -1;
+  if (status == 0 && rename(tmp.data, path) < 0)
+    status = -1;
+  if (status < 0)
+  {
+    fprintf(err_out(), "du: %s: %s\n", path, strerror(errno ? errno : ENOMEM));
+    if (fd >= 0)
+      unlink(tmp.data);
+  }
+  free(tmp.data);
+  return status;
+}
+
+/*
+*@brief  du enter hook: counts the directory itself, and if the index has
+*        it with the same mtime, takes the rest from there instead of
+*        reading it, only going on into its subdirectories
+*@return true if the directory came from the index
+*/
+static bool du_enter(struct walk_worker* wk, struct walk_dir* dir)
+{
+  struct du_run* run = wk->w->ops->arg;
+  struct statx stx;
+  if (statx_at(dir->fd, "", AT_EMPTY_PATH, STATX_BLOCKS | STATX_MTIME | STATX_INO, &stx) != 0)
+  {
+    fprintf(err_out(), "du: cannot access %s: %s\n", dir->path, strerror(errno));
+    atomic_store(&wk->w->failed, true);
+    return false;
+  }
+  dir->sum = stx.stx_blocks;
+  if (!run->records)
+    return false;
+
+  uint64_t dev = (uint64_t)stx.stx_dev_major << 32 | stx.stx_dev_minor;
+  const struct du_record* rec = du_index_find(run, dev, stx.stx_ino);
+  if (rec && rec->mtime_sec == stx.stx_mtime.tv_sec && rec->mtime_nsec == stx.stx_mtime.tv_nsec)
+  {
+    dir->sum = rec->blocks;
+    bool complete = true;
+    const char* names = (const char*)(rec + 1);
+    for (size_t at = 0; at < rec->names_len; at += strlen(names + at) + 1)
+      if (walk_descend(wk, dir, names + at) < 0)
+        complete = false;
+    if (complete)
+      sb_write(&run->records[wk->id], (const char*)rec, du_record_size(rec));
+    return true;
+  }
+
+  struct du_dir* d = calloc(1, sizeof(*d));
+  if (d)
+  {
+    d->rec.dev = dev;
+    d->rec.ino = stx.stx_ino;
+    d->rec.mtime_sec = stx.stx_mtime.tv_sec;
+    d->rec.mtime_nsec = stx.stx_mtime.tv_nsec;
+    dir->data = d;
+  }
+  return false;
+}
+
+/*
+*@brief  du visitor: adds up what isn't a directory (those count themselves
+*        once they are entered) and notes subdirectory names for the index
+*/
+static void du_visit(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                     mode_t mode, const struct statx* stx)
+{
+  (void)wk;
+  struct du_dir* d = dir->data;
+  if (!S_ISDIR(mode))
+    dir->sum += stx->stx_blocks;
+  else if (d)
+    sb_write(&d->names, name, strlen(name) + 1);
+}
+
+/*
+*@brief  du done hook: turns a directory that was read in full into a
+*        record for the next index
+*/
+static void du_done(struct walk_worker* wk, struct walk_dir* dir, bool complete)
+{
+  struct du_run* run = wk->w->ops->arg;
+  struct du_dir* d = dir->data;
+  if (!d)
+    return;
+  dir->data = NULL;
+
+  if (complete && !d->names.failed)
+  {
+    static const char pad[8];
+    struct strbuf* sb = &run->records[wk->id];
+    d->rec.names_len = (uint32_t)d->names.len;
+    d->rec.blocks = dir->sum;
+    sb_write(sb, (const char*)&d->rec, sizeof(d->rec));
+    if (d->names.len)
+      sb_write(sb, d->names.data, d->names.len);
+    sb_write(sb, pad, du_record_size(&d->rec) - sizeof(d->rec) - d->names.len);
+  }
+  free(d->names.data);
+  free(d);
+}
+
+/*
+*@brief  appends a size given in 512 byte blocks: KiB, or with human in
+*        K/M/G/... rounded up, with one decimal below 10 (like du -h)
+*/
+static void du_size(struct strbuf* sb, uintmax_t blocks, bool human)
+{
+  if (!human)
+  {
+    sb_uint(sb, (blocks + 1) / 2);
+    return;
+  }
+  static const char units[] = "KMGTPE";
+  uintmax_t bytes = blocks * 512;
+  if (bytes < 1024)
+  {
+    sb_uint(sb, bytes);
+    return;
+  }
+
+  int unit = 0;
+  uintmax_t div = 1024;
+  while (units[unit + 1] && bytes / div >= 1024)
+  {
+    div *= 1024;
+    unit++;
+  }
+  uintmax_t tenths = (bytes * 10 + div - 1) / div;
+  uintmax_t whole = (bytes + div - 1) / div;
+  if (whole >= 1024 && units[unit + 1])
+  {
+    //rounding up made it the next unit
+    unit++;
+    whole = 1;
+    tenths = 10;
+  }
+  if (tenths < 100)
+  {
+    sb_uint(sb, tenths / 10);
+    sb_write(sb, ".", 1);
+    sb_uint(sb, tenths % 10);
+  }
+  else
+  {
+    sb_uint(sb, whole);
+  }
+  sb_write(sb, &units[unit], 1);
+}
+
+/*
+*@brief  du leave hook: passes a finished directory's total up to its
+*        parent and prints it if it isn't too deep. The root's total is
+*        kept for do_du, so it comes last
+*/
+static void du_leave(struct walk_worker* wk, struct walk_dir* dir)
+{
+  struct du_run* run = wk->w->ops->arg;
+  uintmax_t blocks = dir->sum + atomic_load(&dir->below);
+  if (!dir->parent)
+  {
+    run->total = blocks;
+    return;
+  }
+  atomic_fetch_add(&dir->parent->below, blocks);
+  if (run->max_depth < 0 || dir->depth <= run->max_depth)
+  {
+    du_size(&wk->line, blocks, run->human);
+    sb_write(&wk->line, "\t", 1);
+    sb_str(&wk->line, dir->path);
+    sb_write(&wk->line, "\n", 1);
+    walk_emit(wk);
+  }
+}
+
+/**
+ * @brief  Outputs the disk usage of every directory in a tree, in KiB
+ * @param  Options: "-s" for only the total of each argument, "-h" for
+ *         sizes in K/M/G, "-d N" or "--max-depth=N" to print only
+ *         directories at most N levels down, "--index=FILE" to keep a size
+ *         index there between runs. Then the files and directories to
+ *         measure, or if none, the current working directory
+ * @return -1 on error, 0 on success
+ * Notes: the tree is walked on all cores; each thread adds up the
+ * directories it reads, and finished subtrees are added into their parents
+ * atomically. Like do_stat it counts st_blocks (512 byte units); hard links
+ * are counted once per link. With an index, a directory whose mtime hasn't
+ * changed isn't read again, only its subdirectories are looked at. mtimes
+ * only change when entries come and go, so files that grow or shrink in
+ * place aren't noticed until their directory changes
+ */
+int do_du(int argc, char** argv) {
+  //options are dropped from argv, what's left are the directories
+  char* here[] = { ".", NULL };
+  char** dirs = argv;
+  int ndirs = 0;
+  const char* index = NULL;
+  struct du_run run;
+  memset(&run, 0, sizeof(run));
+  run.max_depth = -1;
+
+  for (int i = 0; i < argc; i++)
+  {
+    const char* depth = NULL;
+    if (!strncmp(argv[i], "--max-depth=", 12))
+      depth = argv[i] + 12;
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      depth = argv[++i];
+    else if (!strncmp(argv[i], "--index=", 8) && argv[i][8] != '\0')
+      index = argv[i] + 8;
+    else if (argv[i][0] == '-' && argv[i][1] != '\0')
+    {
+      for (const char* opt = argv[i] + 1; *opt; opt++)
+      {
+        if (*opt == 's')
+          run.max_depth = 0;
+        else if (*opt == 'h')
+          run.human = true;
+        else
+        {
+          fprintf(err_out(), "du: invalid option %s\n", argv[i]);
+          return -1;
+        }
+      }
+    }
+    else
+      dirs[ndirs++] = argv[i];
+
+    if (depth)
+    {
+      char* end;
+      long n = strtol(depth, &end, 10);
+      if (*depth == '\0' || *end != '\0' || n < 0 || n > INT_MAX)
+      {
+        fprintf(err_out(), "du: invalid maximum depth: %s\n", depth);
+        return -1;
+      }
+      run.max_depth = (int)n;
+    }
+  }
+  if (ndirs == 0)
+  {
+    dirs = here;
+    ndirs = 1;
+  }
+
+  if (index)
+  {
+    run.nrecords = walk_thread_count();
+    run.records = calloc(run.nrecords, sizeof(*run.records));
+    if (!run.records)
+    {
+      fprintf(err_out(), "du: %s\n", strerror(ENOMEM));
+      return -1;
+    }
+    du_index_load(&run, index);
+  }
+
+  struct walk_ops ops = { STATX_BLOCKS, du_visit, du_leave, &run, du_enter, du_done };
+  int status = 0;
+  for (int i = 0; i < ndirs; i++)
+  {
+    struct statx stx;
+    if (statx_at(AT_FDCWD, dirs[i], 0, STATX_TYPE | STATX_BLOCKS, &stx) != 0)
+    {
+      fprintf(err_out(), "du: cannot access %s: %s\n", dirs[i], strerror(errno));
+      status = -1;
+      continue;
+    }
+
+    run.total = stx.stx_blocks;
+    if (S_ISDIR(stx.stx_mode) && walk_tree(dirs[i], &ops, false) < 0)
+      status = -1;
+
+    struct strbuf line = { 0 };
+    du_size(&line, run.total, run.human);
+    out_write(ctx->out, line.data, line.len);
+    free(line.data);
+    out_write(ctx->out, "\t", 1);
+    out_str(ctx->out, dirs[i]);
+    out_write(ctx->out, "\n", 1);
+  }
+
+  if (index && du_index_save(&run, index) < 0)
+    status = -1;
+  for (int i = 0; i < run.nrecords; i++)
+    free(run.records[i].data);
+  free(run.records);
+  free(run.table);
+  if (run.map)
+    munmap((void*)run.map, run.map_len);
+  return status;
+}
+
+/*
+*@brief  find visitor: prints the path of every entry whose name matches
+*/
+static void find_visit(struct walk_worker* wk, struct walk_dir* dir, const char* name,
+                       mode_t mode, const struct statx* stx)
+{
+  const char* pattern = wk->w->ops->arg;
+  (void)mode;
+  (void)stx;
+
+  if (pattern && fnmatch(pattern, name, 0) != 0)
+    return;
+  walk_join(&wk->line, dir->path, name);
+  sb_write(&wk->line, "\n", 1);
+  walk_emit(wk);
+}
+
+/**
+ * @brief  Outputs the path of every entry below a directory, optionally only
+ *         those whose name matches a shell pattern
+ * @param  The directory to search (default the current working directory),
+ *         optionally followed by "-name pattern"
+ * @return -1 on error, 0 on success
+ */
+int do_find(int argc, char** argv) {
+  const char* root = ".";
+  const char* pattern = NULL;
+  int i = 0;
+
+  if (i < argc && argv[i][0] != '-')
+    root = argv[i++];
+  for (; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-name") && i + 1 < argc)
+      pattern = argv[++i];
+    else
+    {
+      fprintf(err_out(), "find: unknown or incomplete expression %s\n", argv[i]);
+      return -1;
+    }
+  }
+
+  struct statx stx;
+  if (statx_at(AT_FDCWD, root, 0, STATX_TYPE, &stx) != 0)
+  {
+    fprintf(err_out(), "find: %s: %s\n", root, strerror(errno));
+    return -1;
+  }
+
+  //the root is matched on its last component, like every other entry
+  const char* base = strrchr(root, '/');
+  base = base && base[1] ? base + 1 : root;
+  if (!pattern || fnmatch(pattern, base, 0) == 0)
+  {
+    out_str(ctx->out, root);
+    out_write(ctx->out, "\n", 1);
+  }
+  if (!S_ISDIR(stx.stx_mode))
+    return 0;
+
+  struct walk_ops ops = { 0, find_visit, NULL, (void*)pattern, NULL, NULL };
+  return walk_tree(root, &ops, walk_order == WALK_ORDER_SORTED);
+}
+
+/*
+*@brief  parses a byte count with an optional k/m/g suffix (powers of 1024)
+*@return 0 on success, -1 if the text is not a valid size
+*/
+static int parse_size(const char* text, long long* value)
+{
+  char* end;
+  errno = 0;
+  long long n = strtoll(text, &end, 10);
+  if (errno != 0 || end == text || n < 0)
+    return -1;
+
+  int shift = 0;
+  switch (tolower((unsigned char)*end))
+  {
+    case 'k': shift = 10; end++; break;
+    case 'm': shift = 20; end++; break;
+    case 'g': shift = 30; end++; break;
+  }
+  if (*end != '\0' || n > (LLONG_MAX >> shift))
+    return -1;
+
+  *value = n << shift;
+  return 0;
+}
+
+/*
+*@brief  prints one tunable as "name value  # help"
+*/
+static void print_tunable(const struct tunable* t)
+{
+  out_str(ctx->out, t->name);
+  out_write(ctx->out, "\t", 1);
+  if (t->choices)
+    out_str(ctx->out, t->choices[*t->value]);
+  else
+    out_int(ctx->out, *t->value);
+  out_write(ctx->out, "\t# ", 3);
+  out_str(ctx->out, t->help);
+  out_write(ctx->out, "\n", 1);
+}
+
+/**
+ * @brief  Shows or changes the shell's runtime tunables
+ * @param  No arguments to list every tunable, a name to show one,
+ *         or a name and a new value to change it
+ * @return -1 on error, 0 on success
+ */
+int do_set(int argc, char** argv) {
+  size_t count = sizeof(tunables) / sizeof(tunables[0]);
+
+  if (argc == 0)
+  {
+    for (size_t i = 0; i < count; i++)
+      print_tunable(&tunables[i]);
+    return 0;
+  }
+
+  const struct tunable* t = NULL;
+  for (size_t i = 0; i < count && !t; i++)
+    if (!strcmp(tunables[i].name, argv[0]))
+      t = &tunables[i];
+
+  if (!t)
+  {
+    fprintf(err_out(), "set: unknown setting %s\n", argv[0]);
+    return -1;
+  }
+  if (argc == 1)
+  {
+    print_tunable(t);
+    return 0;
+  }
+
+  if (t->choices)
+  {
+    for (long long i = 0; t->choices[i]; i++)
+    {
+      if (!strcmp(t->choices[i], argv[1]))
+      {
+        *t->value = i;
+        return 0;
+      }
+    }
+    fprintf(err_out(), "set: %s must be one of:", t->name);
+    for (int i = 0; t->choices[i]; i++)
+      fprintf(err_out(), " %s", t->choices[i]);
+    fprintf(err_out(), "\n");
+    return -1;
+  }
+
+  long long value;
+  if (parse_size(argv[1], &value) < 0 || value < t->min || value > t->max)
+  {
+    fprintf(err_out(), "set: %s must be a size between %lld and %lld: %s\n",
+            t->name, t->min, t->max, argv[1]);
+    return -1;
+  }
+  *t->value = value;
+  return 0;
+}
+
+/**
+ * @brief  Leaves the shell
+ * @param  Not used
+ * @return Does not return
+ */
+int do_exit(int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+  //under --serve only the connection ends, once the response is sent
+  if (serving)
+  {
+    serve_exit = true;
+    return 0;
+  }
+  out_flush(ctx->out);
+  exit(EXIT_SUCCESS);
+}
+
+/*
+* @brief  one program found on PATH: which PATH directory it came from, how
+*         often it has been run, and its full path
+*/
+struct path_entry {
+  struct path_entry* next;
+  const char* name;     //points into full, after the directory
+  size_t dir;           //index into path_cache.dirs
+  unsigned long hits;
+  char full[];
+};
+
+/*
+* @brief  a PATH directory and the mtime it had when it was last searched.
+*         Adding or removing a program changes it, so a changed mtime means
+*         what is known about that directory (and everything behind it on
+*         PATH, which it might now shadow) is out of date
+*/
+struct path_dir {
+  const char* name;
+  size_t len;
+  struct timespec mtime;
+  bool seen;            //mtime has been recorded
+};
+
+/*
+* @brief  where commands were last found on PATH, so running a program
+*         doesn't mean probing every PATH directory again. It is built for
+*         one value of PATH and starts over when PATH changes
+*/
+static struct {
+  char* path;           //the PATH this was built for, split up in place
+  size_t path_len;
+  struct path_dir* dirs;
+  size_t count;
+  struct path_entry* table[PATH_HASH_SIZE];
+  struct strbuf name;   //scratch for building candidate paths
+} path_cache;
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER; //for --serve workers
+
+/*
+*@brief  same FNV-1a the command table uses, unseeded
+*/
+static uint32_t path_hash(const char* s)
+{
+  uint32_t h = 2166136261u;
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h % PATH_HASH_SIZE;
+}
+
+/*
+*@brief  forgets what was found in PATH directories from index dir on
+*/
+static void path_forget(size_t dir)
+{
+  for (size_t i = 0; i < PATH_HASH_SIZE; i++)
+  {
+    struct path_entry** link = &path_cache.table[i];
+    while (*link)
+    {
+      struct path_entry* e = *link;
+      if (e->dir >= dir)
+      {
+        *link = e->next;
+        free(e);
+      }
+      else
+        link = &e->next;
+    }
+  }
+}
+
+/*
+*@brief  makes sure the cache was built for this PATH, starting over if not
+*@return 0 on success, -1 if out of memory
+*/
+static int path_sync(const char* env)
+{
+  size_t len = strlen(env);
+  if (path_cache.path && len == path_cache.path_len &&
+      memcmp(path_cache.path, env, len) == 0)
+    return 0;
+  //the split copy no longer matches byte for byte, so compare with dirs
+  if (path_cache.path)
+  {
+    size_t off = 0;
+    bool same = true;
+    for (size_t i = 0; same && i < path_cache.count; i++)
+    {
+      const struct path_dir* d = &path_cache.dirs[i];
+      same = off + d->len <= len && memcmp(env + off, d->name, d->len) == 0 &&
+             (i + 1 == path_cache.count ? off + d->len == len
+                                        : env[off + d->len] == ':');
+      off += d->len + 1;
+    }
+    if (same)
+      return 0;
+  }
+
+  path_forget(0);
+  free(path_cache.path);
+  free(path_cache.dirs);
+  path_cache.count = 0;
+  path_cache.path_len = len;
+  path_cache.path = strdup(env);
+  size_t count = 1;
+  for (const char* p = env; *p; p++)
+    count += *p == ':';
+  path_cache.dirs = calloc(count, sizeof(*path_cache.dirs));
+  if (!path_cache.path || !path_cache.dirs)
+  {
+    free(path_cache.path);
+    free(path_cache.dirs);
+    path_cache.path = NULL;
+    path_cache.dirs = NULL;
+    return -1;
+  }
+
+  char* p = path_cache.path;
+  for (size_t i = 0; i < count; i++)
+  {
+    char* end = strchrnul(p, ':');
+    bool last = *end == '\0';
+    *end = '\0';
+    path_cache.dirs[i].name = p;
+    path_cache.dirs[i].len = (size_t)(end - p);
+    p = last ? end : end + 1;
+  }
+  path_cache.count = count;
+  return 0;
+}
+
+/*
+*@brief  checks a PATH directory against the mtime it had last time,
+*        dropping the entries it may have invalidated
+*@return true if it hasn't changed
+*/
+static bool path_dir_current(size_t i)
+{
+  struct path_dir* d = &path_cache.dirs[i];
+  struct stat st;
+
+  if (stat(d->len ? d->name : ".", &st) < 0)
+    st.st_mtim = (struct timespec){ 0, 0 };
+  if (d->seen && st.st_mtim.tv_sec == d->mtime.tv_sec &&
+      st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+    return true;
+  if (d->seen)
+    path_forget(i);
+  d->mtime = st.st_mtim;
+  d->seen = true;
+  return false;
+}
+
+/*
+*@brief  looks a command up on PATH the way execvp would, remembering
+*        where it was found. A hit only costs a stat of the PATH
+*        directories up to and including the one it came from
+*@return the full path of the program, or NULL if there is none
+*/
+static const char* path_lookup(const char* name)
+{
+  const char* env = getenv("PATH");
+  if (!env)
+    env = "/usr/local/bin:/usr/bin:/bin";
+  if (path_sync(env) < 0)
+    return NULL;
+
+  uint32_t h = path_hash(name);
+  for (struct path_entry* e = path_cache.table[h]; e; e = e->next)
+  {
+    if (strcmp(e->name, name) != 0)
+      continue;
+    size_t dir = e->dir;
+    bool current = true;
+    for (size_t i = 0; current && i <= dir; i++)
+      current = path_dir_current(i);
+    if (!current)
+      break;  //e is gone, search again
+    e->hits++;
+    return e->full;
+  }
+
+  struct strbuf* sb = &path_cache.name;
+  for (size_t i = 0; i < path_cache.count; i++)
+  {
+    const struct path_dir* d = &path_cache.dirs[i];
+    //recorded before looking, so a program added after this shows up
+    path_dir_current(i);
+
+    sb->len = 0;
+    if (d->len)
+    {
+      sb_write(sb, d->name, d->len);
+      sb_write(sb, "/", 1);
+    }
+    sb_str(sb, name);
+    if (sb->failed)
+      return NULL;
+    sb->data[sb->len] = '\0';
+
+    struct stat st;
+    if (stat(sb->data, &st) < 0 || !S_ISREG(st.st_mode) ||
+        access(sb->data, X_OK) < 0)
+      continue;
+
+    //an empty entry means the current directory, which cd moves
+    if (d->len == 0 || d->name[0] != '/')
+      return sb->data;
+    struct path_entry* e = malloc(sizeof(*e) + sb->len + 1);
+    if (!e)
+      return sb->data;
+    memcpy(e->full, sb->data, sb->len + 1);
+    e->name = e->full + d->len + 1;
+    e->dir = i;
+    e->hits = 1;
+    e->next = path_cache.table[h];
+    path_cache.table[h] = e;
+    return e->full;
+  }
+  return NULL;
+}
+
+extern char** environ;
+
+/*
+*@brief  starts a program that isn't a builtin with in, out and err as
+*        its stdin, stdout and stderr. posix_spawn uses vfork semantics in glibc, so
+*        starting a child doesn't copy the shell's page tables however big
+*        it has grown. The shell ignores SIGPIPE for its pipeline threads;
+*        the child gets the default back
+*@return the child's pid, or -1 if it couldn't be started
+*/
+static posix_spawnattr_t spawn_attr;
+
+static void spawn_attr_init(void)
+{
+  sigset_t pipe_only;
+  sigemptyset(&pipe_only);
+  sigaddset(&pipe_only, SIGPIPE);
+  posix_spawnattr_init(&spawn_attr);
+  posix_spawnattr_setsigdefault(&spawn_attr, &pipe_only);
+  posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGDEF);
+}
+
+static pid_t spawn_program(char** argv, int in, int out_fd, int err_fd)
+{
+  //copied while the cache is locked, another thread may change it
+  pthread_mutex_lock(&path_lock);
+  const char* found = strchr(argv[0], '/') ? argv[0] : path_lookup(argv[0]);
+  char* path = found ? strdup(found) : NULL;
+  pthread_mutex_unlock(&path_lock);
+  if (!path)
+  {
+    if (found)
+      fprintf(err_out(), "myshell: %s: %s\n", argv[0], strerror(ENOMEM));
+    else
+      fprintf(err_out(), "myshell: %s: command not found\n", argv[0]);
+    return -1;
+  }
+
+  static pthread_once_t attr_once = PTHREAD_ONCE_INIT;
+  pthread_once(&attr_once, spawn_attr_init);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_t* use = NULL;
+  if (in != STDIN_FILENO || out_fd != STDOUT_FILENO || err_fd != STDERR_FILENO)
+  {
+    posix_spawn_file_actions_init(&actions);
+    if (in != STDIN_FILENO)
+      posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+      posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    if (err_fd != STDERR_FILENO)
+      posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    use = &actions;
+  }
+
+  pid_t pid;
+  int err = posix_spawn(&pid, path, use, &spawn_attr, argv, environ);
+  free(path);
+  if (use)
+    posix_spawn_file_actions_destroy(use);
+  if (err != 0)
+  {
+    fprintf(err_out(), "myshell: %s: %s\n", argv[0], strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+/*
+*@brief  waits for a child started by spawn_program
+*@return the program's exit status (128 + signal if it was killed), or -1
+*/
+static int wait_program(pid_t pid, const char* name)
+{
+  int wstatus;
+  while (waitpid(pid, &wstatus, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      fprintf(err_out(), "myshell: %s: %s\n", name, strerror(errno));
+      return -1;
+    }
+  }
+  if (WIFSIGNALED(wstatus))
+    return 128 + WTERMSIG(wstatus);
+  return WEXITSTATUS(wstatus);
+}
+
+/*
+*@brief  runs a program that isn't a builtin and waits for it, with
+*        err_fd as its stderr
+*@return the program's exit status, or -1 if it couldn't be started
+*/
+static int spawn_external(char** argv, int in, int out_fd, int err_fd)
+{
+  //the child writes to the same stdout, so get ours out first
+  out_flush(ctx->out);
+
+  pid_t pid = spawn_program(argv, in, out_fd, err_fd);
+  return pid < 0 ? -1 : wait_program(pid, argv[0]);
+}
+
+/**
+ * @brief  Shows or clears the table of programs found on PATH
+ * @param  -r to forget everything, -l (or nothing) to list it
+ * @return 0 on success, -1 for an unknown option
+ */
+int do_rehash(int argc, char** argv) {
+  if (argc > 0 && strcmp(argv[0], "-r") == 0)
+  {
+    pthread_mutex_lock(&path_lock);
+    path_forget(0);
+    for (size_t i = 0; i < path_cache.count; i++)
+      path_cache.dirs[i].seen = false;
+    pthread_mutex_unlock(&path_lock);
+    return 0;
+  }
+  if (argc > 0 && strcmp(argv[0], "-l") != 0)
+  {
+    fprintf(err_out(), "rehash: unknown option: %s\n", argv[0]);
+    return -1;
+  }
+
+  //collected first, so the lock isn't held while out waits for a reader
+  struct strbuf sb = { NULL, 0, 0, false };
+  pthread_mutex_lock(&path_lock);
+  for (size_t i = 0; i < PATH_HASH_SIZE; i++)
+  {
+    for (const struct path_entry* e = path_cache.table[i]; e; e = e->next)
+    {
+      if (sb.len == 0)
+        sb_str(&sb, "hits\tcommand\n");
+      char hits[24];
+      snprintf(hits, sizeof(hits), "%4lu\t", e->hits);
+      sb_str(&sb, hits);
+      sb_str(&sb, e->full);
+      sb_write(&sb, "\n", 1);
+    }
+  }
+  pthread_mutex_unlock(&path_lock);
+  out_write(ctx->out, sb.data, sb.len);
+  free(sb.data);
+  return 0;
+}
+
+/**
+ * @brief  Sets environment variables for the programs the shell runs
+ * @param  NAME=value words; a bare NAME is accepted and left alone
+ * @return 0 on success, -1 if a name is not valid
+ */
+int do_export(int argc, char** argv) {
+  int status = 0;
+
+  for (int i = 0; i < argc; i++)
+  {
+    const char* eq = strchr(argv[i], '=');
+    size_t n = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+    bool valid = n > 0 && !isdigit((unsigned char)argv[i][0]);
+    for (size_t j = 0; valid && j < n; j++)
+      valid = isalnum((unsigned char)argv[i][j]) || argv[i][j] == '_';
+    if (!valid)
+    {
+      fprintf(err_out(), "export: not a valid identifier: %s\n", argv[i]);
+      status = -1;
+      continue;
+    }
+    if (!eq)
+      continue;
+
+    //argv lives in the command arena, so setenv makes its own copy
+    char* name = strndup(argv[i], n);
+    if (!name || setenv(name, eq + 1, 1) < 0)
+    {
+      fprintf(err_out(), "export: %s\n", strerror(errno));
+      status = -1;
+    }
+    free(name);
+  }
+  return status;
+}
+
+//command flags
+#define CMD_SHELL  0x1 //changes the state of the shell itself (cwd, exiting, jobs)
+#define CMD_SHARED 0x2 //uses state every --serve connection would share
+
+/*
+* @brief  one builtin: its handler, how many words may follow its name
+*         (max_args of -1 means no limit) and its CMD_* flags
+*/
+struct command {
+  const char* name;
+  int (*handler)(int argc, char** argv);
+  int min_args, max_args;
+  unsigned int flags;
+};
+
+/*
+* @brief  every builtin the shell knows. This is the one place a new
+*         command has to be added
+*/
+static const struct command commands[] = {
+  { "cat",   do_cat,   0, -1, 0 },
+  { "cache", do_cache, 0,  1, 0 },
+  { "cd",    do_cd,    0,  1, CMD_SHELL },
+  { "cp",    do_cp,    2, -1, 0 },
+  { "du",    do_du,    0, -1, 0 },
+  { "exit",  do_exit,  0,  0, CMD_SHELL },
+  { "export", do_export, 1, -1, CMD_SHELL | CMD_SHARED },
+  { "fg",    do_fg,    0,  1, CMD_SHELL | CMD_SHARED },
+  { "grep",  do_grep,  1, -1, 0 },
+  { "hash",  do_hash,  0, -1, 0 },
+  { "history", do_history, 0, 1, CMD_SHARED },
+  { "head",  do_head,  0, -1, 0 },
+  { "find",  do_find,  0, -1, 0 },
+  { "jobs",  do_jobs,  0,  0, CMD_SHELL | CMD_SHARED },
+  { "ls",    do_ls,    0, -1, 0 },
+  { "mkdir", do_mkdir, 1, -1, 0 },
+  { "parallel", do_parallel, 0, -1, CMD_SHELL | CMD_SHARED },
+  { "pwd",   do_pwd,   0,  0, 0 },
+  { "rehash", do_rehash, 0, 1, 0 },
+  { "rm",    do_rm,    1, -1, 0 },
+  { "rmdir", do_rmdir, 1, -1, 0 },
+  { "set",   do_set,   0,  2, CMD_SHARED },
+  { "stat",  do_stat,  1, -1, 0 },
+  { "stats", do_stats, 0,  1, 0 },
+  { "tail",  do_tail,  0, -1, 0 },
+  { "wait",  do_wait,  0, -1, CMD_SHELL | CMD_SHARED },
+  { "wc",    do_wc,    0, -1, 0 },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+_Static_assert(NUM_COMMANDS * 4 <= COMMAND_HASH_SIZE && NUM_COMMANDS < 255,
+               "COMMAND_HASH_SIZE is too small for the command table");
+
+/*
+* @brief  perfect hash over the command names: each slot holds a command's
+*         index + 1, or 0 if empty. It is built on first use by trying hash
+*         seeds until every name lands in a slot of its own, so a lookup is
+*         one hash and one strcmp no matter how many commands there are
+*/
+static unsigned char command_slots[COMMAND_HASH_SIZE];
+static uint32_t command_seed;
+static bool command_slots_ready = false;
+
+/*
+*@brief  FNV-1a of a command name, mixed with a seed, reduced to a slot
+*/
+static uint32_t command_hash(const char* name, uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ seed;
+  for (; *name; name++)
+  {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h & (COMMAND_HASH_SIZE - 1);
+}
+
+/*
+*@brief  finds a seed that doesn't collide and fills in command_slots
+*/
+static void build_command_slots(void)
+{
+  for (uint32_t seed = 0; seed < (1u << 20); seed++)
+  {
+    size_t i;
+    memset(command_slots, 0, sizeof(command_slots));
+    for (i = 0; i < NUM_COMMANDS; i++)
+    {
+      uint32_t slot = command_hash(commands[i].name, seed);
+      if (command_slots[slot])
+        break;
+      command_slots[slot] = (unsigned char)(i + 1);
+    }
+    if (i == NUM_COMMANDS)
+    {
+      command_seed = seed;
+      command_slots_ready = true;
+      return;
+    }
+  }
+
+  //only possible if a name is in the table twice
+  fprintf(err_out(), "myshell: command table has duplicate names\n");
+  abort();
+}
+
+/*
+*@brief  looks up a builtin by name
+*@return the table entry, or NULL if there is no such command
+*/
+static const struct command* find_command(const char* name)
+{
+  if (!command_slots_ready)
+    build_command_slots();
+
+  unsigned char index = command_slots[command_hash(name, command_seed)];
+  if (index && !strcmp(commands[index - 1].name, name))
+    return &commands[index - 1];
+  return NULL;
+}
+
+/*
+* @brief  what Tab completes a word to: every name that starts with it,
+*         copied out of the listings (which only stay valid until the next
+*         glob_list), then put in order without duplicates
+*/
+struct completion {
+  struct strbuf names;  //NUL separated
+  uint32_t* at;
+  unsigned char* type;  //d_type, DT_UNKNOWN when it needs a stat to tell
+  size_t count, cap;
+};
+
+/*
+*@brief  adds one candidate
+*/
+static void completion_add(struct completion* c, const char* name, unsigned char type)
+{
+  if (c->count == c->cap)
+  {
+    size_t cap = c->cap ? c->cap * 2 : 256;
+    uint32_t* at = realloc(c->at, cap * sizeof(*at));
+    if (at)
+      c->at = at;
+    unsigned char* types = at ? realloc(c->type, cap) : NULL;
+    if (!types)
+    {
+      c->names.failed = true;
+      return;
+    }
+    c->type = types;
+    c->cap = cap;
+  }
+  c->at[c->count] = (uint32_t)c->names.len;
+  c->type[c->count++] = type;
+  sb_write(&c->names, name, strlen(name) + 1);
+}
+
+/*
+*@brief  adds the names of a directory that start with prefix, found by
+*        binary search in its sorted listing. Dot files only come with a
+*        prefix that asks for them
+*/
+static void completion_dir(struct completion* c, const char* dir, const char* prefix,
+                           size_t plen, bool programs)
+{
+  struct glob_dir* d = glob_list(dir);
+  if (!d || glob_dir_sort(d) < 0)
+    return;
+
+  size_t lo = 0, hi = d->count;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(d->names + d->offs[d->order[mid]], prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; i < d->count; i++)
+  {
+    uint32_t k = d->order[i];
+    const char* name = d->names + d->offs[k];
+    if (strncmp(name, prefix, plen) != 0)
+      break;
+    if ((name[0] == '.' && prefix[0] != '.') || (programs && d->types[k] == DT_DIR))
+      continue;
+    completion_add(c, name, d->types[k] == DT_LNK ? DT_UNKNOWN : d->types[k]);
+  }
+}
+
+static int completion_cmp(const void* a, const void* b, void* arg)
+{
+  const struct completion* c = arg;
+  return strcmp(c->names.data + c->at[*(const uint32_t*)a],
+                c->names.data + c->at[*(const uint32_t*)b]);
+}
+
+/*
+*@brief  sorts the candidates and drops the duplicates (a program in two
+*        PATH directories, or one that is also a builtin)
+*/
+static void completion_sort(struct completion* c)
+{
+  uint32_t* order = malloc((c->count ? c->count : 1) * sizeof(*order));
+  uint32_t* at = malloc((c->count ? c->count : 1) * sizeof(*at));
+  unsigned char* type = malloc(c->count ? c->count : 1);
+  if (!order || !at || !type)
+  {
+    free(order);
+    free(at);
+    free(type);
+    c->count = 0;
+    return;
+  }
+  for (size_t i = 0; i < c->count; i++)
+    order[i] = (uint32_t)i;
+  qsort_r(order, c->count, sizeof(*order), completion_cmp, c);
+
+  size_t n = 0;
+  for (size_t i = 0; i < c->count; i++)
+  {
+    uint32_t k = order[i];
+    if (n > 0 && strcmp(c->names.data + at[n - 1], c->names.data + c->at[k]) == 0)
+      continue;
+    at[n] = c->at[k];
+    type[n++] = c->type[k];
+  }
+  free(order);
+  free(c->at);
+  free(c->type);
+  c->at = at;
+  c->type = type;
+  c->count = c->cap = n;
+}
+
+/*
+*@brief  lists the candidates in columns below the line, the way ls would
+*/
+static void completion_show(const struct completion* c)
+{
+  struct winsize ws;
+  size_t width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  size_t widest = 1;
+  for (size_t i = 0; i < c->count; i++)
+  {
+    size_t w = text_cols(c->names.data + c->at[i], strlen(c->names.data + c->at[i])) +
+               (c->type[i] == DT_DIR);
+    if (w > widest)
+      widest = w;
+  }
+  size_t ncols = width / (widest + 2) ? width / (widest + 2) : 1;
+  size_t nrows = (c->count + ncols - 1) / ncols;
+
+  struct strbuf sb = { NULL, 0, 0, false };
+  sb_write(&sb, "\n", 1);
+  for (size_t row = 0; row < nrows; row++)
+  {
+    for (size_t col = 0; col < ncols; col++)
+    {
+      size_t i = col * nrows + row;
+      if (i >= c->count)
+        break;
+      const char* name = c->names.data + c->at[i];
+      size_t w = text_cols(name, strlen(name));
+      sb_str(&sb, name);
+      if (c->type[i] == DT_DIR)
+      {
+        sb_write(&sb, "/", 1);
+        w++;
+      }
+      if (col + 1 < ncols && i + nrows < c->count)
+        for (; w < widest + 2; w++)
+          sb_write(&sb, " ", 1);
+    }
+    sb_write(&sb, "\n", 1);
+  }
+  if (!sb.failed)
+    write_all(STDOUT_FILENO, sb.data, sb.len);
+  free(sb.data);
+}
+
+/*
+*@brief  puts text into the line at the cursor, with a \ in front of
+*        anything tokenize would otherwise take for something else
+*/
+static void editor_insert(const char* text, size_t len)
+{
+  struct strbuf sb = { NULL, 0, 0, false };
+  for (size_t i = 0; i < len; i++)
+  {
+    if (memchr(" \t\\'\"|&<>*?[#", text[i], 13))
+      sb_write(&sb, "\\", 1);
+    sb_write(&sb, text + i, 1);
+  }
+  if (!sb.failed && sb_reserve(&ed.line, sb.len) == 0)
+  {
+    memmove(ed.line.data + ed.pos + sb.len, ed.line.data + ed.pos, ed.line.len - ed.pos);
+    memcpy(ed.line.data + ed.pos, sb.data, sb.len);
+    ed.line.len += sb.len;
+    ed.pos += sb.len;
+  }
+  free(sb.data);
+}
+
+/*
+*@brief  completes the word before the cursor: the first word of a command
+*        from the builtins and the programs on PATH, anything else as a
+*        path. Directories come from the glob cache's listings, sorted once
+*        and then searched, so a Tab in a huge directory reads nothing that
+*        hasn't changed. Ambiguous words get as far as all candidates agree,
+*        and a second Tab lists them
+*/
+static void editor_complete(bool again)
+{
+  const char* line = ed.line.data;
+  size_t start = ed.pos;
+  while (start > 0 && !memchr("|&<>", line[start - 1], 4) &&
+         !(isblank((unsigned char)line[start - 1]) && (start < 2 || line[start - 2] != '\\')))
+    start--;
+  size_t before = start;
+  while (before > 0 && isblank((unsigned char)line[before - 1]))
+    before--;
+  bool first = before == 0 || line[before - 1] == '|' || line[before - 1] == '&';
+
+  //the word as tokenize would see it, without its escapes
+  struct strbuf word = { NULL, 0, 0, false };
+  for (size_t i = start; i < ed.pos; i++)
+  {
+    if (line[i] == '\\' && i + 1 < ed.pos)
+      i++;
+    sb_write(&word, line + i, 1);
+  }
+  sb_write(&word, "", 1);
+  if (word.failed)
+  {
+    free(word.data);
+    return;
+  }
+
+  struct completion c = { { NULL, 0, 0, false }, NULL, NULL, 0, 0 };
+  char* slash = strrchr(word.data, '/');
+  const char* prefix = slash ? slash + 1 : word.data;
+  size_t plen = strlen(prefix);
+  struct strbuf dir = { NULL, 0, 0, false };
+  if (slash)
+    sb_write(&dir, word.data, slash == word.data ? 1 : (size_t)(slash - word.data));
+  sb_write(&dir, slash ? "" : ".", slash ? 1 : 2);
+
+  if (first && !slash)
+  {
+    for (size_t i = 0; i < NUM_COMMANDS; i++)
+      if (strncmp(commands[i].name, prefix, plen) == 0)
+        completion_add(&c, commands[i].name, DT_REG);
+    const char* env = getenv("PATH");
+    if (path_sync(env ? env : "/usr/local/bin:/usr/bin:/bin") == 0)
+      for (size_t i = 0; i < path_cache.count; i++)
+        completion_dir(&c, path_cache.dirs[i].len ? path_cache.dirs[i].name : ".",
+                       prefix, plen, true);
+  }
+  else if (!dir.failed)
+    completion_dir(&c, dir.data, prefix, plen, false);
+  if (!c.names.failed)
+    completion_sort(&c);
+  else
+    c.count = 0;
+
+  //how far every candidate agrees
+  size_t common = 0;
+  if (c.count > 0)
+  {
+    const char* one = c.names.data + c.at[0];
+    common = strlen(one);
+    for (size_t i = 1; i < c.count && common > plen; i++)
+    {
+      const char* other = c.names.data + c.at[i];
+      size_t k = plen;
+      while (k < common && one[k] == other[k])
+        k++;
+      common = k;
+    }
+  }
+
+  if (c.count == 1)
+  {
+    const char* name = c.names.data + c.at[0];
+    unsigned char type = c.type[0];
+    struct stat st;
+    if (type == DT_UNKNOWN && !first)
+    {
+      struct strbuf path = { NULL, 0, 0, false };
+      sb_write(&path, dir.data, strlen(dir.data));
+      sb_str(&path, "/");
+      sb_str(&path, name);
+      if (!path.failed && stat(path.data, &st) == 0 && S_ISDIR(st.st_mode))
+        type = DT_DIR;
+      free(path.data);
+    }
+    editor_insert(name + plen, common - plen);
+    //a directory goes on to its names, anything else is a finished word
+    if (sb_reserve(&ed.line, 1) == 0)
+    {
+      memmove(ed.line.data + ed.pos + 1, ed.line.data + ed.pos, ed.line.len - ed.pos);
+      ed.line.data[ed.pos++] = type == DT_DIR ? '/' : ' ';
+      ed.line.len++;
+    }
+  }
+  else if (c.count > 1 && common > plen)
+    editor_insert(c.names.data + c.at[0] + plen, common - plen);
+  else if (c.count > 1 && again)
+  {
+    bool show = true;
+    if (c.count > COMPLETE_ASK)
+    {
+      char ask[80];
+      snprintf(ask, sizeof(ask), "\nDisplay all %zu possibilities? (y or n)", c.count);
+      write_all(STDOUT_FILENO, ask, strlen(ask));
+      int key = editor_key();
+      show = key == 'y' || key == 'Y' || key == ' ';
+      if (!show)
+        write_all(STDOUT_FILENO, "\n", 1);
+    }
+    if (show)
+      completion_show(&c);
+  }
+  else
+    write_all(STDOUT_FILENO, "\a", 1);
+
+  free(c.names.data);
+  free(c.at);
+  free(c.type);
+  free(dir.data);
+  free(word.data);
+}
+
+/*
+* @brief  I/O counters of the whole process from /proc/self/io: bytes
+*         through read/write-like calls and how many such calls were made.
+*         The kernel doesn't count other syscalls anywhere it is cheap to
+*         read, so only these are counted, as rw_syscalls. Reaped children are
+*         included, threads too
+*/
+struct io_counts {
+  uint64_t rchar, wchar, syscr, syscw;
+  uint64_t self; //bytes the snapshot itself read
+};
+
+/*
+*@brief  reads the counters. The file is kept open and read again from
+*        the start each time, one syscall. That read counts itself, which
+*        io_delta takes back out
+*@return 0 on success, -1 if /proc isn't there
+*/
+static int io_snapshot(struct io_counts* io)
+{
+  static int fd = -2;
+  char buf[512];
+
+  if (fd == -2)
+    fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  ssize_t n = fd >= 0 ? pread(fd, buf, sizeof(buf) - 1, 0) : -1;
+  memset(io, 0, sizeof(*io));
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  io->self = (uint64_t)n;
+
+  const struct { const char* key; uint64_t* value; } fields[] = {
+    { "rchar:", &io->rchar }, { "wchar:", &io->wchar },
+    { "syscr:", &io->syscr }, { "syscw:", &io->syscw },
+  };
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+  {
+    const char* at = strstr(buf, fields[i].key);
+    if (at)
+      *fields[i].value = strtoull(at + strlen(fields[i].key), NULL, 10);
+  }
+  return 0;
+}
+
+/*
+*@brief  after - before, minus the read of /proc/self/io in between
+*/
+static void io_delta(struct io_counts* d, const struct io_counts* before,
+                     const struct io_counts* after)
+{
+  d->syscr = after->syscr - before->syscr;
+  d->syscw = after->syscw - before->syscw;
+  d->rchar = after->rchar - before->rchar;
+  d->wchar = after->wchar - before->wchar;
+  if (d->syscr > 0)
+    d->syscr--;
+  if (d->rchar >= after->self)
+    d->rchar -= after->self;
+}
+
+enum stats_mode { STATS_IO_OFF, STATS_IO_ON };
+
+/*
+* @brief  what execute_command has measured for one builtin (or for all
+*         programs, pipelines or job starts together). Latencies go into a
+*         log-linear histogram: four buckets per power of two, so any
+*         percentile read from it is within 25%
+*/
+struct cmd_stats {
+  unsigned long calls;
+  uint64_t total_ns, max_ns;
+  uint64_t rw_syscalls, rchar, wchar;
+  uint32_t hist[STATS_BUCKETS];
+};
+
+enum { STATS_PROGRAM = NUM_COMMANDS, STATS_PIPELINE, STATS_JOB, STATS_SLOTS };
+static const char* const stats_extra_names[] = { "(program)", "(pipeline)", "(job)" };
+
+static struct cmd_stats cmd_stats[STATS_SLOTS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; //for --serve workers
+static const char* stats_json_path = NULL;
+
+/*
+*@brief  the name a stats slot is shown under
+*/
+static const char* stats_name(size_t slot)
+{
+  return slot < NUM_COMMANDS ? commands[slot].name : stats_extra_names[slot - NUM_COMMANDS];
+}
+
+/*
+*@brief  histogram bucket of a latency: the value itself below 4, then 4
+*        buckets per power of two
+*/
+static unsigned int stats_bucket(uint64_t ns)
+{
+  if (ns < 4)
+    return (unsigned int)ns;
+  int e = 63 - __builtin_clzll(ns);
+  return (unsigned int)((e - 1) * 4 + ((ns >> (e - 2)) & 3));
+}
+
+/*
+*@brief  the largest latency that falls into a bucket
+*/
+static uint64_t stats_bucket_max(unsigned int b)
+{
+  if (b < 4)
+    return b;
+  int e = (int)(b / 4) + 1;
+  return ((uint64_t)(4 + b % 4 + 1) << (e - 2)) - 1;
+}
+
+/*
+*@brief  reads a percentile (0..100) off a histogram, as the top of its
+*        bucket but never more than the slowest call seen
+*/
+static uint64_t stats_percentile(const struct cmd_stats* st, unsigned int pct)
+{
+  unsigned long want = (st->calls * pct + 99) / 100, seen = 0;
+  for (unsigned int b = 0; b < STATS_BUCKETS; b++)
+  {
+    seen += st->hist[b];
+    if (seen >= want && seen > 0)
+      return stats_bucket_max(b) < st->max_ns ? stats_bucket_max(b) : st->max_ns;
+  }
+  return 0;
+}
+
+/*
+* @brief  one command being measured
+*/
+struct stats_sample {
+  struct timespec start;
+  struct io_counts io;
+  bool with_io;
+};
+
+/*
+*@brief  starts measuring a command
+*/
+static void stats_begin(struct stats_sample* s)
+{
+  s->with_io = stats_io == STATS_IO_ON && io_snapshot(&s->io) == 0;
+  clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+/*
+*@brief  adds a finished command to its slot. What it left in the output
+*        buffer is written first, so that write counts too
+*/
+static void stats_end(const struct stats_sample* s, size_t slot)
+{
+  out_flush(ctx->out);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ns = (uint64_t)(now.tv_sec - s->start.tv_sec) * 1000000000u +
+                (uint64_t)now.tv_nsec - (uint64_t)s->start.tv_nsec;
+
+  struct io_counts after, d;
+  bool with_io = s->with_io && io_snapshot(&after) == 0;
+  if (with_io)
+    io_delta(&d, &s->io, &after);
+
+  pthread_mutex_lock(&stats_lock);
+  struct cmd_stats* st = &cmd_stats[slot];
+  st->calls++;
+  st->total_ns += ns;
+  if (ns > st->max_ns)
+    st->max_ns = ns;
+  st->hist[stats_bucket(ns)]++;
+  if (with_io)
+  {
+    st->rw_syscalls += d.syscr + d.syscw;
+    st->rchar += d.rchar;
+    st->wchar += d.wchar;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+*@brief  writes the counters as JSON, one object per command that ran
+*/
+static void stats_json(struct strbuf* sb)
+{
+  bool first = true;
+
+  sb_str(sb, "{\"commands\":[");
+  for (size_t i = 0; i < STATS_SLOTS; i++)
+  {
+    const struct cmd_stats* st = &cmd_stats[i];
+    if (st->calls == 0)
+      continue;
+    sb_str(sb, first ? "\n" : ",\n");
+    first = false;
+    sb_str(sb, "  {\"name\":\"");
+    sb_str(sb, stats_name(i));
+    sb_str(sb, "\",\"calls\":");
+    sb_uint(sb, st->calls);
+    sb_str(sb, ",\"total_ns\":");
+    sb_uint(sb, st->total_ns);
+    sb_str(sb, ",\"p50_ns\":");
+    sb_uint(sb, stats_percentile(st, 50));
+    sb_str(sb, ",\"p99_ns\":");
+    sb_uint(sb, stats_percentile(st, 99));
+    sb_str(sb, ",\"rw_syscalls\":");
+    sb_uint(sb, st->rw_syscalls);
+    sb_str(sb, ",\"read_bytes\":");
+    sb_uint(sb, st->rchar);
+    sb_str(sb, ",\"write_bytes\":");
+    sb_uint(sb, st->wchar);
+    sb_str(sb, "}");
+  }
+  sb_str(sb, "\n]}\n");
+}
+
+/*
+*@brief  atexit hook: writes the JSON to the file asked for ("-" for stderr)
+*/
+static void stats_json_report(void)
+{
+  struct strbuf sb = { NULL, 0, 0, false };
+  stats_json(&sb);
+  out_flush(ctx->out);
+
+  int fd = strcmp(stats_json_path, "-") == 0
+           ? STDERR_FILENO
+           : open(stats_json_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || sb.failed || write_all(fd, sb.data, sb.len) < 0)
+    fprintf(err_out(), "myshell: %s: %s\n", stats_json_path, strerror(sb.failed ? ENOMEM : errno));
+  if (fd > STDERR_FILENO)
+    close(fd);
+  free(sb.data);
+}
+
+/**
+ * @brief  Has the per-command counters written out as JSON when the shell
+ *         exits, syscall counts included
+ * @param  File to write to, or "-" for stderr
+ */
+void stats_enable_json(const char* path) {
+  if (!stats_json_path)
+    atexit(stats_json_report);
+  stats_json_path = path;
+  stats_io = STATS_IO_ON;
+}
+
+/**
+ * @brief  Shows what execute_command measured for every command so far:
+ *         calls, total time, median and 99th percentile latency, and with
+ *         "set stats_io on" the read/write syscalls (rw_syscalls, other
+ *         syscalls aren't counted) and bytes
+ * @param  "-r" to start over, "-j" for JSON
+ * @return 0 on success, -1 for an unknown option
+ */
+int do_stats(int argc, char** argv) {
+  if (argc > 0 && strcmp(argv[0], "-r") == 0)
+  {
+    pthread_mutex_lock(&stats_lock);
+    memset(cmd_stats, 0, sizeof(cmd_stats));
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+  }
+  if (argc > 0 && strcmp(argv[0], "-j") == 0)
+  {
+    struct strbuf sb = { NULL, 0, 0, false };
+    pthread_mutex_lock(&stats_lock);
+    stats_json(&sb);
+    pthread_mutex_unlock(&stats_lock);
+    out_write(ctx->out, sb.data, sb.len);
+    free(sb.data);
+    return 0;
+  }
+  if (argc > 0)
+  {
+    fprintf(err_out(), "stats: unknown option: %s\n", argv[0]);
+    return -1;
+  }
+
+  char line[160];
+  snprintf(line, sizeof(line), "%-12s %9s %12s %10s %10s %11s %12s %12s\n", "command", "calls",
+           "total ms", "p50 us", "p99 us", "rw_syscalls", "read", "written");
+  out_str(ctx->out, line);
+
+  //collected first, so the lock isn't held while out waits for a reader
+  struct strbuf sb = { NULL, 0, 0, false };
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < STATS_SLOTS; i++)
+  {
+    const struct cmd_stats* st = &cmd_stats[i];
+    if (st->calls == 0)
+      continue;
+    snprintf(line, sizeof(line), "%-12s %9lu %12.3f %10.1f %10.1f %11" PRIu64 " %12" PRIu64
+             " %12" PRIu64 "\n", stats_name(i), st->calls, (double)st->total_ns / 1e6,
+             (double)stats_percentile(st, 50) / 1e3, (double)stats_percentile(st, 99) / 1e3,
+             st->rw_syscalls, st->rchar, st->wchar);
+    sb_str(&sb, line);
+  }
+  pthread_mutex_unlock(&stats_lock);
+  out_write(ctx->out, sb.data, sb.len);
+  free(sb.data);
+  return 0;
+}
+
+/*
+*@brief  user + system CPU time of the shell and its reaped children, in
+*        seconds
+*/
+static void cpu_times(double* user, double* sys)
+{
+  struct rusage self, kids;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &kids);
+  *user = (double)(self.ru_utime.tv_sec + kids.ru_utime.tv_sec) +
+          (double)(self.ru_utime.tv_usec + kids.ru_utime.tv_usec) / 1e6;
+  *sys = (double)(self.ru_stime.tv_sec + kids.ru_stime.tv_sec) +
+         (double)(self.ru_stime.tv_usec + kids.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+* @brief  what "time" measures around a command line
+*/
+struct time_sample {
+  struct timespec start;
+  double user, sys;
+  struct io_counts io;
+  bool with_io;
+};
+
+/*
+*@brief  starts timing a command line
+*/
+static void time_begin(struct time_sample* t)
+{
+  out_flush(ctx->out); //so earlier output isn't charged to this line
+  t->with_io = io_snapshot(&t->io) == 0;
+  cpu_times(&t->user, &t->sys);
+  clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+/*
+*@brief  prints wall, user and sys time and the I/O of a timed command
+*        line to stderr, like the time keyword of other shells
+*/
+static void time_report(const struct time_sample* t)
+{
+  struct timespec now;
+  double user, sys;
+  struct io_counts after, d;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  cpu_times(&user, &sys);
+  double real = (double)(now.tv_sec - t->start.tv_sec) +
+                (double)(now.tv_nsec - t->start.tv_nsec) / 1e9;
+
+  out_flush(ctx->out);
+  fprintf(err_out(), "\nreal\t%.6fs\nuser\t%.6fs\nsys\t%.6fs\n", real, user - t->user,
+          sys - t->sys);
+  if (t->with_io && io_snapshot(&after) == 0)
+  {
+    io_delta(&d, &t->io, &after);
+    fprintf(err_out(), "read\t%" PRIu64 " bytes in %" PRIu64 " syscalls\n"
+            "written\t%" PRIu64 " bytes in %" PRIu64 " syscalls\n",
+            d.rchar, d.syscr, d.wchar, d.syscw);
+  }
+}
+
+/*
+*@brief  looks a command up in the command table and checks how many words
+*        follow its name. *cmd is left NULL for a program to run from PATH
+*@return 0 if it can run, -1 if not (the error has been reported)
+*/
+static int check_command(int argc, char** argv, const struct command** cmd)
+{
+  commands_run++;
+  *cmd = find_command(argv[0]);
+  if (!*cmd)
+    return 0;
+
+  if (serving && ((*cmd)->flags & CMD_SHARED))
+  {
+    fprintf(err_out(), "myshell: %s: not available under --serve\n", (*cmd)->name);
+    return -1;
+  }
+
+  int nargs = argc - 1;
+  if (nargs < (*cmd)->min_args)
+  {
+    fprintf(err_out(), "myshell: %s: missing operand\n", (*cmd)->name);
+    return -1;
+  }
+  if ((*cmd)->max_args >= 0 && nargs > (*cmd)->max_args)
+  {
+    fprintf(err_out(), "myshell: %s: too many arguments\n", (*cmd)->name);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+* @brief  the < > >> 2> 2>> of one command, and then the files they opened
+*         (-1 where there is none). A builtin is simply handed the fds: it
+*         writes into the file through its outbuf like it would into a pipe,
+*         without dup2 or a process of its own
+*/
+struct redirects {
+  const char* path[3]; //input, output, error
+  bool append[3];
+  int fd[3];
+};
+
+/*
+*@brief  takes the redirections out of a command's words, leaving argv
+*        NULL ended with only the command and its arguments
+*@return 0 on success, -1 on a syntax error (reported)
+*/
+static int redirect_split(int* argc, char** argv, struct redirects* r)
+{
+  int kept = 0;
+
+  memset(r, 0, sizeof(*r));
+  r->fd[0] = r->fd[1] = r->fd[2] = -1;
+  for (int i = 0; i < *argc; i++)
+  {
+    int which = is_op(argv[i], OP_IN) ? 0 :
+                is_op(argv[i], OP_OUT) || is_op(argv[i], OP_APPEND) ? 1 :
+                is_op(argv[i], OP_ERR) || is_op(argv[i], OP_ERR_APPEND) ? 2 : -1;
+    if (which < 0)
+    {
+      argv[kept++] = argv[i];
+      continue;
+    }
+    if (i + 1 == *argc || is_any_op(argv[i + 1]))
+    {
+      fprintf(err_out(), "myshell: syntax error near unexpected token `%s'\n",
+              i + 1 == *argc ? "newline" : argv[i + 1]);
+      return -1;
+    }
+    r->path[which] = argv[++i];
+    r->append[which] = is_op(argv[i - 1], OP_APPEND) || is_op(argv[i - 1], OP_ERR_APPEND);
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+  return 0;
+}
+
+/*
+*@brief  opens a file to write a command's output to. With direct_output
+*        on, a file that is being replaced is opened O_DIRECT where the
+*        file system allows it, so big outputs skip the page cache
+*@return the fd, or -1 on error
+*/
+static int redirect_open_output(const char* path, bool append, bool direct)
+{
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  struct stat st;
+  int fd = -1;
+
+  if (direct && !append)
+  {
+    fd = open(path, flags | O_DIRECT, 0666);
+    //only regular files keep it; the rest (and file systems without it)
+    //are written the usual way
+    if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)))
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    if (fd >= 0 || errno != EINVAL)
+      return fd;
+  }
+  return open(path, flags, 0666);
+}
+
+/*
+*@brief  opens the files of a command's redirections. Only a builtin's
+*        output can be direct: it goes through an outbuf that knows what
+*        O_DIRECT asks for, a program's stdio doesn't
+*@return 0 on success, -1 on error (reported, and nothing is left open)
+*/
+static int redirect_open(struct redirects* r, bool builtin)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    if (!r->path[i])
+      continue;
+    r->fd[i] = i == 0 ? open(r->path[i], O_RDONLY | O_CLOEXEC)
+                      : redirect_open_output(r->path[i], r->append[i],
+                                             i == 1 && builtin && direct_output == 1);
+    if (r->fd[i] < 0)
+    {
+      fprintf(err_out(), "myshell: %s: %s\n", r->path[i], strerror(errno));
+      while (i-- > 0)
+        if (r->fd[i] >= 0)
+          close(r->fd[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+*@brief  closes the files of a command's redirections that are still open
+*/
+static void redirect_close(struct redirects* r)
+{
+  for (int i = 0; i < 3; i++)
+    if (r->fd[i] >= 0)
+      close(r->fd[i]);
+}
+
+/*
+*@brief  has the error messages of a command's context go to fd, its 2>
+*        file. The stream takes the fd over; closing it closes both
+*@return true if it does, false if they still go where they did
+*/
+static bool exec_err_open(struct exec_ctx* c, int fd)
+{
+  FILE* f = fdopen(fd, "w");
+  if (!f)
+    return false;
+  c->err_stream = f;
+  c->err_fd = fd;
+  return true;
+}
+
+/*
+*@brief  runs one tokenized command through the command table
+*@return the command's status, or -1 for an invalid command
+*/
+static int run_command(int argc, char** argv)
+{
+  const struct command* cmd;
+  struct redirects r;
+
+  // Nothing to do for an empty line, a syntax error was already reported
+  if (argc <= 0)
+    return argc;
+
+  if (redirect_split(&argc, argv, &r) < 0)
+    return -1;
+  // Only redirections: the files are created (or checked), nothing runs
+  if (argc == 0)
+  {
+    if (redirect_open(&r, false) < 0)
+      return -1;
+    redirect_close(&r);
+    return 0;
+  }
+
+  if (check_command(argc, argv, &cmd) < 0 || redirect_open(&r, cmd != NULL) < 0)
+    return -1;
+  // Not a builtin, so run it as a program, the files as its fds
+  if (!cmd)
+  {
+    int status = spawn_external(argv, r.fd[0] >= 0 ? r.fd[0] : ctx->in_fd,
+                                r.fd[1] >= 0 ? r.fd[1] : ctx->out->fd,
+                                r.fd[2] >= 0 ? r.fd[2] : ctx->err_fd);
+    redirect_close(&r);
+    return status;
+  }
+  if (r.fd[0] < 0 && r.fd[1] < 0 && r.fd[2] < 0)
+    return cmd->handler(argc - 1, argv + 1);
+
+  //a builtin runs in a context of its own with the files in place of the
+  //shell's, writing into its file through an outbuf of its own
+  struct exec_ctx* shell = ctx;
+  struct exec_ctx redirected = *shell;
+  struct outbuf* o = NULL;
+  if (r.fd[1] >= 0 && !(o = out_alloc()))
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(ENOMEM));
+    redirect_close(&r);
+    return -1;
+  }
+  out_flush(shell->out);
+  if (o)
+  {
+    out_init(o, r.fd[1]);
+    redirected.out = o;
+  }
+  if (r.fd[0] >= 0)
+    redirected.in_fd = r.fd[0];
+  bool own_err = r.fd[2] >= 0 && exec_err_open(&redirected, r.fd[2]);
+  if (own_err)
+    r.fd[2] = -1;
+
+  ctx = &redirected;
+  int status = cmd->handler(argc - 1, argv + 1);
+  if (o && out_flush(o) < 0)
+  {
+    fprintf(err_out(), "myshell: %s: %s\n", r.path[1], strerror(errno));
+    status = -1;
+  }
+  ctx = shell;
+  if (own_err)
+    fclose(redirected.err_stream);
+  redirect_close(&r);
+  free(o);
+  return status;
+}
+
+struct job;
+
+/*
+* @brief  one command of a pipeline. A builtin runs on a thread of its own
+*         writing into the pipe through its own outbuf, a program is
+*         spawned with the pipe ends as its stdin and stdout. in and out
+*         (pipe ends, or the files of its redirections) belong to the stage,
+*         and are closed as soon as it is done with them so the neighbours
+*         see end of file or a broken pipe
+*/
+struct pipe_stage {
+  int argc;
+  char** argv;
+  const struct command* cmd; //NULL for a program
+  int in, out, err;
+  bool own_in, own_out, own_err; //not the shell's own fds
+  FILE* err_stream;          //a builtin's messages, unless it has a 2> of its own
+  struct outbuf* sink;
+  pthread_t thread;
+  bool started;
+  pid_t pid;
+  int pidfd;                 //watched by the job loop, -1 if there is none
+  struct job* job;           //NULL when the shell waits for it right away
+  atomic_bool finished;      //set by a background thread when it is done
+  bool reaped;
+  int status;
+};
+
+/*
+* @brief  a pipeline running in the background (started with &, or by
+*         parallel). It owns the words of its command line, so the shell
+*         can go on to the next command while it runs
+*/
+struct job {
+  struct job* next;
+  int id;                    //0 for the hidden jobs of parallel
+  struct arena words;
+  char* text;                //the command line, for jobs to show
+  struct pipe_stage* stages;
+  int nstages, running;
+  int status;                //of the last stage, once it is done
+  bool done;
+};
+
+/*
+* @brief  the background jobs and the epoll loop that notices when they
+*         finish: every child has a pidfd that becomes readable when it
+*         exits, and builtin threads bump one shared eventfd. Finished jobs
+*         are put on a free list so a stream of short jobs (parallel) runs
+*         without allocating
+*/
+static struct {
+  struct job* list;
+  struct job* spare;
+  int epfd;                  //-1 until the first job
+  int eventfd;
+  bool no_pidfd;             //pidfd_open isn't there, poll children instead
+} jobs = { NULL, NULL, -1, -1, false };
+
+/*
+*@brief  closes the pipe ends a stage was given
+*/
+static void stage_close(struct pipe_stage* st)
+{
+  if (st->own_in)
+    close(st->in);
+  if (st->own_out)
+    close(st->out);
+  if (st->own_err)
+    close(st->err);
+  st->own_in = st->own_out = st->own_err = false;
+}
+
+/*
+*@brief  thread body for a builtin stage
+*/
+static void* stage_main(void* arg)
+{
+  struct pipe_stage* st = arg;
+
+  struct exec_ctx own = { st->sink, st->in, st->err_stream, st->err, NULL };
+  bool own_err = st->own_err && exec_err_open(&own, st->err);
+  if (own_err)
+    st->own_err = false;
+  ctx = &own;
+  st->status = st->cmd->handler(st->argc - 1, st->argv + 1);
+  out_flush(own.out);
+  if (own_err)
+  {
+    fclose(own.err_stream);
+    own.err_stream = st->err_stream;
+  }
+  stage_close(st);
+
+  //a job is reaped by the shell's event loop, wake it up
+  if (st->job)
+  {
+    uint64_t one = 1;
+    atomic_store(&st->finished, true);
+    if (write(jobs.eventfd, &one, sizeof(one)) < 0)
+      fprintf(err_out(), "myshell: eventfd: %s\n", strerror(errno));
+  }
+  return NULL;
+}
+
+/*
+*@brief  gets a stage going, on a thread or as a child process. A NULL
+*        last_sink gives every stage an outbuf of its own
+*@return 0 on success, -1 if it couldn't be started
+*/
+static int stage_start(struct pipe_stage* st, struct outbuf* last_sink)
+{
+  if (!st->cmd)
+  {
+    st->pid = spawn_program(st->argv, st->in, st->out, st->err);
+    stage_close(st);
+    return st->pid < 0 ? -1 : 0;
+  }
+
+  //the last stage writes where the shell does; the shell is only waiting
+  st->sink = last_sink;
+  if (st->own_out || !last_sink)
+  {
+    st->sink = out_alloc();
+    if (!st->sink)
+    {
+      fprintf(err_out(), "myshell: %s\n", strerror(errno));
+      stage_close(st);
+      return -1;
+    }
+    out_init(st->sink, st->out);
+  }
+
+  int err = pthread_create(&st->thread, NULL, stage_main, st);
+  if (err != 0)
+  {
+    fprintf(err_out(), "myshell: %s: %s\n", st->argv[0], strerror(err));
+    if (st->sink != last_sink)
+      free(st->sink);
+    st->sink = NULL;
+    stage_close(st);
+    return -1;
+  }
+  st->started = true;
+  return 0;
+}
+
+/*
+*@brief  counts the stages of a command line, checking every | has a
+*        command on both sides
+*@return number of stages, or -1 on a syntax error (reported)
+*/
+static int count_stages(int argc, char** argv)
+{
+  int nstages = 1;
+  bool empty = true;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (!is_op(argv[i], OP_PIPE))
+      empty = false;
+    else if (empty)
+      break;
+    else
+    {
+      nstages++;
+      empty = true;
+    }
+  }
+  if (empty)
+  {
+    fprintf(err_out(), "myshell: syntax error near unexpected token `|'\n");
+    return -1;
+  }
+  return nstages;
+}
+
+/*
+*@brief  cuts a command line into stages, checks every command and
+*        connects them with pipes. Builtins that change the shell (cd,
+*        exit, ...) can't be stages or jobs, as they would only change a
+*        thread
+*@return the stages, or NULL if the pipeline can't run (reported)
+*/
+static struct pipe_stage* pipeline_setup(struct arena* a, int argc, char** argv,
+                                         int nstages, int in, int out_fd)
+{
+  struct pipe_stage* stages = arena_alloc(a, nstages * sizeof(*stages));
+  if (!stages)
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(ENOMEM));
+    return NULL;
+  }
+
+  //cut the words up at the operators, each stage gets a NULL ended argv
+  int n = 0, start = 0;
+  for (int i = 0; i <= argc; i++)
+  {
+    if (i < argc && !is_op(argv[i], OP_PIPE))
+      continue;
+    memset(&stages[n], 0, sizeof(stages[n]));
+    stages[n].argc = i - start;
+    stages[n].argv = argv + start;
+    stages[n].err = ctx->err_fd;
+    stages[n].err_stream = ctx->err_stream;
+    stages[n].pid = -1;
+    stages[n].pidfd = -1;
+    if (i < argc)
+      argv[i] = NULL;
+    n++;
+    start = i + 1;
+  }
+
+  stages[0].in = in;
+  stages[n - 1].out = out_fd;
+  for (int i = 0; i < n; i++)
+  {
+    struct pipe_stage* st = &stages[i];
+    struct redirects r;
+    bool ok = redirect_split(&st->argc, st->argv, &r) == 0;
+    if (ok && st->argc == 0)
+    {
+      fprintf(err_out(), "myshell: syntax error near unexpected token `|'\n");
+      ok = false;
+    }
+    if (ok && check_command(st->argc, st->argv, &st->cmd) < 0)
+      ok = false;
+    if (ok && st->cmd && (st->cmd->flags & CMD_SHELL))
+    {
+      fprintf(err_out(), "myshell: %s: can't be used in a pipeline or job\n",
+              st->cmd->name);
+      ok = false;
+    }
+    if (!ok || redirect_open(&r, st->cmd != NULL) < 0)
+    {
+      for (int j = 0; j < i; j++)
+        stage_close(&stages[j]);
+      return NULL;
+    }
+
+    //a redirection takes the place of the pipe on that side
+    int* fds[3] = { &st->in, &st->out, &st->err };
+    bool* own[3] = { &st->own_in, &st->own_out, &st->own_err };
+    for (int k = 0; k < 3; k++)
+    {
+      if (r.fd[k] >= 0)
+      {
+        *fds[k] = r.fd[k];
+        *own[k] = true;
+      }
+    }
+  }
+
+  for (int i = 0; i + 1 < n; i++)
+  {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+      fprintf(err_out(), "myshell: pipe: %s\n", strerror(errno));
+      for (int j = 0; j < n; j++)
+        stage_close(&stages[j]);
+      return NULL;
+    }
+    //sized from the write end, the capacity belongs to the pipe itself
+    if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size) < 0)
+      fprintf(err_out(), "myshell: pipe_size %lld: %s\n", pipe_size, strerror(errno));
+    if (stages[i].own_out)
+      close(fds[1]);
+    else
+    {
+      stages[i].out = fds[1];
+      stages[i].own_out = true;
+    }
+    if (stages[i + 1].own_in)
+      close(fds[0]);
+    else
+    {
+      stages[i + 1].in = fds[0];
+      stages[i + 1].own_in = true;
+    }
+  }
+  return stages;
+}
+
+/*
+*@brief  frees a finished stage's outbuf unless it was borrowed
+*/
+static void stage_free_sink(struct pipe_stage* st, struct outbuf* last_sink)
+{
+  if (st->sink != last_sink)
+    free(st->sink);
+  st->sink = NULL;
+}
+
+/*
+*@brief  runs cmd1 | cmd2 | ... with every stage going at once, and waits
+*        for all of them. Builtins don't fork; their output goes into the
+*        pipe from a thread, and cat splices file data into it
+*@return the status of the last stage, or -1 if the pipeline couldn't run
+*/
+static int run_pipeline(int argc, char** argv, int nstages)
+{
+  struct pipe_stage* stages = pipeline_setup(ctx->arena, argc, argv, nstages,
+                                             ctx->in_fd, ctx->out->fd);
+  if (!stages)
+    return -1;
+
+  //whatever the shell printed before has to come out first
+  out_flush(ctx->out);
+
+  int status = 0;
+  for (int i = 0; i < nstages; i++)
+    if (stage_start(&stages[i], ctx->out) < 0)
+      status = -1;
+
+  for (int i = 0; i < nstages; i++)
+  {
+    struct pipe_stage* st = &stages[i];
+    if (st->started)
+    {
+      pthread_join(st->thread, NULL);
+      stage_free_sink(st, ctx->out);
+    }
+    else if (st->pid > 0)
+      st->status = wait_program(st->pid, st->argv[0]);
+    else
+      st->status = -1;
+  }
+  return status < 0 ? -1 : stages[nstages - 1].status;
+}
+
+/*
+*@brief  creates the epoll instance and the eventfd threads report to
+*@return 0 on success, -1 on error (reported)
+*/
+static int jobs_init(void)
+{
+  if (jobs.epfd >= 0)
+    return 0;
+
+  jobs.epfd = epoll_create1(EPOLL_CLOEXEC);
+  jobs.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (jobs.epfd < 0 || jobs.eventfd < 0 ||
+      epoll_ctl(jobs.epfd, EPOLL_CTL_ADD, jobs.eventfd, &ev) < 0)
+  {
+    fprintf(err_out(), "myshell: jobs: %s\n", strerror(errno));
+    if (jobs.epfd >= 0)
+      close(jobs.epfd);
+    if (jobs.eventfd >= 0)
+      close(jobs.eventfd);
+    jobs.epfd = jobs.eventfd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+*@brief  has the event loop watch a child: its pidfd becomes readable when
+*        it exits. Without pidfds the loop checks on it with WNOHANG
+*/
+static void job_watch(struct pipe_stage* st)
+{
+#ifdef SYS_pidfd_open
+  if (!jobs.no_pidfd)
+  {
+    st->pidfd = (int)syscall(SYS_pidfd_open, st->pid, 0);
+    if (st->pidfd >= 0)
+    {
+      fcntl(st->pidfd, F_SETFD, FD_CLOEXEC);
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = st };
+      if (epoll_ctl(jobs.epfd, EPOLL_CTL_ADD, st->pidfd, &ev) == 0)
+        return;
+      close(st->pidfd);
+      st->pidfd = -1;
+    }
+    else if (errno == ENOSYS)
+      jobs.no_pidfd = true;
+  }
+#endif
+  jobs.no_pidfd = true;
+}
+
+/*
+*@brief  records that one stage of a job is done
+*/
+static void job_stage_done(struct pipe_stage* st, int status)
+{
+  struct job* j = st->job;
+
+  st->reaped = true;
+  st->status = status;
+  if (st->pidfd >= 0)
+    close(st->pidfd); //closing it takes it out of the epoll set too
+  st->pidfd = -1;
+  stage_free_sink(st, NULL);
+  if (--j->running == 0)
+  {
+    j->done = true;
+    j->status = j->stages[j->nstages - 1].status;
+  }
+}
+
+/*
+*@brief  reaps children without pidfds and threads that said they are done
+*/
+static void jobs_sweep(void)
+{
+  for (struct job* j = jobs.list; j; j = j->next)
+  {
+    for (int i = 0; !j->done && i < j->nstages; i++)
+    {
+      struct pipe_stage* st = &j->stages[i];
+      if (st->reaped)
+        continue;
+      if (st->started && atomic_load(&st->finished))
+      {
+        pthread_join(st->thread, NULL);
+        job_stage_done(st, st->status);
+      }
+      else if (st->pid > 0 && st->pidfd < 0)
+      {
+        int wstatus;
+        if (waitpid(st->pid, &wstatus, WNOHANG) == st->pid)
+          job_stage_done(st, WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus)
+                                                  : WEXITSTATUS(wstatus));
+      }
+    }
+  }
+}
+
+/*
+*@brief  waits up to timeout ms (-1 for as long as it takes, 0 to just
+*        look) for background stages to finish, and reaps them
+*/
+static void jobs_poll(int timeout)
+{
+  struct epoll_event events[64];
+
+  if (jobs.epfd < 0)
+    return;
+  //children without a pidfd have to be looked at every now and then
+  if (jobs.no_pidfd && (timeout < 0 || timeout > 10))
+    timeout = 10;
+
+  int n = epoll_wait(jobs.epfd, events, 64, timeout);
+  bool sweep = jobs.no_pidfd;
+  for (int i = 0; i < n; i++)
+  {
+    struct pipe_stage* st = events[i].data.ptr;
+    if (!st)
+    {
+      uint64_t count;
+      if (read(jobs.eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(err_out(), "myshell: eventfd: %s\n", strerror(errno));
+      sweep = true;
+      continue;
+    }
+
+    int wstatus;
+    if (waitpid(st->pid, &wstatus, 0) == st->pid)
+      job_stage_done(st, WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus)
+                                              : WEXITSTATUS(wstatus));
+    else
+      job_stage_done(st, -1);
+  }
+  if (sweep)
+    jobs_sweep();
+}
+
+/*
+*@brief  takes a finished job off the list and keeps it for reuse
+*/
+static void job_free(struct job* j)
+{
+  for (struct job** link = &jobs.list; *link; link = &(*link)->next)
+  {
+    if (*link == j)
+    {
+      *link = j->next;
+      break;
+    }
+  }
+  arena_reset(&j->words);
+  j->next = jobs.spare;
+  jobs.spare = j;
+}
+
+/*
+*@brief  starts argv (which must live in the job's own arena) in the
+*        background. Its input is /dev/null, as there is no job control
+*        to hand it the terminal
+*@return 0 on success, -1 if it couldn't be started (j is freed then)
+*/
+static int job_launch(struct job* j, int argc, char** argv)
+{
+  int nstages = count_stages(argc, argv);
+  int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (nstages < 0 || devnull < 0)
+  {
+    if (devnull < 0)
+      fprintf(err_out(), "myshell: /dev/null: %s\n", strerror(errno));
+    else
+      close(devnull);
+    job_free(j);
+    return -1;
+  }
+
+  j->stages = pipeline_setup(&j->words, argc, argv, nstages, devnull, out_stdout.fd);
+  if (!j->stages)
+  {
+    close(devnull);
+    job_free(j);
+    return -1;
+  }
+  //unless the first command reads a file of its own
+  if (j->stages[0].own_in)
+    close(devnull);
+  else
+    j->stages[0].own_in = true;
+  j->nstages = nstages;
+  j->running = 0;
+  j->done = false;
+
+  out_flush(ctx->out);
+  for (int i = 0; i < nstages; i++)
+  {
+    struct pipe_stage* st = &j->stages[i];
+    st->job = j;
+    atomic_init(&st->finished, false);
+    if (stage_start(st, NULL) < 0)
+    {
+      st->reaped = true;
+      st->status = -1;
+      continue;
+    }
+    j->running++;
+    if (!st->cmd)
+      job_watch(st);
+  }
+  if (j->running == 0)
+  {
+    j->done = true;
+    j->status = -1;
+  }
+  return 0;
+}
+
+/*
+*@brief  gets a job off the free list, or a new one
+*@return the job, or NULL if out of memory (reported)
+*/
+static struct job* job_new(int id)
+{
+  if (jobs_init() < 0)
+    return NULL;
+
+  struct job* j = jobs.spare;
+  if (j)
+    jobs.spare = j->next;
+  else if (!(j = calloc(1, sizeof(*j))))
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(errno));
+    return NULL;
+  }
+  j->id = id;
+  j->text = "";
+  j->next = jobs.list;
+  jobs.list = j;
+  return j;
+}
+
+/*
+*@brief  copies a command line's words into a job, and joins them with
+*        spaces for jobs to show
+*@return the copied argv, or NULL if out of memory (reported)
+*/
+static char** job_words(struct job* j, int argc, char** argv)
+{
+  size_t len = 0;
+  for (int i = 0; i < argc; i++)
+    len += strlen(argv[i]) + 1;
+
+  char** copy = arena_alloc(&j->words, (argc + 1) * sizeof(char*));
+  char* text = arena_alloc(&j->words, len + 1);
+  char* joined = arena_alloc(&j->words, len + 1);
+  if (!copy || !text || !joined)
+  {
+    fprintf(err_out(), "myshell: %s\n", strerror(ENOMEM));
+    return NULL;
+  }
+
+  j->text = joined;
+  for (int i = 0; i < argc; i++)
+  {
+    size_t n = strlen(argv[i]);
+    memcpy(joined, argv[i], n);
+    joined[n] = i + 1 < argc ? ' ' : '\0';
+    joined += n + 1;
+    //operators have to stay the very same pointers
+    if (is_any_op(argv[i]))
+      copy[i] = argv[i];
+    else
+    {
+      copy[i] = memcpy(text, argv[i], n + 1);
+      text += n + 1;
+    }
+  }
+  copy[argc] = NULL;
+  return copy;
+}
+
+/*
+*@brief  runs a command line in the background as a numbered job
+*@return 0 if it was started, -1 if not
+*/
+static int run_background(int argc, char** argv)
+{
+  if (serving)
+  {
+    fprintf(err_out(), "myshell: background jobs are not available under --serve\n");
+    return -1;
+  }
+
+  int id = 1;
+  for (struct job* j = jobs.list; j; j = j->next)
+    if (j->id >= id)
+      id = j->id + 1;
+
+  struct job* j = job_new(id);
+  if (!j)
+    return -1;
+  char** words = job_words(j, argc, argv);
+  if (!words)
+  {
+    job_free(j);
+    return -1;
+  }
+  if (job_launch(j, argc, words) < 0)
+    return -1;
+
+  if (shell_interactive)
+  {
+    char line[64];
+    pid_t pid = j->stages[j->nstages - 1].pid;
+    snprintf(line, sizeof(line), "[%d] %ld\n", j->id, (long)(pid > 0 ? pid : 0));
+    out_str(ctx->out, line);
+  }
+  return 0;
+}
+
+/*
+*@brief  prints a job's state the way jobs lists it
+*/
+static void job_print(const struct job* j)
+{
+  char head[64];
+
+  if (!j->done)
+    snprintf(head, sizeof(head), "[%d]  Running\t\t", j->id);
+  else if (j->status == 0)
+    snprintf(head, sizeof(head), "[%d]  Done\t\t", j->id);
+  else
+    snprintf(head, sizeof(head), "[%d]  Exit %d\t\t", j->id, j->status);
+  out_str(ctx->out, head);
+  out_str(ctx->out, j->text);
+  out_write(ctx->out, "\n", 1);
+}
+
+/**
+ * @brief  Reports background jobs that have finished since the last time,
+ *         and forgets them. Called before each interactive prompt
+ */
+void jobs_notify(void) {
+  jobs_poll(0);
+  for (struct job* j = jobs.list, *next; j; j = next)
+  {
+    next = j->next;
+    if (j->done && j->id > 0)
+    {
+      job_print(j);
+      job_free(j);
+    }
+  }
+}
+
+/*
+*@brief  finds the job a %n, %% or %+ (latest) or pid argument names
+*@return the job, or NULL if there is none (reported)
+*/
+static struct job* job_find(const char* cmd, const char* spec)
+{
+  struct job* latest = NULL;
+  char* end;
+
+  for (struct job* j = jobs.list; j; j = j->next)
+    if (j->id > 0 && (!latest || j->id > latest->id))
+      latest = j;
+
+  if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+  {
+    if (!latest)
+      fprintf(err_out(), "%s: no current job\n", cmd);
+    return latest;
+  }
+
+  bool by_id = spec[0] == '%';
+  long n = strtol(spec + by_id, &end, 10);
+  if (*end == '\0' && end != spec + by_id)
+  {
+    for (struct job* j = jobs.list; j; j = j->next)
+    {
+      if (j->id <= 0)
+        continue;
+      if (by_id ? j->id == n : j->stages[j->nstages - 1].pid == n)
+        return j;
+    }
+  }
+  fprintf(err_out(), "%s: %s: no such job\n", cmd, spec);
+  return NULL;
+}
+
+/*
+*@brief  waits for a job to finish, then forgets it
+*@return the job's status
+*/
+static int job_wait(struct job* j)
+{
+  while (!j->done)
+    jobs_poll(-1);
+  int status = j->status;
+  job_free(j);
+  return status;
+}
+
+/**
+ * @brief  Lists the background jobs. Finished ones are shown one last time
+ * @param  Not used
+ * @return 0
+ */
+int do_jobs(int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+
+  jobs_poll(0);
+  //the list is newest first, show them by number
+  int max = 0;
+  for (struct job* j = jobs.list; j; j = j->next)
+    if (j->id > max)
+      max = j->id;
+  for (int id = 1; id <= max; id++)
+  {
+    for (struct job* j = jobs.list; j; j = j->next)
+    {
+      if (j->id != id)
+        continue;
+      job_print(j);
+      if (j->done)
+        job_free(j);
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief  Waits for background jobs
+ * @param  Jobs to wait for (%n or a pid); all of them if none are given
+ * @return Status of the last job named, 0 when waiting for all, -1 if a
+ *         job doesn't exist
+ */
+int do_wait(int argc, char** argv) {
+  if (argc == 0)
+  {
+    out_flush(ctx->out);
+    bool any = true;
+    while (any)
+    {
+      any = false;
+      for (struct job* j = jobs.list; j; j = j->next)
+      {
+        if (j->id > 0)
+        {
+          job_wait(j);
+          any = true;
+          break;
+        }
+      }
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = 0; i < argc; i++)
+  {
+    struct job* j = job_find("wait", argv[i]);
+    status = j ? job_wait(j) : -1;
+  }
+  return status;
+}
+
+/**
+ * @brief  Brings a job to the foreground. There is no job control (process
+ *         groups, the terminal), so this shows the job and waits for it
+ * @param  The job (%n or a pid), the latest one if not given
+ * @return The job's status, or -1 if there is no such job
+ */
+int do_fg(int argc, char** argv) {
+  struct job* j = job_find("fg", argc > 0 ? argv[0] : NULL);
+  if (!j)
+    return -1;
+  out_str(ctx->out, j->text);
+  out_write(ctx->out, "\n", 1);
+  out_flush(ctx->out);
+  return job_wait(j);
+}
+
+/**
+ * @brief  Runs a list of commands with at most N of them at a time
+ * @param  -j N for the limit (one per CPU by default), -a file to read the
+ *         commands from, one per line, and/or the commands themselves,
+ *         each quoted as one word
+ * @return 0 if every command succeeded, -1 otherwise
+ */
+int do_parallel(int argc, char** argv) {
+  long limit = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* file = NULL;
+  int first = 0;
+
+  while (first < argc && argv[first][0] == '-')
+  {
+    char* end;
+    if (strcmp(argv[first], "-j") == 0 && first + 1 < argc)
+    {
+      limit = strtol(argv[first + 1], &end, 10);
+      if (*end != '\0' || limit < 1)
+      {
+        fprintf(err_out(), "parallel: invalid job count: %s\n", argv[first + 1]);
+        return -1;
+      }
+      first += 2;
+    }
+    else if (strcmp(argv[first], "-a") == 0 && first + 1 < argc)
+    {
+      file = argv[first + 1];
+      first += 2;
+    }
+    else
+    {
+      fprintf(err_out(), "parallel: usage: parallel [-j N] [-a file] [command ...]\n");
+      return -1;
+    }
+  }
+  if (limit < 1)
+    limit = 1;
+
+  struct line_reader input = { -1, NULL, 0, 0, 0, false };
+  if (file && (input.fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    fprintf(err_out(), "parallel: %s: %s\n", file, strerror(errno));
+    return -1;
+  }
+
+  int status = 0;
+  long inflight = 0;
+  bool more = true;
+  out_flush(ctx->out);
+  while (more || inflight > 0)
+  {
+    //start commands until the limit, then wait for one to finish
+    while (more && inflight < limit)
+    {
+      const char* line;
+      ssize_t len;
+      if (first < argc)
+      {
+        line = argv[first++];
+        len = (ssize_t)strlen(line);
+      }
+      else if (input.fd >= 0 && (len = reader_next(&input, &line)) > 0)
+        ;
+      else
+      {
+        if (input.fd >= 0 && len < 0)
+        {
+          fprintf(err_out(), "parallel: %s: %s\n", file, strerror(errno));
+          status = -1;
+        }
+        more = false;
+        break;
+      }
+
+      //words go into the job's arena straight away
+      struct job* j = job_new(0);
+      if (!j)
+      {
+        status = -1;
+        more = false;
+        break;
+      }
+      char** words;
+      bool* globbed;
+      int nwords = tokenize(&j->words, line, (size_t)len, &words, &globbed);
+      if (nwords > 0 && glob_expand(&j->words, &nwords, &words, globbed) < 0)
+        nwords = -1;
+      if (nwords <= 0)
+      {
+        job_free(j);
+        if (nwords < 0)
+          status = -1;
+        continue;
+      }
+      if (job_launch(j, nwords, words) < 0)
+      {
+        status = -1;
+        continue;
+      }
+      inflight++;
+    }
+
+    //collect what finished (jobs of ours have no number), and wait for
+    //more only when there is nothing else to do
+    long finished = 0;
+    for (struct job* j = jobs.list, *next; j; j = next)
+    {
+      next = j->next;
+      if (j->id == 0 && j->done)
+      {
+        if (j->status != 0)
+          status = -1;
+        job_free(j);
+        finished++;
+      }
+    }
+    inflight -= finished;
+    if (finished == 0 && inflight > 0 && (!more || inflight >= limit))
+      jobs_poll(-1);
+  }
+
+  if (input.fd >= 0)
+    close(input.fd);
+  free(input.buf);
+  return status;
+}
+
+/**
+ * @brief  Executes a shell command. Checks for invalid commands.
+ * @param  The command line to execute and its length
+ * @return Return value of command being executed, or -1 for invalid command
+ */
+int execute_command(const char* line, size_t len)  {
+  char** argv;
+  bool* globbed;
+  int argc = tokenize(ctx->arena, line, len, &argv, &globbed);
+  int status = argc < 0 || (argc > 0 && glob_expand(ctx->arena, &argc, &argv, globbed) < 0)
+               ? -1 : 0;
+  struct stats_sample sample;
+
+  //everything before a & goes to the background, the rest runs here
+  int start = 0;
+  for (int i = 0; i < argc && status == 0; i++)
+  {
+    if (!is_op(argv[i], OP_BACKGROUND))
+      continue;
+    if (i == start)
+    {
+      fprintf(err_out(), "myshell: syntax error near unexpected token `&'\n");
+      status = -1;
+      break;
+    }
+    argv[i] = NULL;
+    stats_begin(&sample);
+    status = run_background(i - start, argv + start);
+    stats_end(&sample, STATS_JOB);
+    start = i + 1;
+  }
+
+  //"time" in front of the command line measures all of it, pipes included
+  struct time_sample timed;
+  bool timing = status == 0 && start < argc && strcmp(argv[start], "time") == 0;
+  if (timing)
+  {
+    start++;
+    time_begin(&timed);
+  }
+
+  if (status == 0 && start < argc)
+  {
+    int nstages = count_stages(argc - start, argv + start);
+    const struct command* cmd = nstages == 1 ? find_command(argv[start]) : NULL;
+    size_t slot = nstages > 1 ? STATS_PIPELINE : cmd ? (size_t)(cmd - commands) : STATS_PROGRAM;
+
+    stats_begin(&sample);
+    if (nstages < 0)
+      status = -1;
+    else if (nstages > 1)
+      status = run_pipeline(argc - start, argv + start, nstages);
+    else
+      status = run_command(argc - start, argv + start);
+    if (nstages > 0)
+      stats_end(&sample, slot);
+  }
+  if (timing)
+    time_report(&timed);
+
+  // The words only live as long as the command
+  arena_reset(ctx->arena);
+  return status;
+}
+
+/*
+* @brief  one client of --serve. Its requests are run one at a time by a
+*         worker; while one runs, what it prints comes back through the two
+*         pipes and is framed into outq for the socket. Between requests the
+*         connection's current directory is kept as dirfd and its logical
+*         path, and a worker moves into it before each command
+*/
+struct serve_conn;
+
+struct serve_watch {
+  int kind; //SERVE_*
+  struct serve_conn* conn;
+};
+
+enum { SERVE_LISTEN, SERVE_DONE, SERVE_SOCK, SERVE_OUT, SERVE_ERR };
+
+struct serve_conn {
+  int sock;
+  int out_r, out_w;     //the running command's stdout
+  int err_r, err_w;     //and its stderr, written through err_file
+  FILE* err_file;
+  int dirfd;
+  struct strbuf cwd;
+  struct strbuf in;     //read from the socket, not yet a whole request
+  struct strbuf req;    //the request being run
+  struct strbuf outq;   //frames waiting for the socket
+  size_t sent;
+  struct serve_watch watch[3];
+  uint32_t sock_events;
+  bool pipes_on;
+  bool busy;            //a worker has it
+  bool eof;             //the client has sent everything it will
+  bool dead;            //the socket is gone, output is dropped
+  bool exiting;         //exit ran, close once the response is out
+  bool closed;          //freed after this round of events
+  int status;
+  struct serve_conn* next; //in the work queue or the done list
+};
+
+//the server: connections waiting for a worker, and ones a worker is done
+//with, which the epoll loop hears about through donefd. Closed ones are
+//only freed once the events already read for them have been passed over
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct serve_conn* queue;
+  struct serve_conn** queue_tail;
+  struct serve_conn* done;
+  struct serve_conn* closed;
+  int epfd, donefd, devnull;
+  struct serve_watch listen_watch, done_watch;
+} serve = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, &serve.queue,
+            NULL, NULL, -1, -1, -1, { SERVE_LISTEN, NULL }, { SERVE_DONE, NULL } };
+
+/*
+*@brief  adds, changes or removes what epoll watches an fd for
+*/
+static void serve_ctl(int op, int fd, uint32_t events, struct serve_watch* w)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = w };
+  if (epoll_ctl(serve.epfd, op, fd, &ev) < 0)
+    fprintf(err_out(), "myshell: --serve: epoll: %s\n", strerror(errno));
+}
+
+/*
+*@brief  writes a frame header: the type byte and a big endian length
+*/
+static void serve_header(char* at, char type, uint32_t len)
+{
+  at[0] = type;
+  at[1] = (char)(len >> 24);
+  at[2] = (char)(len >> 16);
+  at[3] = (char)(len >> 8);
+  at[4] = (char)len;
+}
+
+/*
+*@brief  closes everything a connection holds and frees it, taking its fds
+*        out of epoll first
+*/
+static void serve_free(struct serve_conn* c)
+{
+  //a spawn in progress can hold copies of these fds, which would keep
+  //them registered past close and hand their events to a freed c
+  if (c->watch[0].conn)
+  {
+    if (c->sock >= 0)
+      serve_ctl(EPOLL_CTL_DEL, c->sock, 0, NULL);
+    serve_ctl(EPOLL_CTL_DEL, c->out_r, 0, NULL);
+    serve_ctl(EPOLL_CTL_DEL, c->err_r, 0, NULL);
+  }
+  int fds[] = { c->sock, c->out_r, c->out_w, c->err_r, c->dirfd };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  if (c->err_file)
+    fclose(c->err_file);
+  else if (c->err_w >= 0)
+    close(c->err_w);
+  free(c->cwd.data);
+  free(c->in.data);
+  free(c->req.data);
+  free(c->outq.data);
+  free(c);
+}
+
+/*
+*@brief  sets up an accepted connection in the directory the server
+*        started in
+*@return the connection, or NULL on error (reported, sock is closed)
+*/
+static struct serve_conn* serve_conn_new(int sock, const char* cwd)
+{
+  struct serve_conn* c = calloc(1, sizeof(*c));
+  if (!c)
+  {
+    fprintf(err_out(), "myshell: --serve: %s\n", strerror(ENOMEM));
+    close(sock);
+    return NULL;
+  }
+  c->sock = sock;
+  c->out_r = c->out_w = c->err_r = c->err_w = c->dirfd = -1;
+
+  int outp[2], errp[2];
+  bool ok = pipe2(outp, O_CLOEXEC) == 0;
+  if (ok)
+  {
+    c->out_r = outp[0];
+    c->out_w = outp[1];
+    ok = pipe2(errp, O_CLOEXEC) == 0;
+  }
+  if (ok)
+  {
+    c->err_r = errp[0];
+    c->err_w = errp[1];
+    c->err_file = fdopen(c->err_w, "w");
+    if (c->err_file)
+      setvbuf(c->err_file, NULL, _IOLBF, 0);
+    c->dirfd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    ok = c->err_file && c->dirfd >= 0 &&
+         fcntl(c->out_r, F_SETFL, O_NONBLOCK) == 0 &&
+         fcntl(c->err_r, F_SETFL, O_NONBLOCK) == 0;
+  }
+  sb_str(&c->cwd, cwd);
+  if (!ok || c->cwd.failed)
+  {
+    fprintf(err_out(), "myshell: --serve: %s\n", strerror(ok ? ENOMEM : errno));
+    serve_free(c);
+    return NULL;
+  }
+
+  c->watch[0] = (struct serve_watch){ SERVE_SOCK, c };
+  c->watch[1] = (struct serve_watch){ SERVE_OUT, c };
+  c->watch[2] = (struct serve_watch){ SERVE_ERR, c };
+  c->sock_events = EPOLLIN;
+  serve_ctl(EPOLL_CTL_ADD, c->sock, c->sock_events, &c->watch[0]);
+  serve_ctl(EPOLL_CTL_ADD, c->out_r, 0, &c->watch[1]);
+  serve_ctl(EPOLL_CTL_ADD, c->err_r, 0, &c->watch[2]);
+  return c;
+}
+
+/*
+*@brief  drops the socket of a connection that can't be written to. A
+*        worker may still have it, so the rest stays until it is done
+*/
+static void serve_kill(struct serve_conn* c)
+{
+  if (c->dead)
+    return;
+  c->dead = true;
+  serve_ctl(EPOLL_CTL_DEL, c->sock, 0, NULL);
+  close(c->sock);
+  c->sock = -1;
+  c->outq.len = c->sent = 0;
+}
+
+/*
+*@brief  sends as much of outq as the socket takes without blocking
+*/
+static void serve_flush(struct serve_conn* c)
+{
+  while (!c->dead && c->sent < c->outq.len)
+  {
+    ssize_t n = send(c->sock, c->outq.data + c->sent, c->outq.len - c->sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        serve_kill(c);
+      break;
+    }
+    c->sent += (size_t)n;
+  }
+
+  if (c->sent == c->outq.len)
+    c->outq.len = c->sent = 0;
+  else if (c->sent >= SERVE_QUEUE_MAX)
+  {
+    memmove(c->outq.data, c->outq.data + c->sent, c->outq.len - c->sent);
+    c->outq.len -= c->sent;
+    c->sent = 0;
+  }
+}
+
+/*
+*@brief  moves what one of the pipes has into outq as a frame
+*@return bytes read, 0 if there was nothing, -1 on error
+*/
+static ssize_t serve_pipe(struct serve_conn* c, int fd, char type)
+{
+  //with the client gone it is read only so the command isn't stuck
+  char scratch[4096];
+  char* frame = scratch;
+  size_t room = sizeof(scratch) - 5;
+  if (!c->dead)
+  {
+    if (sb_reserve(&c->outq, 5 + SERVE_READ_SIZE) < 0)
+      return -1;
+    frame = c->outq.data + c->outq.len;
+    room = SERVE_READ_SIZE;
+  }
+  ssize_t n = read(fd, frame + 5, room);
+  if (n <= 0)
+    return n < 0 && errno != EAGAIN && errno != EINTR ? -1 : 0;
+  if (!c->dead)
+  {
+    serve_header(frame, type, (uint32_t)n);
+    c->outq.len += 5 + (size_t)n;
+  }
+  return n;
+}
+
+/*
+*@brief  watches the socket and the pipes for what can be done next: the
+*        pipes only while a command runs and the client keeps up with its
+*        output, the socket for requests only between them
+*/
+static void serve_update(struct serve_conn* c)
+{
+  size_t pending = c->outq.len - c->sent;
+  bool pipes = c->busy && (c->dead || pending < SERVE_QUEUE_MAX);
+  if (pipes != c->pipes_on)
+  {
+    serve_ctl(EPOLL_CTL_MOD, c->out_r, pipes ? EPOLLIN : 0, &c->watch[1]);
+    serve_ctl(EPOLL_CTL_MOD, c->err_r, pipes ? EPOLLIN : 0, &c->watch[2]);
+    c->pipes_on = pipes;
+  }
+
+  uint32_t events = (pending ? EPOLLOUT : 0) | (!c->busy && !c->eof ? EPOLLIN : 0);
+  if (!c->dead && events != c->sock_events)
+  {
+    serve_ctl(EPOLL_CTL_MOD, c->sock, events, &c->watch[0]);
+    c->sock_events = events;
+  }
+}
+
+/*
+*@brief  hands the next whole request to a worker, or closes the
+*        connection once there will be none and the responses are out
+*/
+static void serve_next(struct serve_conn* c)
+{
+  if (c->busy)
+  {
+    serve_update(c);
+    return;
+  }
+
+  if (!c->dead && !c->exiting && c->in.len >= 4)
+  {
+    const unsigned char* p = (const unsigned char*)c->in.data;
+    size_t n = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+    if (n > SERVE_REQUEST_MAX)
+      serve_kill(c);
+    else if (c->in.len >= 4 + n)
+    {
+      //execute_command, like the main loop, is given a whole line
+      c->req.len = 0;
+      sb_write(&c->req, c->in.data + 4, n);
+      if (n == 0 || c->in.data[4 + n - 1] != '\n')
+        sb_write(&c->req, "\n", 1);
+      memmove(c->in.data, c->in.data + 4 + n, c->in.len - 4 - n);
+      c->in.len -= 4 + n;
+      if (c->req.failed)
+        serve_kill(c);
+      else
+      {
+        c->busy = true;
+        c->next = NULL;
+        pthread_mutex_lock(&serve.lock);
+        *serve.queue_tail = c;
+        serve.queue_tail = &c->next;
+        pthread_cond_signal(&serve.ready);
+        pthread_mutex_unlock(&serve.lock);
+        serve_update(c);
+        return;
+      }
+    }
+  }
+
+  if (c->dead || ((c->eof || c->exiting) && c->sent == c->outq.len))
+  {
+    c->closed = true;
+    c->next = serve.closed;
+    serve.closed = c;
+  }
+  else
+    serve_update(c);
+}
+
+/*
+*@brief  takes what the client sent
+*/
+static void serve_read(struct serve_conn* c)
+{
+  if (sb_reserve(&c->in, SERVE_READ_SIZE) < 0)
+  {
+    serve_kill(c);
+    return;
+  }
+  ssize_t n = read(c->sock, c->in.data + c->in.len, SERVE_READ_SIZE);
+  if (n < 0 && errno != EAGAIN && errno != EINTR)
+    serve_kill(c);
+  else if (n == 0)
+    c->eof = true;
+  else if (n > 0)
+    c->in.len += (size_t)n;
+}
+
+/*
+*@brief  after a command ran: the last of its output, then the frame with
+*        its status, which ends the response
+*/
+static void serve_finish(struct serve_conn* c)
+{
+  while (serve_pipe(c, c->out_r, 'o') > 0)
+    ;
+  while (serve_pipe(c, c->err_r, 'e') > 0)
+    ;
+  c->busy = false;
+  if (!c->dead && sb_reserve(&c->outq, 9) < 0)
+    serve_kill(c);
+  if (!c->dead)
+  {
+    char* frame = c->outq.data + c->outq.len;
+    serve_header(frame, 'x', 4);
+    uint32_t status = (uint32_t)c->status;
+    frame[5] = (char)(status >> 24);
+    frame[6] = (char)(status >> 16);
+    frame[7] = (char)(status >> 8);
+    frame[8] = (char)status;
+    c->outq.len += 9;
+  }
+  serve_flush(c);
+  serve_next(c);
+}
+
+/*
+*@brief  after a command: keeps the directory it left the worker in for
+*        the connection's next one. Only cd moves, so mostly nothing to do
+*/
+static void serve_keep_cwd(struct serve_conn* c)
+{
+  const char* now = cwd_get(false);
+  if (!now || (strlen(now) == c->cwd.len && memcmp(now, c->cwd.data, c->cwd.len) == 0))
+    return;
+  int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  close(c->dirfd);
+  c->dirfd = fd;
+  c->cwd.len = 0;
+  c->cwd.failed = false;
+  sb_str(&c->cwd, now);
+}
+
+/*
+*@brief  one worker: runs a request at a time, in the connection's
+*        directory and with its pipes as stdout and stderr. The worker has
+*        a current directory of its own (unshare), so workers in different
+*        directories don't get in each other's way, and neither do the
+*        pipeline threads and programs they start
+*/
+static void* serve_worker(void* arg)
+{
+  (void)arg;
+  struct outbuf* o = out_alloc();
+  if (!o || unshare(CLONE_FS) < 0)
+  {
+    fprintf(err_out(), "myshell: --serve: %s\n", strerror(o ? errno : ENOMEM));
+    exit(EXIT_FAILURE);
+  }
+  serving = true;
+  struct arena arena = { NULL, NULL };
+  struct exec_ctx own = { o, serve.devnull, NULL, STDERR_FILENO, &arena };
+  ctx = &own;
+
+  while (true)
+  {
+    pthread_mutex_lock(&serve.lock);
+    while (!serve.queue)
+      pthread_cond_wait(&serve.ready, &serve.lock);
+    struct serve_conn* c = serve.queue;
+    serve.queue = c->next;
+    if (!serve.queue)
+      serve.queue_tail = &serve.queue;
+    pthread_mutex_unlock(&serve.lock);
+
+    out_init(o, c->out_w);
+    own.err_stream = c->err_file;
+    own.err_fd = c->err_w;
+    serve_exit = false;
+    c->status = -1;
+    if (fchdir(c->dirfd) < 0)
+      fprintf(err_out(), "myshell: cd: %s\n", strerror(errno));
+    else
+    {
+      cwd_set(c->cwd.data, c->cwd.len);
+      c->status = execute_command(c->req.data, c->req.len);
+      serve_keep_cwd(c);
+    }
+    out_flush(o);
+    fflush(c->err_file);
+    own.err_stream = NULL;
+    own.err_fd = STDERR_FILENO;
+    c->exiting = serve_exit;
+
+    pthread_mutex_lock(&serve.lock);
+    c->next = serve.done;
+    serve.done = c;
+    pthread_mutex_unlock(&serve.lock);
+    uint64_t one = 1;
+    write_all(serve.donefd, (const char*)&one, sizeof(one));
+  }
+  return NULL;
+}
+
+/*
+*@brief  opens the listening socket at path, replacing a stale socket
+*        left there by an earlier server
+*@return the socket, or -1 on error (reported)
+*/
+static int serve_listen(const char* path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(err_out(), "myshell: --serve: %s: %s\n", path, strerror(ENAMETOOLONG));
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SERVE_BACKLOG) < 0)
+  {
+    fprintf(err_out(), "myshell: --serve: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+*@brief  runs the shell as a server on a unix socket. A request is a
+*        4 byte big endian length and a command line; the response is
+*        frames of a type byte, a 4 byte big endian length and that many
+*        bytes: 'o' for stdout, 'e' for stderr, and last 'x' with the
+*        command's status as 4 big endian bytes. One thread watches every
+*        socket and pipe with epoll; the commands run on workers threads
+*@return EXIT_FAILURE if the server couldn't start, otherwise it doesn't
+*/
+static int serve_run(const char* path, int workers)
+{
+  const char* cwd = cwd_get(false);
+  int lfd = serve_listen(path);
+  if (lfd < 0)
+    return EXIT_FAILURE;
+
+  serve.epfd = epoll_create1(EPOLL_CLOEXEC);
+  serve.donefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  serve.devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (!cwd || serve.epfd < 0 || serve.donefd < 0 || serve.devnull < 0)
+  {
+    fprintf(err_out(), "myshell: --serve: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  serve_ctl(EPOLL_CTL_ADD, lfd, EPOLLIN, &serve.listen_watch);
+  serve_ctl(EPOLL_CTL_ADD, serve.donefd, EPOLLIN, &serve.done_watch);
+
+  //built now, before the workers could race to do it
+  find_command("cd");
+  for (int i = 0; i < workers; i++)
+  {
+    pthread_t t;
+    int err = pthread_create(&t, NULL, serve_worker, NULL);
+    if (err)
+    {
+      fprintf(err_out(), "myshell: --serve: %s\n", strerror(err));
+      return EXIT_FAILURE;
+    }
+    pthread_detach(t);
+  }
+
+  struct epoll_event events[64];
+  while (true)
+  {
+    int n = epoll_wait(serve.epfd, events, 64, -1);
+    if (n < 0 && errno != EINTR)
+    {
+      fprintf(err_out(), "myshell: --serve: epoll: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+      struct serve_watch* w = events[i].data.ptr;
+      struct serve_conn* c = w->conn;
+      uint32_t ev = events[i].events;
+
+      if (c && c->closed)
+        continue;
+      if (w->kind == SERVE_LISTEN)
+      {
+        int sock;
+        while ((sock = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+          serve_conn_new(sock, cwd);
+      }
+      else if (w->kind == SERVE_DONE)
+      {
+        uint64_t count;
+        if (read(serve.donefd, &count, sizeof(count)) < 0)
+          continue;
+        pthread_mutex_lock(&serve.lock);
+        struct serve_conn* done = serve.done;
+        serve.done = NULL;
+        pthread_mutex_unlock(&serve.lock);
+        while (done)
+        {
+          struct serve_conn* next = done->next;
+          serve_finish(done);
+          done = next;
+        }
+      }
+      else if (w->kind == SERVE_SOCK)
+      {
+        if (ev & (EPOLLHUP | EPOLLERR))
+          serve_kill(c);
+        else
+        {
+          if (ev & EPOLLIN)
+            serve_read(c);
+          if (ev & EPOLLOUT)
+            serve_flush(c);
+        }
+        serve_next(c);
+      }
+      else
+      {
+        if (serve_pipe(c, w->kind == SERVE_OUT ? c->out_r : c->err_r,
+                       w->kind == SERVE_OUT ? 'o' : 'e') < 0)
+          serve_kill(c);
+        serve_flush(c);
+        serve_update(c);
+      }
+    }
+
+    while (serve.closed)
+    {
+      struct serve_conn* next = serve.closed->next;
+      serve_free(serve.closed);
+      serve.closed = next;
+    }
+  }
 }